@@ -13,26 +13,76 @@
  * Build (Linux/Debian/Ubuntu):
  *   sudo apt-get install libsdl2-dev libsdl2-ttf-dev
  *   gcc -O2 -Wall -Wextra -std=c11 iceburger_tetris.c -lSDL2 -lSDL2_ttf -o iceburger
+ *   (add -DHAVE_FONTCONFIG ... -lfontconfig to find fonts through fontconfig; the makefile does when it can)
  *
  * Run:
  *   ./tetris
+ *   ./tetris --statedb states.db      # also record every position into an on-disk state index
+ *   ./tetris --record replays/        # save every game as a replay; --verify FILE... re-checks them
+ *   ./tetris --players 2              # local versus: cleared lines send garbage to the next player
+ *   ./tetris --players 2 --bot        # ... against the placement bot (-march=native enables its AVX2 kernel)
+ *   ./tetris --royale-server 7000 & ./tetris --royale-bots 127.0.0.1:7000 98 & ./tetris --royale 127.0.0.1:7000   # 99-player royale
+ *   ./tetris --spectate 9300          # stream the board to browser overlays at ws://127.0.0.1:9300/
+ *   ./tetris --print-config > tetris.conf   # then edit: gravity, delays, colors, fonts, window, fx.bloom glow (read at startup)
+ *   (any unknown option prints the full list)
  *
  * Controls:
- *   ←/→ move, ↓ soft drop, ↑ rotate CW, Z rotate CCW, Space hard drop, C hold, P pause, R restart, Esc quit
+ *   ←/→ move, ↓ soft drop, ↑ rotate CW, Z rotate CCW, Space hard drop, C hold, P pause, R restart, M music, T theme, Esc quit
+ *   Versus: P1 A/D move, S soft, W hard drop, E/Q rotate, LShift hold; P2 arrows (↑ hard drop), ./, rotate, RShift hold
+ *   Gamepad: d-pad/left stick move and soft drop, d-pad up hard drop, A/Y rotate CW, B/X CCW, shoulders hold, Start pause
+ *   F9 rewind: ←/→ step a tick, [/] step a second, F5 dump that moment as a replay, F9 back to live
  *
  * Notes:
- * - Uses SDL2 for rendering and SDL_ttf to draw emoji/text. If your system font lacks color emoji, tiles fall back to colored squares.
- * - Particle system is simple + efficient; feel free to tweak constants.
+ * - Uses SDL2 for rendering and SDL_ttf to draw emoji/text. If no installed font has the tile emoji, tiles fall back to colored squares.
+ * - Particle system is simple + efficient; its budget and burst sizes are in the settings file.
  */
 
+// POSIX bits (mmap, ftruncate) are hidden by -std=c11 unless asked for
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
 #include <SDL.h>
 #include <SDL_ttf.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef HAVE_FONTCONFIG
+#include <fontconfig/fontconfig.h>
+#endif
+// x86 builds carry the AVX2 kernels whatever the baseline (target
+// attributes) and switch to them at startup when the CPU has it (simd_init).
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #define COLS 10
 #define ROWS 20
@@ -41,34 +91,58 @@
 #define PREVIEW_W 6
 #define PREVIEW_H 6
 
+// Defaults for the settings file (see Settings)
 #define START_SPEED_MS 900
 #define SPEED_STEP_MS 70
 #define MIN_SPEED_MS 90
 
-#define MAX_PARTICLES 4096
+#define MAX_PARTICLES 4096 // pool storage per board; fx.particles budgets under it
+
+// Fixed simulation step: inputs, gravity and checksums all run per tick
+#define SIM_HZ 250
+#define TICK_US (1000000/SIM_HZ)
+
+// Interactive line-clear and spawn delays, in ticks (headless games use 0)
+#define CLEAR_TICKS 60
+#define ARE_TICKS 0
 
 // Utility min/max
 static int imax(int a, int b){return a>b?a:b;}
 static int imin(int a, int b){return a<b?a:b;}
 
-// RNG
-static float frandf(){return (float)rand()/(float)RAND_MAX;}
-
-// Colors
-static SDL_Color col_bg = {20, 24, 28, 255};
-static SDL_Color col_grid = {36, 42, 48, 255};
-static SDL_Color col_text = {235, 235, 235, 255};
-
-// Per-piece tint
-static SDL_Color col_piece[7] = {
-  {45, 212, 191, 255}, // I
-  {250, 204, 21, 255}, // O
-  {192, 132, 252, 255}, // T
-  {74, 222, 128, 255}, // S
-  {251, 113, 133, 255}, // Z
-  {96, 165, 250, 255}, // J
-  {245, 158, 11, 255}  // L
-};
+// Per-piece tint (plus grey for garbage rows)
+#define TINT_GARBAGE 7
+#define GRAVITY_LEVELS 64 // levels past the table fall back to the formula (see gravity_for)
+
+// Settings: every tunable, read once at startup from a key = value file (see
+// settings_load), validated and then never written again - bar a replay's
+// gravity, set before any thread starts; everything reads it through cfg,
+// threads included. Tables derived from it are built at the
+// same time so hot paths index arrays rather than recomputing.
+typedef struct {
+  int start_speed_ms, speed_step_ms, min_speed_ms;
+  int clear_ticks, are_ticks;
+  int particles, burst_min, burst_range, bloom; // bloom: glow strength in percent, 0 = off
+  int pad_das_ms, pad_arr_ms, pad_deadzone;
+  int audio_buffer;
+  int win_w, win_h, win_max_w;
+  char emoji_font[256], ui_font[256]; int ui_font_size;
+  SDL_Color col_bg, col_grid, col_text, col_piece[8];
+  // derived
+  int gravity_ms[GRAVITY_LEVELS]; // fall interval per level
+  int burst_cap;                  // particles per burst, so four bursts always fit
+  Uint64 pad_das_us, pad_arr_us;
+} Settings;
+
+static Settings settings_rw;                       // written by settings_load and settings_gravity only
+static const Settings *const cfg = &settings_rw;
+
+// Gravity is part of the rules, so a replay brings the gravity it was
+// recorded under; playback sets it before any other thread starts.
+static void settings_gravity(Settings *s, int start_ms, int step_ms, int min_ms){
+  s->start_speed_ms = start_ms; s->speed_step_ms = step_ms; s->min_speed_ms = min_ms;
+  for(int l=0;l<GRAVITY_LEVELS;l++) s->gravity_ms[l] = imax(min_ms, start_ms - l*step_ms);
+}
 
 // Emoji strings
 static const char *EMOJI_ICE = "🍦"; // UTF-8
@@ -89,15 +163,30 @@ typedef struct {
 
 // Particle
 typedef struct {
-  bool alive;
-  float x,y,vx,vy; // in pixels
+  float x,y,vx,vy; // in pixels, relative to the board
   float life, maxlife;
   SDL_Color c;
 } Particle;
 
+// Garbage waiting to rise into a board (versus): one attack, one hole column.
+typedef struct { Uint8 lines, hole; } Garbage;
+#define GARBAGE_QUEUE 16
+#define GARBAGE_PER_LOCK 8 // most rows that rise after a single piece locks
+
+// Engine phases. Line-clear and spawn (ARE) delays are ticks the game sits in
+// a phase with no piece in play; a game whose delays are 0 never leaves FALL.
+enum { PHASE_FALL, PHASE_CLEAR, PHASE_ARE };
+
+// Timed modes end the game themselves: sprint on the lock that reaches
+// SPRINT_LINES, ultra when the sim clock reaches ULTRA_TICKS.
+enum { MODE_MARATHON, MODE_SPRINT, MODE_ULTRA };
+#define SPRINT_LINES 40
+#define ULTRA_TICKS (120*SIM_HZ)
+
 // Game state
 typedef struct {
-  Cell board[ROWS][COLS];
+  Cell board[ROWS][COLS]; // storage only: index through row[] (see CELL)
+  Uint8 row[ROWS];        // logical row -> board row; clears and garbage rotate this, not cells
   Piece cur, next, hold;
   bool has_hold;
   bool can_hold;
@@ -106,9 +195,28 @@ typedef struct {
   int lines;
   int level;
   int fall_ms;
-  Uint32 fall_accum; // ms accumulator
+  Uint32 fall_accum; // us accumulator, advanced TICK_US per tick
+  int pieces;        // pieces spawned so far (bumps on every spawn)
+  Uint32 tick;       // simulation ticks since reset
+  Uint32 seed;       // seed the game was reset with
+  Uint32 rng;        // randomizer state; all gameplay randomness comes from here
+  Uint8 phase, phase_left;      // PHASE_*, ticks until it ends
+  Uint8 clear_ticks, are_ticks; // delays this game runs with (0 = instant; headless default)
+  Uint8 mode;                   // MODE_*
+  Uint8 bag;                    // 7-bag randomizer: each run of 7 draws deals every shape once
+  // Outputs for whoever drives the game; not part of the simulated state.
+  Uint8 fx_clears[ROWS]; // line clears per row since the renderer last looked
+  int attack;            // garbage lines earned and not yet sent (versus)
+  // Versus only; checksummed whenever non-empty.
+  Garbage garbage[GARBAGE_QUEUE]; int ngarbage; // incoming, oldest first
+  const Uint8 *deal; int deal_bag; // searches only: bag deal_bag's kinds, dealt in place of the seed's
 } Game;
 
+#define CELL(g, r, c) ((g)->board[(g)->row[r]][c])
+
+// Player actions, applied at tick boundaries
+enum { ACT_LEFT, ACT_RIGHT, ACT_SOFT, ACT_HARD, ACT_CW, ACT_CCW, ACT_HOLD, ACT_COUNT };
+
 // Shapes
 static const unsigned char SHAPES[7][4][4] = {
   // I
@@ -127,13 +235,13 @@ static const unsigned char SHAPES[7][4][4] = {
   {{0,0,1,0},{1,1,1,0},{0,0,0,0},{0,0,0,0}},
 };
 
-static void piece_from_k(Piece *p, int k){
+static void piece_from_k(Piece *p, int k, int type){
   memset(p,0,sizeof(*p));
   p->k = k;
   p->w = 4; p->h = 4;
   for(int r=0;r<4;r++)for(int c=0;c<4;c++) p->m[r][c]=SHAPES[k][r][c];
   p->x = COLS/2 - 2; p->y = 0;
-  p->type = (rand()%2);
+  p->type = type;
   p->tint = k;
 }
 
@@ -155,7 +263,7 @@ static bool collide(const Game *g, const Piece *p, int nx, int ny){
       int x = nx + c;
       int y = ny + r;
       if(x<0||x>=COLS||y<0||y>=ROWS) return true;
-      if(g->board[y][x].filled) return true;
+      if(CELL(g,y,x).filled) return true;
     }
   }
   return false;
@@ -167,86 +275,217 @@ static void lock_piece(Game *g){
       if(!g->cur.m[r][c]) continue;
       int x=g->cur.x+c, y=g->cur.y+r;
       if(y>=0 && y<ROWS && x>=0 && x<COLS){
-        g->board[y][x].filled=true;
-        g->board[y][x].type=g->cur.type;
-        g->board[y][x].tint=g->cur.tint;
+        CELL(g,y,x) = (Cell){ true, g->cur.type, g->cur.tint };
       }
     }
   }
 }
 
-// Particle system
-static Particle particles[MAX_PARTICLES];
-static void particles_reset(){ memset(particles,0,sizeof particles); }
-static void spawn_explosion(int cx, int cy, SDL_Color base){
-  // cx,cy in pixels centre where line cleared
-  int count = 120 + rand()%80;
-  for(int i=0;i<count;i++){
-    for(int j=0;j<MAX_PARTICLES;j++) if(!particles[j].alive){
-      particles[j].alive=true;
-      particles[j].x=cx+(frandf()-0.5f)*TILE*COLS*0.1f;
-      particles[j].y=cy+(frandf()-0.5f)*TILE*2;
-      float ang = frandf()*6.28318f;
-      float spd = 100.0f + frandf()*300.0f;
-      particles[j].vx=cosf(ang)*spd;
-      particles[j].vy=sinf(ang)*spd - (50.0f+frandf()*100.0f);
-      particles[j].life=0.0f;
-      particles[j].maxlife=0.6f+frandf()*0.6f;
-      SDL_Color c = base;
-      int d = (int)(frandf()*40.0f);
-      c.r = (Uint8)imax(0, imin(255, c.r + d - 20));
-      c.g = (Uint8)imax(0, imin(255, c.g + d - 20));
-      c.b = (Uint8)imax(0, imin(255, c.b + d - 20));
-      particles[j].c=c;
-      break;
-    }
+// Particle system, one pool per board. Live particles stay packed at the
+// front, so updating and drawing cost what is on screen rather than the pool.
+typedef struct { Particle p[MAX_PARTICLES]; int live; Uint32 rng; } FxPool;
+
+static void fx_reset(FxPool *fx, Uint32 seed){ fx->live = 0; fx->rng = seed ? seed : 0x9E3779B9u; }
+
+// Cosmetic randomness: its own xorshift, never the game's.
+static float fx_rand(FxPool *fx){
+  Uint32 x = fx->rng;
+  x ^= x<<13; x ^= x>>17; x ^= x<<5;
+  fx->rng = x;
+  return (float)(x>>8) * (1.0f/16777216.0f);
+}
+
+static void fx_explosion(FxPool *fx, float cx, float cy, SDL_Color base){
+  // cx,cy in board pixels, centre of the cleared line
+  int count = imin(cfg->burst_cap, cfg->burst_min + (int)(fx_rand(fx)*(float)cfg->burst_range));
+  for(int i=0;i<count && fx->live<cfg->particles;i++){
+    Particle *p = &fx->p[fx->live++];
+    p->x=cx+(fx_rand(fx)-0.5f)*TILE*COLS*0.1f;
+    p->y=cy+(fx_rand(fx)-0.5f)*TILE*2;
+    float ang = fx_rand(fx)*6.28318f;
+    float spd = 100.0f + fx_rand(fx)*300.0f;
+    p->vx=cosf(ang)*spd;
+    p->vy=sinf(ang)*spd - (50.0f+fx_rand(fx)*100.0f);
+    p->life=0.0f;
+    p->maxlife=0.6f+fx_rand(fx)*0.6f;
+    SDL_Color c = base;
+    int d = (int)(fx_rand(fx)*40.0f);
+    c.r = (Uint8)imax(0, imin(255, c.r + d - 20));
+    c.g = (Uint8)imax(0, imin(255, c.g + d - 20));
+    c.b = (Uint8)imax(0, imin(255, c.b + d - 20));
+    p->c=c;
+  }
+}
+
+// Turns the line clears the game recorded into explosions.
+static void fx_from_game(FxPool *fx, Game *g, SDL_Color base){
+  for(int r=0;r<ROWS;r++){
+    for(int k=0;k<g->fx_clears[r];k++) fx_explosion(fx, TILE*COLS/2, TILE*(r+0.5f), base);
+    g->fx_clears[r] = 0;
   }
 }
-static void particles_update(float dt){
-  for(int i=0;i<MAX_PARTICLES;i++) if(particles[i].alive){
-    particles[i].life += dt;
-    if(particles[i].life >= particles[i].maxlife){ particles[i].alive=false; continue; }
+
+// Returns how many are still alive.
+static int fx_update(FxPool *fx, float dt){
+  for(int i=0;i<fx->live;){
+    Particle *p = &fx->p[i];
+    p->life += dt;
+    if(p->life >= p->maxlife){ *p = fx->p[--fx->live]; continue; }
     // gravity + drag
-    particles[i].vy += 900.0f * dt;
-    particles[i].vx *= (1.0f - 0.8f*dt);
-    particles[i].x += particles[i].vx * dt;
-    particles[i].y += particles[i].vy * dt;
+    p->vy += 900.0f * dt;
+    p->vx *= (1.0f - 0.8f*dt);
+    p->x += p->vx * dt;
+    p->y += p->vy * dt;
+    i++;
+  }
+  return fx->live;
+}
+
+// Bit r set for every full row (logical index).
+static Uint32 full_rows(const Game *g){
+  Uint32 m = 0;
+  for(int r=0;r<ROWS;r++){
+    bool full=true; for(int c=0;c<COLS;c++) if(!CELL(g,r,c).filled){ full=false; break; }
+    if(full) m |= 1u<<r;
   }
+  return m;
+}
+
+static int popcount32(Uint32 m){ int n=0; for(; m; m &= m-1) n++; return n; }
+
+// Lines the game has earned, counting rows already full but still sitting out
+// the clear delay (timed modes stop and split on the lock, not the collapse).
+static int lines_credited(const Game *g){
+  return g->lines + (g->phase==PHASE_CLEAR ? popcount32(full_rows(g)) : 0);
 }
 
-static void clear_lines(Game *g){
+// Did a timed mode end the game (as opposed to topping out)?
+static bool game_finished(const Game *g){
+  return (g->mode==MODE_SPRINT && g->lines>=SPRINT_LINES) || (g->mode==MODE_ULTRA && g->tick>=ULTRA_TICKS);
+}
+
+// Fall interval for a level: the table settings built, or the same formula
+// past its end (deep levels keep speeding up until they reach the minimum).
+static int gravity_for(int level){
+  return level<GRAVITY_LEVELS ? cfg->gravity_ms[level] : imax(cfg->min_speed_ms, cfg->start_speed_ms - level*cfg->speed_step_ms);
+}
+
+// Returns how many lines went.
+static int clear_lines(Game *g){
   int cleared = 0;
   for(int r=ROWS-1;r>=0;r--){
-    bool full=true; for(int c=0;c<COLS;c++) if(!g->board[r][c].filled){ full=false; break; }
+    bool full=true; for(int c=0;c<COLS;c++) if(!CELL(g,r,c).filled){ full=false; break; }
     if(full){
-      // explosion centre
-      int cx = TILE*COLS/2; int cy = TILE*(r+0.5f);
-      SDL_Color base = {255, 200, 120, 255};
-      spawn_explosion(cx, cy, base);
+      if(g->fx_clears[r]<255) g->fx_clears[r]++;
       cleared++;
-      // pull down
-      for(int rr=r; rr>0; rr--) memcpy(g->board[rr], g->board[rr-1], sizeof g->board[rr]);
-      memset(g->board[0], 0, sizeof g->board[0]);
+      // pull down: rows above shift one index, the cleared one comes back empty on top
+      Uint8 gone = g->row[r];
+      memmove(g->row+1, g->row, (size_t)r);
+      g->row[0] = gone;
+      memset(g->board[gone], 0, sizeof g->board[gone]);
       r++; // recheck same row after pull
     }
   }
   if(cleared){
     static const int score_tbl[5]={0,40,100,300,1200};
-    g->score += score_tbl[cleared]*(g->level+1);
+    g->score += score_tbl[imin(cleared,4)]*(g->level+1);
     g->lines += cleared;
     g->level = g->lines/10;
-    g->fall_ms = imax(MIN_SPEED_MS, START_SPEED_MS - g->level * SPEED_STEP_MS);
+    g->fall_ms = gravity_for(g->level);
+  }
+  return cleared;
+}
+
+// Garbage rises from the bottom, the mirror of the pull-down above: the top n
+// row slots are recycled as the new bottom rows. Anything in them tops out.
+static void push_garbage_rows(Game *g, int n, int hole){
+  Uint8 top[ROWS];
+  for(int r=0;r<n;r++) for(int c=0;c<COLS;c++) if(CELL(g,r,c).filled) g->game_over = true;
+  memcpy(top, g->row, (size_t)n);
+  memmove(g->row, g->row+n, (size_t)(ROWS-n));
+  memcpy(g->row+ROWS-n, top, (size_t)n);
+  for(int r=ROWS-n;r<ROWS;r++) for(int c=0;c<COLS;c++)
+    CELL(g,r,c) = c==hole ? (Cell){ false, 0, 0 } : (Cell){ true, 1, TINT_GARBAGE };
+}
+
+static void game_queue_garbage(Game *g, int lines, int hole){
+  if(g->game_over || lines<=0) return;
+  if(g->ngarbage==GARBAGE_QUEUE){ // full: fold into the newest attack
+    Garbage *last = &g->garbage[GARBAGE_QUEUE-1];
+    last->lines = (Uint8)imin(255, last->lines + lines);
+    return;
+  }
+  g->garbage[g->ngarbage++] = (Garbage){ (Uint8)imin(255, lines), (Uint8)hole };
+}
+
+static int garbage_queued(const Game *g){
+  int n = 0; for(int i=0;i<g->ngarbage;i++) n += g->garbage[i].lines;
+  return n;
+}
+
+// Outgoing attack cancels queued garbage first, oldest attack first.
+// Returns what's left to send.
+static int garbage_cancel(Game *g, int attack){
+  while(attack && g->ngarbage){
+    Garbage *q = &g->garbage[0];
+    int n = imin(attack, q->lines);
+    q->lines = (Uint8)(q->lines - n); attack -= n;
+    if(!q->lines) memmove(g->garbage, g->garbage+1, sizeof g->garbage[0]*(size_t)--g->ngarbage);
+  }
+  return attack;
+}
+
+static void garbage_rise(Game *g){
+  int budget = GARBAGE_PER_LOCK;
+  while(g->ngarbage && budget && !g->game_over){
+    Garbage *q = &g->garbage[0];
+    int n = imin(q->lines, budget);
+    push_garbage_rows(g, n, q->hole);
+    q->lines = (Uint8)(q->lines - n); budget -= n;
+    if(!q->lines) memmove(g->garbage, g->garbage+1, sizeof g->garbage[0]*(size_t)--g->ngarbage);
+  }
+}
+
+// xorshift32: tiny, and its whole state lives in Game so replays and peers agree
+static Uint32 game_rand(Game *g){
+  Uint32 x = g->rng;
+  x ^= x<<13; x ^= x>>17; x ^= x<<5;
+  return g->rng = x;
+}
+
+// The 7-bag deals draw n from bag n/7, a shuffle keyed by the seed and the bag
+// number alone - no state beyond the draw count (pieces+2: cur and next were
+// dealt at reset) - so snapshots need only the flag.
+static int bag_kind(Uint32 seed, int draw){
+  Uint32 x = seed ^ (Uint32)(draw/7)*0x9E3779B9u;
+  x ^= x>>16; x *= 0x85EBCA6Bu; x ^= x>>13; x *= 0xC2B2AE35u; x ^= x>>16; x |= 1;
+  Uint8 perm[7] = { 0,1,2,3,4,5,6 };
+  for(int i=6;i>0;i--){
+    x ^= x<<13; x ^= x>>17; x ^= x<<5;
+    int j = (int)(x%(Uint32)(i+1)); Uint8 tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
   }
+  return perm[draw%7];
+}
+
+// The 7-bag's draw n for this game: the seed's, unless a search fixed that bag.
+static int bag_deal(const Game *g, int draw){
+  return g->deal && draw/7==g->deal_bag ? g->deal[draw%7] : bag_kind(g->seed, draw);
 }
 
-static void new_bag_piece(Piece *p){ piece_from_k(p, rand()%7); }
+// Both randomizers draw twice from rng, so a game's stream is the same either way.
+static void new_bag_piece(Game *g, Piece *p, int draw){
+  int k = (int)(game_rand(g)%7);
+  if(g->bag) k = bag_deal(g, draw);
+  piece_from_k(p, k, (int)(game_rand(g)%2));
+}
 
 static void spawn_piece(Game *g){
   g->cur = g->next;
-  new_bag_piece(&g->next);
+  new_bag_piece(g, &g->next, g->pieces+2);
   g->cur.x = COLS/2 - 2; g->cur.y = 0;
   if(collide(g,&g->cur,g->cur.x,g->cur.y)) g->game_over=true;
   g->can_hold=true;
+  g->pieces++;
 }
 
 static void hold_piece(Game *g){
@@ -256,16 +495,40 @@ static void hold_piece(Game *g){
   g->can_hold=false;
 }
 
+// After the clear delay (if any): lines clear and become attack (after
+// cancelling queued garbage); a lock that clears nothing lets the queue rise
+// instead. Either way the next piece spawns onto the result - after the ARE
+// delay - so garbage that leaves it no room tops out.
+static void lock_resolve(Game *g){
+  static const int attack_tbl[5]={0,0,1,2,4};
+  int cleared = clear_lines(g);
+  if(g->mode==MODE_SPRINT && g->lines>=SPRINT_LINES){ g->game_over = true; return; }
+  if(cleared) g->attack += garbage_cancel(g, attack_tbl[imin(cleared,4)]);
+  else garbage_rise(g);
+  if(g->game_over) return;
+  if(g->are_ticks){ g->phase = PHASE_ARE; g->phase_left = g->are_ticks; }
+  else spawn_piece(g);
+}
+
+// The piece has landed: full rows sit out the clear delay first, unless they
+// finish a sprint (whose clock stops on this lock either way).
+static void piece_landed(Game *g){
+  lock_piece(g);
+  Uint32 full = g->clear_ticks ? full_rows(g) : 0;
+  if(full && !(g->mode==MODE_SPRINT && g->lines + popcount32(full) >= SPRINT_LINES)){
+    g->phase = PHASE_CLEAR; g->phase_left = g->clear_ticks; return;
+  }
+  lock_resolve(g);
+}
+
 static void hard_drop(Game *g){
   while(!collide(g,&g->cur,g->cur.x,g->cur.y+1)) g->cur.y++;
-  lock_piece(g);
-  clear_lines(g);
-  spawn_piece(g);
+  piece_landed(g);
 }
 
 static void soft_step(Game *g){
   if(!collide(g,&g->cur,g->cur.x,g->cur.y+1)) g->cur.y++;
-  else { lock_piece(g); clear_lines(g); spawn_piece(g); }
+  else piece_landed(g);
 }
 
 static void attempt_rotate(Game *g, bool cw){
@@ -274,185 +537,5546 @@ static void attempt_rotate(Game *g, bool cw){
   for(int i=0;i<5;i++) if(!collide(g,&t,t.x+kicks[i][0],t.y+kicks[i][1])){ t.x+=kicks[i][0]; t.y+=kicks[i][1]; g->cur=t; return; }
 }
 
-static void game_reset(Game *g){
+static void game_reset(Game *g, Uint32 seed){
   memset(g,0,sizeof *g);
-  g->fall_ms = START_SPEED_MS; g->level=0; g->lines=0; g->score=0; g->fall_accum=0;
-  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) g->board[r][c].filled=false;
-  new_bag_piece(&g->cur); new_bag_piece(&g->next);
+  g->seed = seed; g->rng = seed ? seed : 0x9E3779B9u; // xorshift must not start at 0
+  g->fall_ms = gravity_for(0); g->level=0; g->lines=0; g->score=0; g->fall_accum=0;
+  for(int r=0;r<ROWS;r++) g->row[r]=(Uint8)r;
+  new_bag_piece(g, &g->cur, 0); new_bag_piece(g, &g->next, 1);
   g->cur.x=COLS/2-2; g->cur.y=0;
   g->can_hold=true; g->has_hold=false; g->game_over=false;
-  particles_reset();
 }
 
-// Rendering helpers
-static void fill_rect(SDL_Renderer *ren, int x,int y,int w,int h, SDL_Color c){
-  SDL_SetRenderDrawColor(ren,c.r,c.g,c.b,c.a); SDL_Rect R={x,y,w,h}; SDL_RenderFillRect(ren,&R);
-}
-
-static void draw_text(SDL_Renderer *ren, TTF_Font *font, const char *txt, int x, int y, SDL_Color color){
-  if(!font||!txt||!*txt) return;
-  SDL_Surface *surf = TTF_RenderUTF8_Blended(font, txt, color);
-  if(!surf) return;
-  SDL_Texture *tex = SDL_CreateTextureFromSurface(ren, surf);
-  SDL_Rect dst = {x, y, surf->w, surf->h};
-  SDL_FreeSurface(surf);
-  SDL_RenderCopy(ren, tex, NULL, &dst);
-  SDL_DestroyTexture(tex);
-}
-
-static void draw_tile(SDL_Renderer *ren, TTF_Font *emoji_font, int px, int py, int type, SDL_Color tint){
-  // Background rounded-ish square
-  SDL_Color shadow = { (Uint8)(tint.r*0.6f), (Uint8)(tint.g*0.6f), (Uint8)(tint.b*0.6f), 255 };
-  fill_rect(ren, px+2, py+2, TILE-4, TILE-4, shadow);
-  fill_rect(ren, px, py, TILE-4, TILE-4, tint);
-  // Emoji overlay if possible
-  if(emoji_font){
-    const char *e = type==0?EMOJI_ICE:EMOJI_BURGER;
-    // Center
-    // Render a small text to fit tile
-    SDL_Surface *surf = TTF_RenderUTF8_Blended(emoji_font, e, (SDL_Color){255,255,255,255});
-    if(surf){
-      float scale = (float)(TILE-6) / (float)imax(1, imax(surf->w, surf->h));
-      int w = (int)(surf->w * scale); int h=(int)(surf->h * scale);
-      SDL_Texture *tex = SDL_CreateTextureFromSurface(ren, surf);
-      SDL_FreeSurface(surf);
-      SDL_Rect dst={px + (TILE-4-w)/2, py + (TILE-4-h)/2, w, h};
-      SDL_RenderCopy(ren, tex, NULL, &dst);
-      SDL_DestroyTexture(tex);
-    }
-  }
-}
-
-static void render_board(SDL_Renderer *ren, TTF_Font *emoji_font, const Game *g, int ox, int oy){
-  // grid bg
-  fill_rect(ren, ox-8, oy-8, COLS*TILE+16, ROWS*TILE+16, col_grid);
+// Switches a freshly reset game to the 7-bag: cur and next are re-dealt from
+// the first bag, keeping their types (the rng stream doesn't change).
+static void game_use_bag(Game *g){
+  g->bag = 1;
+  piece_from_k(&g->cur, bag_deal(g, 0), g->cur.type); piece_from_k(&g->next, bag_deal(g, 1), g->next.type);
+}
+
+static void game_apply(Game *g, int act){
+  if(g->game_over || g->phase) return; // no piece in play during clear/ARE
+  switch(act){
+    case ACT_LEFT:  if(!collide(g,&g->cur,g->cur.x-1,g->cur.y)) g->cur.x--; break;
+    case ACT_RIGHT: if(!collide(g,&g->cur,g->cur.x+1,g->cur.y)) g->cur.x++; break;
+    case ACT_SOFT:  soft_step(g); break;
+    case ACT_HARD:  hard_drop(g); break;
+    case ACT_CW:    attempt_rotate(g,true); break;
+    case ACT_CCW:   attempt_rotate(g,false); break;
+    case ACT_HOLD:  hold_piece(g); break;
+  }
+}
+
+// Ticks keep counting after game over so the final checkpoint gets its own tick.
+static void game_tick(Game *g){
+  g->tick++;
+  if(g->game_over) return;
+  if(g->mode==MODE_ULTRA && g->tick>=ULTRA_TICKS){ g->game_over = true; return; }
+  if(g->phase){
+    if(--g->phase_left) return;
+    int done = g->phase; g->phase = PHASE_FALL;
+    if(done==PHASE_CLEAR) lock_resolve(g); else spawn_piece(g);
+    return;
+  }
+  g->fall_accum += TICK_US;
+  Uint32 step = (Uint32)g->fall_ms*1000u;
+  while(g->fall_accum >= step){ g->fall_accum -= step; soft_step(g); }
+}
+
+// CRC32C (Castagnoli). Uses the SSE4.2 / ARMv8 CRC instructions when the build
+// targets them (e.g. -march=native), a slice-by-one table otherwise.
+static Uint32 crc32c_table[256];
+static void crc32c_init(){
+  for(Uint32 i=0;i<256;i++){
+    Uint32 c=i; for(int k=0;k<8;k++) c = (c>>1) ^ (0x82F63B78u & (0u-(c&1)));
+    crc32c_table[i]=c;
+  }
+}
+static Uint32 crc32c(Uint32 crc, const void *buf, size_t n){
+  const Uint8 *p = buf;
+  crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  for(;n>=8;n-=8,p+=8){ Uint64 v; memcpy(&v,p,8); crc = (Uint32)_mm_crc32_u64(crc, v); }
+  for(;n;n--) crc = _mm_crc32_u8(crc, *p++);
+#elif defined(__ARM_FEATURE_CRC32)
+  for(;n>=8;n-=8,p+=8){ Uint64 v; memcpy(&v,p,8); crc = __crc32cd(crc, v); }
+  for(;n;n--) crc = __crc32cb(crc, *p++);
+#else
+  for(;n;n--) crc = (crc>>8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+#endif
+  return ~crc;
+}
+
+static int piece_pack(const Piece *p, Uint8 *out){
+  Uint16 mask = 0;
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(p->m[r][c]) mask |= (Uint16)(1u<<(r*4+c));
+  out[0]=(Uint8)p->k; out[1]=(Uint8)p->x; out[2]=(Uint8)p->y; out[3]=(Uint8)p->type; out[4]=(Uint8)p->tint;
+  out[5]=(Uint8)mask; out[6]=(Uint8)(mask>>8);
+  return 7;
+}
+
+static void put_u32(Uint8 *b, Uint32 v){ b[0]=(Uint8)v; b[1]=(Uint8)(v>>8); b[2]=(Uint8)(v>>16); b[3]=(Uint8)(v>>24); }
+static Uint32 get_u32(const Uint8 *b){ return b[0] | (Uint32)b[1]<<8 | (Uint32)b[2]<<16 | (Uint32)b[3]<<24; }
+static void put_u16(Uint8 *b, Uint16 v){ b[0]=(Uint8)v; b[1]=(Uint8)(v>>8); }
+static int get_u16(const Uint8 *b){ return b[0] | b[1]<<8; }
+
+// Phase, delays, mode and randomizer in one word; 0 for instant marathon games
+// (and every snapshot older than delays).
+static Uint32 phase_word(const Game *g){
+  return (Uint32)g->phase | (Uint32)g->phase_left<<2 | (Uint32)g->clear_ticks<<10 | (Uint32)g->are_ticks<<18 | (Uint32)g->mode<<26 | (Uint32)g->bag<<28;
+}
+
+// Checksum of everything that feeds the simulation (not particles, which are cosmetic).
+static Uint32 game_checksum(const Game *g){
+  Uint8 b[ROWS*COLS + 64]; size_t n=0;
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++){
+    const Cell *x = &CELL(g,r,c);
+    b[n++] = x->filled ? (Uint8)(0x80 | x->type<<3 | x->tint) : 0;
+  }
+  n += piece_pack(&g->cur, b+n); n += piece_pack(&g->next, b+n);
+  if(g->has_hold) n += piece_pack(&g->hold, b+n);
+  b[n++] = (Uint8)(g->has_hold | g->can_hold<<1 | g->game_over<<2);
+  Uint32 w[] = { (Uint32)g->score, (Uint32)g->lines, (Uint32)g->level, (Uint32)g->fall_ms, g->fall_accum, g->tick, g->rng };
+  for(size_t i=0;i<sizeof w/sizeof w[0];i++){ put_u32(b+n, w[i]); n+=4; }
+  if(phase_word(g)){ put_u32(b+n, phase_word(g)); n+=4; } // absent for instant games, as before delays existed
+  Uint32 crc = crc32c(0, b, n);
+  return g->ngarbage ? crc32c(crc, (const Uint8*)g->garbage, sizeof g->garbage[0]*(size_t)g->ngarbage) : crc;
+}
+
+static void piece_unpack(Piece *p, const Uint8 *in){
+  Uint16 mask = (Uint16)(in[5] | in[6]<<8);
+  memset(p,0,sizeof *p);
+  p->k=in[0]; p->x=(Sint8)in[1]; p->y=(Sint8)in[2]; p->type=in[3]; p->tint=in[4]; p->w=4; p->h=4;
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++) p->m[r][c] = (mask>>(r*4+c))&1;
+}
+
+// Complete simulation state in a fixed-size, endian-neutral blob (snapshots,
+// replays starting mid-game). Fields that change every tick come first so
+// tick-to-tick deltas stay short. Cells are filled<<7 | type<<3 | tint. The
+// incoming garbage queue (count, then lines and hole per slot) comes last,
+// so blobs from before it was packed are a prefix (see snap_upgrade).
+#define SNAP_WORDS 10
+#define SNAP_TICK 4 // byte offset of the tick word
+#define SNAP_BYTES_V1 (SNAP_WORDS*4 + 1 + 3*7 + ROWS*COLS)
+#define SNAP_BYTES (SNAP_BYTES_V1 + 1 + 2*GARBAGE_QUEUE)
+
+static void game_pack(const Game *g, Uint8 *b){
+  Uint32 w[SNAP_WORDS] = { g->fall_accum, g->tick, (Uint32)g->score, (Uint32)g->lines, (Uint32)g->level,
+                           (Uint32)g->fall_ms, (Uint32)g->pieces, g->seed, g->rng, phase_word(g) };
+  size_t n=0;
+  for(int i=0;i<SNAP_WORDS;i++){ put_u32(b+n, w[i]); n+=4; }
+  b[n++] = (Uint8)(g->has_hold | g->can_hold<<1 | g->game_over<<2);
+  n += piece_pack(&g->cur, b+n); n += piece_pack(&g->next, b+n); n += piece_pack(&g->hold, b+n);
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++){
+    const Cell *x = &CELL(g,r,c);
+    b[n++] = x->filled ? (Uint8)(0x80 | x->type<<3 | x->tint) : 0;
+  }
+  b[n++] = (Uint8)g->ngarbage;
+  for(int i=0;i<GARBAGE_QUEUE;i++){
+    Garbage q = i<g->ngarbage ? g->garbage[i] : (Garbage){0};
+    b[n++] = q.lines; b[n++] = q.hole;
+  }
+}
+
+// An older blob without the garbage queue, padded out to the current size.
+static void snap_upgrade(Uint8 *out, const Uint8 *old){
+  memcpy(out, old, SNAP_BYTES_V1); memset(out + SNAP_BYTES_V1, 0, SNAP_BYTES - SNAP_BYTES_V1);
+}
+
+static Uint32 snap_tick(const Uint8 *b){ return get_u32(b + SNAP_TICK); }
+
+// Whether a blob from outside (file, network) only holds values the tables it
+// indexes have room for: piece kinds and tints, the mode and the phase.
+static bool snap_sane(const Uint8 *b){
+  Uint32 ph = get_u32(b + 36);
+  if((ph&3) > PHASE_ARE || (ph>>26&3) > MODE_ULTRA) return false;
+  for(int k=0;k<3;k++){ const Uint8 *p = b + SNAP_WORDS*4 + 1 + 7*k; if(p[0]>6 || p[4]>7) return false; }
+  return true;
+}
+
+static void game_unpack(Game *g, const Uint8 *b){
+  memset(g,0,sizeof *g);
+  g->fall_accum=get_u32(b); g->tick=get_u32(b+4); g->score=(int)get_u32(b+8); g->lines=(int)get_u32(b+12);
+  g->level=(int)get_u32(b+16); g->fall_ms=(int)get_u32(b+20); g->pieces=(int)get_u32(b+24); g->seed=get_u32(b+28);
+  g->rng=get_u32(b+32);
+  Uint32 ph=get_u32(b+36);
+  g->phase=ph&3; g->phase_left=(Uint8)(ph>>2); g->clear_ticks=(Uint8)(ph>>10); g->are_ticks=(Uint8)(ph>>18); g->mode=(ph>>26)&3; g->bag=(ph>>28)&1;
+  size_t n = SNAP_WORDS*4;
+  g->has_hold = b[n]&1; g->can_hold = (b[n]>>1)&1; g->game_over = (b[n]>>2)&1; n++;
+  piece_unpack(&g->cur, b+n); piece_unpack(&g->next, b+n+7); piece_unpack(&g->hold, b+n+14); n+=21;
+  for(int r=0;r<ROWS;r++) g->row[r]=(Uint8)r;
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++,n++){
+    Cell *x = &g->board[r][c];
+    x->filled = b[n]>>7; x->type = (b[n]>>3)&1; x->tint = b[n]&7;
+  }
+  g->ngarbage = imin(b[n++], GARBAGE_QUEUE);
+  for(int i=0;i<g->ngarbage;i++) g->garbage[i] = (Garbage){ b[n+2*i], b[n+2*i+1] };
+}
+
+static void game_dump(FILE *f, const Game *g){
+  fprintf(f,"tick %u seed %08x rng %08x score %d lines %d level %d fall %d/%u pieces %d%s\n",
+          g->tick, g->seed, g->rng, g->score, g->lines, g->level, g->fall_ms, g->fall_accum, g->pieces, g->game_over?" over":"");
+  fprintf(f,"cur %c@%d,%d next %c hold %c\n", "IOTSZJL"[g->cur.k], g->cur.x, g->cur.y,
+          "IOTSZJL"[g->next.k], g->has_hold?"IOTSZJL"[g->hold.k]:'-');
   for(int r=0;r<ROWS;r++){
     for(int c=0;c<COLS;c++){
-      int px = ox + c*TILE; int py = oy + r*TILE;
-      fill_rect(ren, px, py, TILE-1, TILE-1, (SDL_Color){30,35,40,255});
-      if(g->board[r][c].filled){
-        draw_tile(ren, emoji_font, px, py, g->board[r][c].type, col_piece[g->board[r][c].tint]);
-      }
+      int pr=r-g->cur.y, pc=c-g->cur.x;
+      bool active = pr>=0 && pr<4 && pc>=0 && pc<4 && g->cur.m[pr][pc];
+      fputc(CELL(g,r,c).filled ? "IOTSZJLG"[CELL(g,r,c).tint] : active ? '@' : '.', f);
     }
+    fputc('\n', f);
   }
-  // current piece
-  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(g->cur.m[r][c]){
-    int x = g->cur.x+c, y=g->cur.y+r; if(y<0) continue; if(x<0||x>=COLS||y>=ROWS) continue;
-    int px = ox + x*TILE; int py = oy + y*TILE;
-    draw_tile(ren, emoji_font, px, py, g->cur.type, col_piece[g->cur.tint]);
+}
+
+// Lockstep log: per-tick checksums plus a short window of snapshots, so a peer
+// (or a replay) reporting a different checksum pins the exact tick and both
+// sides can dump the states on either side of the divergence.
+#define LOCKSTEP_WINDOW 64
+typedef struct { Uint32 tick, crc; Game snap; } LockstepEntry;
+typedef struct { LockstepEntry e[LOCKSTEP_WINDOW]; } Lockstep;
+
+static Uint32 lockstep_record(Lockstep *ls, const Game *g){
+  LockstepEntry *e = &ls->e[g->tick % LOCKSTEP_WINDOW];
+  e->tick = g->tick; e->crc = game_checksum(g); e->snap = *g;
+  return e->crc;
+}
+
+static const LockstepEntry *lockstep_find(const Lockstep *ls, Uint32 tick){
+  const LockstepEntry *e = &ls->e[tick % LOCKSTEP_WINDOW];
+  return e->tick==tick ? e : NULL;
+}
+
+// Returns false on a confirmed desync (after writing desync-<tick>.txt).
+// Ticks that already fell out of the window can't be judged and pass.
+static bool lockstep_verify(const Lockstep *ls, Uint32 tick, Uint32 remote_crc){
+  const LockstepEntry *e = lockstep_find(ls, tick);
+  if(!e || e->crc==remote_crc) return true;
+  char name[64]; snprintf(name, sizeof name, "desync-%u.txt", tick);
+  FILE *f = fopen(name, "w");
+  if(f){
+    fprintf(f,"local %08x remote %08x\n", e->crc, remote_crc);
+    const LockstepEntry *prev = tick ? lockstep_find(ls, tick-1) : NULL;
+    if(prev){ fprintf(f,"\n-- before (tick %u, %08x)\n", prev->tick, prev->crc); game_dump(f,&prev->snap); }
+    fprintf(f,"\n-- diverged (tick %u)\n", tick); game_dump(f,&e->snap);
+    fclose(f);
+  }
+  fprintf(stderr,"desync at tick %u: local %08x remote %08x (see %s)\n", tick, e->crc, remote_crc, name);
+  return false;
+}
+
+// Replays: seed + tick-stamped actions + periodic checksums.
+// Version 1/2 records are a varint of (tick delta << 3 | kind); kind REC_CHECK
+// carries a 4-byte CRC. Version 2 adds a flags byte; REPLAY_HAS_START means a
+// packed snapshot follows and the replay begins from that state.
+// Version 3 (written today) range-codes the same records with adaptive binary
+// models. Each record codes its kind first, predicted from the last input and
+// whether the previous record was a checkpoint. Then its tick delta: an
+// input's from the last input (checkpoints in between don't break the rhythm
+// of auto-repeat), predicted from how it follows that input - the same key
+// again (DAS, then ARR), a new piece, or another key; a checkpoint's from the
+// last record. Games with clear/ARE delays always carry a start snapshot,
+// which holds them.
+// Version 4 adds the gravity (start, step and minimum ms, 16 bits each) after
+// the flags, and playback runs under it; older replays play under the
+// current settings. Version 5 start snapshots hold the garbage queue; older
+// ones are SNAP_BYTES_V1 long.
+#define REPLAY_MAGIC 0x50524249u // "IBRP"
+#define REPLAY_VERSION 5
+#define REPLAY_HEADER 16
+#define REPLAY_HEADER_V2 10      // versions 2 and 3: no gravity
+#define REPLAY_HAS_START 1
+#define REPLAY_CHECK_TICKS 50    // checkpoint cadence while idle
+#define REC_CHECK 7
+#define REC_KINDS 8
+#define REC_NONE REC_KINDS        // "last input" before the first one
+#define REC_RUNS 3                // runs of one key: 1, 2, 3 or more
+#define REC_DCTX (REC_KINDS+1+REC_RUNS) // an input follows the last input's kind, or repeats it
+#define REC_MCTX (3+REC_RUNS)     // checkpoint, new piece, other key, repeats
+#define REC_END 33                // bit-length symbol past any real delta
+#define REC_MANT_BITS 7           // deltas below 2^8 have every bit modelled
+
+// LZMA-style binary range coder with 12-bit probabilities. Replays are short,
+// so each model counts its first updates and moves by 1/(n+1.3) until the
+// rate bottoms out at 1/16 - close to a running average while it is young.
+#define RC_TOP (1u<<24)
+#define RC_PROB_BITS 12
+#define RC_PROB_INIT (1u<<(RC_PROB_BITS-1) << 4)
+typedef Uint16 RcProb; // probability of a 0 above, times seen (up to 15) in the low 4 bits
+static const Uint16 RC_RATE[16] = { // 65536/(n+1.3), then 65536/16
+  50412,28493,19859,15240,12365,10402,8977,7895,7046,6362,5799,5328,4927,4582,4283,4096 };
+
+typedef struct {
+  RcProb kind[REC_KINDS+1][2][REC_KINDS];                     // last input x after a check -> 3-bit tree
+  RcProb nbits[REC_KINDS][REC_DCTX][REC_END];                 // kind x rec_dctx -> delta bit length (unary)
+  RcProb mant[REC_MCTX][REC_MANT_BITS+2][1<<REC_MANT_BITS];  // rec_mctx x bit length -> bits under the leading 1
+} ReplayModel;
+
+// What the models are conditioned on; writer and reader keep it in step.
+typedef struct { Uint32 last_tick, last_input; int prev, run; bool checked; } RecCtx;
+
+typedef struct {
+  Uint8 *buf; size_t len, cap; RecCtx c; bool done;
+  Uint64 low, cache_size; Uint32 range; Uint8 cache;
+  ReplayModel m;
+} ReplayWriter;
+
+typedef struct {
+  const Uint8 *p, *end, *start; Uint32 seed, tick; int kind; Uint32 crc; bool ok;
+  int version; RecCtx c; bool overrun;
+  int gravity[3];               // start, step, min ms (version 4 on)
+  Uint8 snap[SNAP_BYTES];       // the start snapshot, at the current size
+  Uint32 range, code;
+  ReplayModel m;
+} ReplayReader;
+
+static void rec_ctx_init(RecCtx *c, Uint32 tick){ *c = (RecCtx){ tick, tick, REC_NONE, 1, false }; }
+
+static void rec_ctx_step(RecCtx *c, Uint32 tick, int kind){
+  if(kind!=REC_CHECK){ c->run = kind==c->prev ? imin(c->run+1, REC_RUNS) : 1; c->prev = kind; c->last_input = tick; }
+  c->last_tick = tick; c->checked = kind==REC_CHECK;
+}
+
+static RcProb *rec_kind_probs(ReplayModel *m, const RecCtx *c){ return m->kind[c->prev][c->checked]; }
+
+// Delta contexts. A checkpoint: did inputs come since the last record. An
+// input: the kind of the last input, or (the same key again) its run.
+static int rec_dctx(const RecCtx *c, int kind){
+  if(kind==REC_CHECK) return !c->checked;
+  return kind==c->prev ? REC_KINDS+c->run : c->prev;
+}
+
+// Mantissa contexts: checkpoint, new piece, other key, or the run of a repeat.
+static int rec_mctx(const RecCtx *c, int kind){
+  if(kind==REC_CHECK) return 0;
+  if(kind==c->prev) return 2+c->run;
+  return c->prev==REC_NONE || c->prev==ACT_HARD || c->prev==ACT_HOLD ? 1 : 2; // a new piece (or hold) starts with the player's reaction
+}
+
+static void model_init(ReplayModel *m){
+  RcProb *p = (RcProb*)m;
+  for(size_t i=0;i<sizeof *m/sizeof *p;i++) p[i]=RC_PROB_INIT;
+}
+
+static void rw_put(ReplayWriter *w, const Uint8 *b, size_t n){
+  if(w->len+n > w->cap){
+    size_t cap = w->cap ? w->cap*2 : 4096;
+    while(cap < w->len+n) cap*=2;
+    Uint8 *nb = realloc(w->buf, cap);
+    if(!nb) return;
+    w->buf=nb; w->cap=cap;
   }
+  memcpy(w->buf+w->len, b, n); w->len+=n;
 }
 
-static void render_preview(SDL_Renderer *ren, TTF_Font *emoji_font, const Piece *p, int ox, int oy){
-  fill_rect(ren, ox-8, oy-8, PREVIEW_W*TILE+16, PREVIEW_H*TILE+16, col_grid);
-  Piece t=*p; // draw centered
-  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(t.m[r][c]){
-    int px = ox + c*TILE; int py = oy + r*TILE;
-    draw_tile(ren, emoji_font, px, py, t.type, col_piece[t.tint]);
+static void rc_adapt(RcProb *p, int bit){
+  unsigned n = *p & 15, q = *p >> 4;
+  if(!bit) q += (((1u<<RC_PROB_BITS) - q) * RC_RATE[n]) >> 16; else q -= (q * RC_RATE[n]) >> 16;
+  *p = (RcProb)(q<<4 | (n<15 ? n+1 : 15));
+}
+
+static void rc_shift_low(ReplayWriter *w){
+  if((Uint32)w->low < 0xFF000000u || (w->low>>32)){
+    Uint8 carry = (Uint8)(w->low>>32), b = w->cache;
+    do { Uint8 o = (Uint8)(b+carry); rw_put(w,&o,1); b = 0xFF; } while(--w->cache_size);
+    w->cache = (Uint8)(w->low>>24);
   }
+  w->cache_size++;
+  w->low = (w->low & 0x00FFFFFFu) << 8;
+}
+
+static void rc_bit(ReplayWriter *w, RcProb *p, int bit){
+  Uint32 bound = (w->range>>RC_PROB_BITS) * (*p>>4);
+  if(!bit) w->range = bound; else { w->low += bound; w->range -= bound; }
+  rc_adapt(p, bit);
+  while(w->range < RC_TOP){ w->range <<= 8; rc_shift_low(w); }
 }
 
-static void render_particles(SDL_Renderer *ren){
-  for(int i=0;i<MAX_PARTICLES;i++) if(particles[i].alive){
-    float a = 1.0f - (particles[i].life / particles[i].maxlife);
-    SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
-    SDL_SetRenderDrawColor(ren, particles[i].c.r, particles[i].c.g, particles[i].c.b, (Uint8)(a*255));
-    SDL_Rect R = { (int)particles[i].x, (int)particles[i].y, 4, 4 };
-    SDL_RenderFillRect(ren, &R);
+static void rc_direct(ReplayWriter *w, Uint32 v, int nbits){
+  while(nbits--){
+    w->range >>= 1;
+    if((v>>nbits)&1) w->low += w->range;
+    while(w->range < RC_TOP){ w->range <<= 8; rc_shift_low(w); }
   }
 }
 
-int main(int argc, char **argv){
-  (void)argc; (void)argv;
-  srand((unsigned)time(NULL));
-  if(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER)!=0){ fprintf(stderr,"SDL_Init error: %s\n", SDL_GetError()); return 1; }
-  if(TTF_Init()!=0){ fprintf(stderr,"TTF_Init error: %s\n", TTF_GetError()); return 1; }
+static void rc_tree(ReplayWriter *w, RcProb *probs, int nbits, Uint32 sym){
+  Uint32 m=1;
+  while(nbits--){ int b=(sym>>nbits)&1; rc_bit(w, &probs[m], b); m = m<<1 | (Uint32)b; }
+}
 
-  int winW = 720, winH = 760;
-  SDL_Window *win = SDL_CreateWindow("IceBurger Tetris", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, winW, winH, SDL_WINDOW_SHOWN);
-  SDL_Renderer *ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED|SDL_RENDERER_PRESENTVSYNC);
+static Uint32 rd_byte(ReplayReader *rd){
+  if(rd->p < rd->end) return *rd->p++;
+  rd->overrun = true;
+  return 0;
+}
 
-  // Try to load a default font for emoji (system dependent). Fallback to NULL.
-  // You can replace path below with a known emoji-capable TTF on your system (e.g., NotoColorEmoji.ttf)
-  const char *font_candidates[] = {
-    "/System/Library/Fonts/Apple Color Emoji.ttc", // macOS
-    "/usr/share/fonts/truetype/noto/NotoColorEmoji.ttf",
-    "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
-    NULL
-  };
-  TTF_Font *emoji_font = NULL;
-  for(int i=0;font_candidates[i];i++){
-    emoji_font = TTF_OpenFont(font_candidates[i], 64);
-    if(emoji_font) break;
+static int rc_dbit(ReplayReader *rd, RcProb *p){
+  Uint32 bound = (rd->range>>RC_PROB_BITS) * (*p>>4); int bit = rd->code >= bound;
+  if(!bit) rd->range = bound; else { rd->code -= bound; rd->range -= bound; }
+  rc_adapt(p, bit);
+  while(rd->range < RC_TOP){ rd->range <<= 8; rd->code = rd->code<<8 | rd_byte(rd); }
+  return bit;
+}
+
+static Uint32 rc_ddirect(ReplayReader *rd, int nbits){
+  Uint32 v=0;
+  while(nbits--){
+    rd->range >>= 1;
+    Uint32 b = rd->code >= rd->range;
+    if(b) rd->code -= rd->range;
+    v = v<<1 | b;
+    while(rd->range < RC_TOP){ rd->range <<= 8; rd->code = rd->code<<8 | rd_byte(rd); }
   }
+  return v;
+}
 
-  TTF_Font *ui_font = NULL;
-  const char *ui_candidates[] = {
-    "/System/Library/Fonts/SFNS.ttf",
-    "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
-    NULL
-  };
-  for(int i=0;ui_candidates[i];i++){ ui_font = TTF_OpenFont(ui_candidates[i], 22); if(ui_font) break; }
+static Uint32 rc_dtree(ReplayReader *rd, RcProb *probs, int nbits){
+  Uint32 m=1;
+  for(int i=0;i<nbits;i++) m = m<<1 | (Uint32)rc_dbit(rd, &probs[m]);
+  return m - (1u<<nbits);
+}
 
-  Game g; game_reset(&g);
+// Tick deltas: bit length (0..32, or REC_END), then the bits under the
+// leading one - all of them modelled for short deltas, the top few for long.
+static void rc_put_delta(ReplayWriter *w, int kind, Uint32 d, int nb){
+  RcProb *u = w->m.nbits[kind][rec_dctx(&w->c, kind)];
+  for(int i=0;i<REC_END;i++){ rc_bit(w, &u[i], i<nb); if(i>=nb) break; }
+  if(nb<2 || nb==REC_END) return;
+  int rest = nb-1, top = imin(rest, REC_MANT_BITS);
+  rc_tree(w, w->m.mant[rec_mctx(&w->c, kind)][imin(nb, REC_MANT_BITS+1)], top, (d>>(rest-top)) & ((1u<<top)-1));
+  rc_direct(w, d, rest-top);
+}
 
-  bool running=true, paused=false;
-  Uint64 now=SDL_GetPerformanceCounter();
-  Uint64 last=now; double freq=(double)SDL_GetPerformanceFrequency();
+static Uint32 rc_get_delta(ReplayReader *rd, int kind, int *nb){
+  RcProb *u = rd->m.nbits[kind][rec_dctx(&rd->c, kind)];
+  for(*nb=0; *nb<REC_END && rc_dbit(rd, &u[*nb]); ) ++*nb;
+  if(*nb<2 || *nb>=REC_END) return (Uint32)(*nb==1);
+  int rest = *nb-1, top = imin(rest, REC_MANT_BITS);
+  Uint32 d = 1u<<top | rc_dtree(rd, rd->m.mant[rec_mctx(&rd->c, kind)][imin(*nb, REC_MANT_BITS+1)], top);
+  return d<<(rest-top) | rc_ddirect(rd, rest-top);
+}
 
-  while(running){
-    last = now; now = SDL_GetPerformanceCounter();
-    float dt = (float)((now-last)/freq);
+// Is this the state game_reset(seed) leaves (delays, mode and randomizer aside)?
+static bool game_fresh(const Game *g){
+  Game f; game_reset(&f, g->seed);
+  f.clear_ticks = g->clear_ticks; f.are_ticks = g->are_ticks; f.mode = g->mode;
+  if(g->bag) game_use_bag(&f);
+  Uint8 a[SNAP_BYTES], b[SNAP_BYTES]; game_pack(&f,a); game_pack(g,b);
+  return !memcmp(a,b,sizeof a);
+}
 
-    // input
-    SDL_Event e; while(SDL_PollEvent(&e)){
-      if(e.type==SDL_QUIT) running=false;
-      if(e.type==SDL_KEYDOWN){
-        SDL_Keycode k = e.key.keysym.sym;
-        if(k==SDLK_ESCAPE) running=false;
-        else if(k==SDLK_p) paused=!paused;
-        else if(k==SDLK_r) { game_reset(&g); paused=false; }
-        if(g.game_over||paused) continue;
-        if(k==SDLK_LEFT && !collide(&g,&g.cur,g.cur.x-1,g.cur.y)) g.cur.x--;
-        else if(k==SDLK_RIGHT && !collide(&g,&g.cur,g.cur.x+1,g.cur.y)) g.cur.x++;
-        else if(k==SDLK_DOWN) soft_step(&g);
-        else if(k==SDLK_SPACE) hard_drop(&g);
-        else if(k==SDLK_c) hold_piece(&g);
-        else if(k==SDLK_z) attempt_rotate(&g,false);
-        else if(k==SDLK_UP) attempt_rotate(&g,true);
-      }
+// Games already under way (or started from a fixture) are embedded as a start snapshot.
+static void replay_begin(ReplayWriter *w, const Game *start){
+  w->len=0; rec_ctx_init(&w->c, start->tick); w->done=false;
+  w->low=0; w->range=0xFFFFFFFFu; w->cache=0; w->cache_size=1;
+  model_init(&w->m);
+  Uint8 h[REPLAY_HEADER]; put_u32(h,REPLAY_MAGIC); h[4]=REPLAY_VERSION; put_u32(h+5,start->seed);
+  bool snap = start->tick || phase_word(start) || !game_fresh(start); // games with delays carry them in the snapshot
+  h[9] = snap ? REPLAY_HAS_START : 0;
+  put_u16(h+10, (Uint16)cfg->start_speed_ms); put_u16(h+12, (Uint16)cfg->speed_step_ms); put_u16(h+14, (Uint16)cfg->min_speed_ms);
+  rw_put(w,h,sizeof h);
+  if(snap){ Uint8 snap[SNAP_BYTES]; game_pack(start,snap); rw_put(w,snap,sizeof snap); }
+}
+
+static int bit_length(Uint32 v){ int n=0; while(v){ n++; v>>=1; } return n; }
+
+static void replay_put(ReplayWriter *w, Uint32 tick, int kind){
+  Uint32 d = tick - (kind==REC_CHECK ? w->c.last_tick : w->c.last_input);
+  rc_tree(w, rec_kind_probs(&w->m, &w->c), 3, (Uint32)kind);
+  rc_put_delta(w, kind, d, bit_length(d));
+  rec_ctx_step(&w->c, tick, kind);
+}
+
+static void replay_put_check(ReplayWriter *w, Uint32 tick, Uint32 crc){
+  replay_put(w, tick, REC_CHECK);
+  rc_direct(w, crc, 32);
+}
+
+// End of stream: a check kind whose delta is the REC_END bit length.
+static void replay_end(ReplayWriter *w){
+  if(w->done) return;
+  rc_tree(w, rec_kind_probs(&w->m, &w->c), 3, REC_CHECK);
+  rc_put_delta(w, REC_CHECK, 0, REC_END);
+  for(int i=0;i<5;i++) rc_shift_low(w);
+  w->done = true;
+}
+
+static bool replay_save(ReplayWriter *w, const char *path){
+  replay_end(w);
+  FILE *f = fopen(path,"wb");
+  if(!f) return false;
+  bool ok = fwrite(w->buf,1,w->len,f)==w->len;
+  return fclose(f)==0 && ok;
+}
+
+static Uint8 *read_file(const char *path, size_t *len){
+  FILE *f = fopen(path,"rb");
+  if(!f) return NULL;
+  size_t cap=4096, n=0; Uint8 *buf=malloc(cap);
+  while(buf){
+    n += fread(buf+n,1,cap-n,f);
+    if(n<cap) break;
+    Uint8 *nb = realloc(buf, cap*=2);
+    if(!nb){ free(buf); buf=NULL; break; }
+    buf = nb;
+  }
+  fclose(f);
+  *len = n;
+  return buf;
+}
+
+// Writes PATH.tmp and renames it over PATH, so readers never see half a file.
+static bool write_file_atomic(const char *path, const void *buf, size_t len){
+  char tmp[1024];
+  if(snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) return false;
+  FILE *f = fopen(tmp, "wb");
+  if(!f) return false;
+  bool ok = fwrite(buf, 1, len, f)==len;
+  if(fclose(f)!=0 || !ok || rename(tmp, path)!=0){ remove(tmp); return false; }
+  return true;
+}
+
+static bool replay_open(ReplayReader *rd, const Uint8 *buf, size_t len){
+  memset(rd,0,sizeof *rd);
+  if(len<9 || get_u32(buf)!=REPLAY_MAGIC || buf[4]<1 || buf[4]>REPLAY_VERSION) return false;
+  rd->version = buf[4];
+  rd->seed = get_u32(buf+5); rd->p = buf+9; rd->end = buf+len; rd->ok = true;
+  if(rd->version>=2){
+    if(len < (rd->version>=4 ? REPLAY_HEADER : REPLAY_HEADER_V2)) return false;
+    Uint8 flags = *rd->p++;
+    if(rd->version>=4){
+      for(int i=0;i<3;i++){ rd->gravity[i] = get_u16(rd->p); rd->p += 2; }
+      if(rd->gravity[0]<4 || rd->gravity[0]>10000 || rd->gravity[1]>10000 || rd->gravity[2]<4 || rd->gravity[2]>rd->gravity[0]) return false; // settings_load's bounds
     }
+    if(flags & REPLAY_HAS_START){
+      int n = rd->version>=5 ? SNAP_BYTES : SNAP_BYTES_V1;
+      if(rd->end-rd->p < n) return false;
+      if(n==SNAP_BYTES) memcpy(rd->snap, rd->p, SNAP_BYTES); else snap_upgrade(rd->snap, rd->p);
+      if(!snap_sane(rd->snap)) return false;
+      rd->start = rd->snap; rd->p += n; rd->tick = snap_tick(rd->start);
+    }
+  }
+  if(rd->version>=3){
+    model_init(&rd->m); rec_ctx_init(&rd->c, rd->tick); rd->range = 0xFFFFFFFFu;
+    for(int i=0;i<5;i++) rd->code = rd->code<<8 | rd_byte(rd);
+  }
+  return true;
+}
 
-    if(!paused && !g.game_over){
-      g.fall_accum += (Uint32)(dt*1000.0f);
-      while(g.fall_accum >= (Uint32)g.fall_ms){ g.fall_accum -= g.fall_ms; soft_step(&g); }
+// Playback takes the replay's gravity; call before other threads read cfg.
+static void replay_use_gravity(const ReplayReader *rd){
+  if(rd->version>=4) settings_gravity(&settings_rw, rd->gravity[0], rd->gravity[1], rd->gravity[2]);
+}
+
+static void replay_start_game(const ReplayReader *rd, Game *g){
+  if(rd->start) game_unpack(g, rd->start); else game_reset(g, rd->seed);
+}
+
+// Advances to the next record; false at end of stream or on a truncated record.
+static bool replay_next(ReplayReader *rd){
+  if(rd->version>=3){
+    int kind = (int)rc_dtree(rd, rec_kind_probs(&rd->m, &rd->c), 3), nb;
+    Uint32 d = rc_get_delta(rd, kind, &nb);
+    if(nb>=REC_END || rd->overrun){ rd->ok = nb==REC_END && !rd->overrun; return false; }
+    Uint32 tick = (kind==REC_CHECK ? rd->c.last_tick : rd->c.last_input) + d;
+    // Writers never go REPLAY_CHECK_TICKS without a checkpoint, nor back in time.
+    if(tick < rd->c.last_tick || tick - rd->c.last_tick > REPLAY_CHECK_TICKS){ rd->ok = false; return false; }
+    if(kind==REC_CHECK) rd->crc = rc_ddirect(rd, 32);
+    rd->tick = tick; rd->kind = kind;
+    rec_ctx_step(&rd->c, tick, kind);
+    return true;
+  }
+  Uint32 v=0; int shift=0;
+  for(;;){
+    if(rd->p>=rd->end || shift>28){ rd->ok = rd->p==rd->end && !shift; return false; }
+    Uint8 b = *rd->p++;
+    v |= (Uint32)(b&0x7F)<<shift; shift+=7;
+    if(!(b&0x80)) break;
+  }
+  if((v>>3) > REPLAY_CHECK_TICKS){ rd->ok = false; return false; }
+  rd->tick += v>>3; rd->kind = (int)(v&7);
+  if(rd->kind==REC_CHECK){
+    if(rd->end-rd->p<4){ rd->ok=false; return false; }
+    rd->crc = get_u32(rd->p); rd->p+=4;
+  }
+  return true;
+}
+
+// One simulation tick: apply actions, run gravity, log the checksum (ls may be
+// NULL) and (when recording) write events plus a checkpoint after any tick
+// with input, every REPLAY_CHECK_TICKS and at the end.
+static Uint32 sim_tick(Game *g, const Uint8 *acts, int n, Lockstep *ls, ReplayWriter *rec){
+  for(int i=0;i<n;i++){ if(rec) replay_put(rec, g->tick, acts[i]); game_apply(g, acts[i]); }
+  game_tick(g);
+  Uint32 crc = ls ? lockstep_record(ls, g) : rec ? game_checksum(g) : 0;
+  if(rec && (n || g->game_over || g->tick%REPLAY_CHECK_TICKS==0)) replay_put_check(rec, g->tick, crc);
+  return crc;
+}
+
+// Pulls this tick's records off a replay: actions into acts, checkpoints
+// verified against the lockstep log. Must run at the start of the tick, before
+// any of its actions are applied. The reader is left on the first record of a
+// later tick (has_rec says whether one is pending).
+static int replay_feed(ReplayReader *rd, bool *has_rec, const Game *g, const Lockstep *ls, Uint8 *acts, int max, bool *desync){
+  int n=0;
+  while(*has_rec && rd->tick<=g->tick){
+    if(rd->kind==REC_CHECK){ if(!lockstep_verify(ls, rd->tick, rd->crc)) *desync=true; }
+    else if(n<max) acts[n++]=(Uint8)rd->kind;
+    *has_rec = replay_next(rd);
+  }
+  return n;
+}
+
+static int replay_verify(const char *path){
+  size_t len=0; Uint8 *buf = read_file(path,&len);
+  ReplayReader rd;
+  if(!buf || !replay_open(&rd,buf,len)){ fprintf(stderr,"%s: not a replay\n", path); free(buf); return 1; }
+  static Lockstep ls;
+  int keep[3] = { cfg->start_speed_ms, cfg->speed_step_ms, cfg->min_speed_ms }; // for the next file, if it predates version 4
+  replay_use_gravity(&rd);
+  Game g; replay_start_game(&rd,&g); lockstep_record(&ls,&g);
+  bool has_rec = replay_next(&rd), desync=false;
+  while(!desync){
+    Uint8 acts[32];
+    int n = replay_feed(&rd,&has_rec,&g,&ls,acts,32,&desync);
+    if(desync || (!has_rec && !n)) break;
+    sim_tick(&g,acts,n,&ls,NULL);
+  }
+  free(buf);
+  settings_gravity(&settings_rw, keep[0], keep[1], keep[2]);
+  if(desync){ printf("%s: DESYNC\n", path); return 1; }
+  if(!rd.ok){ printf("%s: corrupt or truncated at tick %u\n", path, rd.tick); return 1; }
+  printf("%s: ok, %u ticks, score %d, lines %d\n", path, g.tick, g.score, g.lines);
+  return 0;
+}
+
+
+// Published game state for other threads (telemetry, spectators, agents).
+// The simulation writes a packed snapshot once per tick under a seqlock:
+// readers copy it out and retry if a write overlapped, so they never block
+// the writer, and the writer never waits for them. The payload is stored as
+// relaxed atomic words so the overlapping copy is well-defined C11.
+#define PUB_WORDS ((SNAP_BYTES+3)/4)
+typedef struct {
+  atomic_uint seq;                // odd while a write is in progress; 0 = nothing yet
+  atomic_uint words[PUB_WORDS];
+} StatePub;
+
+static StatePub state_pub;
+
+static void state_publish(StatePub *sp, const Game *g){
+  Uint32 buf[PUB_WORDS] = {0};
+  game_pack(g, (Uint8*)buf);
+  unsigned s = atomic_load_explicit(&sp->seq, memory_order_relaxed);
+  atomic_store_explicit(&sp->seq, s+1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for(int i=0;i<PUB_WORDS;i++) atomic_store_explicit(&sp->words[i], buf[i], memory_order_relaxed);
+  atomic_store_explicit(&sp->seq, s+2, memory_order_release);
+}
+
+// Copies the latest published snapshot (PUB_WORDS*4 bytes) into buf; returns
+// its sequence number (0 if nothing has been published yet, buf untouched).
+static unsigned state_read_raw(StatePub *sp, Uint8 *buf){
+  Uint32 w[PUB_WORDS];
+  unsigned s1, s2;
+  do {
+    s1 = atomic_load_explicit(&sp->seq, memory_order_acquire);
+    if(!s1) return 0;
+    if(s1&1) continue;
+    for(int i=0;i<PUB_WORDS;i++) w[i] = atomic_load_explicit(&sp->words[i], memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&sp->seq, memory_order_relaxed);
+  } while((s1&1) || s1!=s2);
+  memcpy(buf, w, sizeof w);
+  return s1;
+}
+
+// The same, unpacked into out.
+static unsigned state_read(StatePub *sp, Game *out){
+  Uint32 buf[PUB_WORDS];
+  unsigned s = state_read_raw(sp, (Uint8*)buf);
+  if(s) game_unpack(out, (const Uint8*)buf);
+  return s;
+}
+
+// Single-producer / single-consumer ring of fixed-size elements. One thread
+// pushes, one pops; neither ever blocks. Capacity must be a power of two.
+typedef struct {
+  atomic_uint head;   // next slot to write (producer)
+  atomic_uint tail;   // next slot to read (consumer)
+  unsigned mask;
+  size_t elem;
+  Uint8 *buf;
+} SpscQueue;
+
+static void spsc_init(SpscQueue *q, void *buf, size_t elem, unsigned cap){
+  atomic_init(&q->head, 0); atomic_init(&q->tail, 0);
+  q->mask = cap-1; q->elem = elem; q->buf = buf;
+}
+
+static bool spsc_push(SpscQueue *q, const void *item){
+  unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if(h - atomic_load_explicit(&q->tail, memory_order_acquire) > q->mask) return false;
+  memcpy(q->buf + (h & q->mask)*q->elem, item, q->elem);
+  atomic_store_explicit(&q->head, h+1, memory_order_release);
+  return true;
+}
+
+static bool spsc_pop(SpscQueue *q, void *item){
+  unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if(t == atomic_load_explicit(&q->head, memory_order_acquire)) return false;
+  memcpy(item, q->buf + (t & q->mask)*q->elem, q->elem);
+  atomic_store_explicit(&q->tail, t+1, memory_order_release);
+  return true;
+}
+
+// Telemetry: a reader thread appending one JSON line a second from the
+// published state.
+typedef struct { const char *path; atomic_bool stop; } Telemetry;
+
+static int telemetry_thread(void *arg){
+  Telemetry *t = arg;
+  FILE *f = fopen(t->path, "a");
+  if(!f){ fprintf(stderr,"telemetry: cannot open %s\n", t->path); return 1; }
+  unsigned last = 0;
+  while(!atomic_load(&t->stop)){
+    Game g; unsigned seq = state_read(&state_pub, &g);
+    if(seq && seq!=last){
+      fprintf(f,"{\"time\":%lld,\"seed\":%u,\"tick\":%u,\"score\":%d,\"lines\":%d,\"level\":%d,\"pieces\":%d,\"over\":%d}\n",
+              (long long)time(NULL), g.seed, g.tick, g.score, g.lines, g.level, g.pieces, g.game_over);
+      fflush(f);
+      last = seq;
     }
+    SDL_Delay(1000);
+  }
+  fclose(f);
+  return 0;
+}
 
-    particles_update(dt);
+// Metrics. Every thread counts into its own shard - a relaxed load and store
+// by the only writer, no locks, no shared cache lines - and nothing is summed
+// or formatted until someone scrapes. Served as Prometheus text on
+// 127.0.0.1:PORT and/or rewritten into a stats file once a second.
+enum {
+  MET_FRAMES, MET_FRAME_US, MET_TICKS, MET_TEXTURES, MET_PARTICLES, MET_INPUTS, MET_INPUT_US,
+  MET_GAMES, MET_PAD_SAMPLES, MET_AUDIO_CALLBACKS, MET_VOICES, MET_SPEC_SKIPS, MET_SPEC_DROPS, MET_COUNT
+};
+#define MET_BUCKETS 12 // the last one is +Inf
+static const Uint32 FRAME_BOUNDS_US[MET_BUCKETS-1] = { 2000, 4000, 6000, 8333, 10000, 12500, 16667, 20000, 33333, 50000, 100000 };
+static const Uint32 INPUT_BOUNDS_US[MET_BUCKETS-1] = { 250, 500, 1000, 2000, 3000, 4000, 6000, 8000, 12000, 16667, 33333 };
 
-    // draw
-    SDL_SetRenderDrawColor(ren, col_bg.r,col_bg.g,col_bg.b,255);
-    SDL_RenderClear(ren);
+typedef struct {
+  _Alignas(64) atomic_ullong v[MET_COUNT];
+  atomic_ullong frame_hist[MET_BUCKETS], input_hist[MET_BUCKETS];
+} MetricShard;
 
-    int ox = 40, oy = 40;
-    render_board(ren, emoji_font, &g, ox, oy);
-    render_preview(ren, emoji_font, &g.next, ox + COLS*TILE + 40, oy);
-    if(g.has_hold) render_preview(ren, emoji_font, &g.hold, ox + COLS*TILE + 40, oy + PREVIEW_H*TILE + 24);
+static MetricShard met_main, met_pad, met_audio, met_spec;
 
-    render_particles(ren);
+static void met_add(MetricShard *m, int id, Uint64 n){
+  atomic_store_explicit(&m->v[id], atomic_load_explicit(&m->v[id], memory_order_relaxed) + n, memory_order_relaxed);
+}
+static void met_set(MetricShard *m, int id, Uint64 v){ atomic_store_explicit(&m->v[id], v, memory_order_relaxed); }
+static void met_observe(MetricShard *m, atomic_ullong *hist, const Uint32 *bounds, int sum_id, Uint64 us){
+  int b = 0; while(b<MET_BUCKETS-1 && us>bounds[b]) b++;
+  atomic_store_explicit(&hist[b], atomic_load_explicit(&hist[b], memory_order_relaxed) + 1, memory_order_relaxed);
+  met_add(m, sum_id, us);
+}
 
-    char buf[128];
-    snprintf(buf,sizeof buf, "Score %d  Lines %d  Level %d", g.score, g.lines, g.level);
-    draw_text(ren, ui_font, buf, ox, oy + ROWS*TILE + 24, col_text);
+typedef struct { Uint64 v[MET_COUNT], frame_hist[MET_BUCKETS], input_hist[MET_BUCKETS]; } MetricTotals;
+
+static void met_collect(MetricTotals *t){
+  MetricShard *shards[] = { &met_main, &met_pad, &met_audio, &met_spec };
+  memset(t,0,sizeof *t);
+  for(size_t s=0;s<sizeof shards/sizeof shards[0];s++){
+    for(int i=0;i<MET_COUNT;i++) t->v[i] += atomic_load_explicit(&shards[s]->v[i], memory_order_relaxed);
+    for(int b=0;b<MET_BUCKETS;b++){
+      t->frame_hist[b] += atomic_load_explicit(&shards[s]->frame_hist[b], memory_order_relaxed);
+      t->input_hist[b] += atomic_load_explicit(&shards[s]->input_hist[b], memory_order_relaxed);
+    }
+  }
+}
 
-    if(paused) draw_text(ren, ui_font, "PAUSED (P)", ox+220, oy+200, (SDL_Color){255,210,60,255});
-    if(g.game_over) draw_text(ren, ui_font, "GAME OVER (R to restart)", ox+120, oy+220, (SDL_Color){255,120,120,255});
+// q-quantile in µs, interpolated inside its bucket (the +Inf bucket reports its lower bound).
+static double met_quantile(const Uint64 *hist, const Uint32 *bounds, double q){
+  Uint64 n = 0; for(int b=0;b<MET_BUCKETS;b++) n += hist[b];
+  if(!n) return 0;
+  double want = q*(double)n, seen = 0;
+  for(int b=0;b<MET_BUCKETS-1;b++){
+    if(seen + (double)hist[b] >= want){
+      double lo = b ? bounds[b-1] : 0;
+      return lo + (bounds[b]-lo) * (hist[b] ? (want-seen)/(double)hist[b] : 0);
+    }
+    seen += (double)hist[b];
+  }
+  return bounds[MET_BUCKETS-2];
+}
 
-    SDL_RenderPresent(ren);
+typedef struct { char *p; size_t n, cap; } TextBuf;
+static void tb_printf(TextBuf *tb, const char *fmt, ...){
+  va_list ap; va_start(ap, fmt);
+  int k = vsnprintf(tb->p + tb->n, tb->cap - tb->n, fmt, ap);
+  va_end(ap);
+  if(k>0) tb->n = (size_t)k < tb->cap - tb->n ? tb->n + (size_t)k : tb->cap - 1;
+}
+
+static void met_histogram(TextBuf *tb, const char *name, const char *help, const Uint64 *hist, const Uint32 *bounds, Uint64 sum_us){
+  tb_printf(tb, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  Uint64 cum = 0;
+  for(int b=0;b<MET_BUCKETS;b++){
+    cum += hist[b];
+    if(b<MET_BUCKETS-1) tb_printf(tb, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[b]/1e6, (unsigned long long)cum);
+    else tb_printf(tb, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cum);
   }
+  tb_printf(tb, "%s_sum %g\n%s_count %llu\n", name, (double)sum_us/1e6, name, (unsigned long long)cum);
+}
+
+static void met_render(TextBuf *tb, double ticks_per_sec){
+  MetricTotals t; met_collect(&t);
+  #define MET_LINE(name, type, help, fmt, val) tb_printf(tb, "# HELP " name " " help "\n# TYPE " name " " type "\n" name " " fmt "\n", val)
+  MET_LINE("iceburger_frames_total", "counter", "Frames rendered.", "%llu", (unsigned long long)t.v[MET_FRAMES]);
+  met_histogram(tb, "iceburger_frame_seconds", "Wall time between frames.", t.frame_hist, FRAME_BOUNDS_US, t.v[MET_FRAME_US]);
+  tb_printf(tb, "# HELP iceburger_frame_quantile_seconds Frame time percentiles since start.\n# TYPE iceburger_frame_quantile_seconds gauge\n");
+  static const double QS[] = { 0.5, 0.9, 0.99, 0.999 };
+  for(size_t i=0;i<sizeof QS/sizeof QS[0];i++)
+    tb_printf(tb, "iceburger_frame_quantile_seconds{quantile=\"%g\"} %g\n", QS[i], met_quantile(t.frame_hist, FRAME_BOUNDS_US, QS[i])/1e6);
+  MET_LINE("iceburger_sim_ticks_total", "counter", "Simulation ticks run.", "%llu", (unsigned long long)t.v[MET_TICKS]);
+  MET_LINE("iceburger_sim_ticks_per_second", "gauge", "Simulation ticks over the last second.", "%g", ticks_per_sec);
+  MET_LINE("iceburger_particles_alive", "gauge", "Live particles in the pool.", "%llu", (unsigned long long)t.v[MET_PARTICLES]);
+  MET_LINE("iceburger_particle_pool_size", "gauge", "Particle pool capacity.", "%d", cfg->particles);
+  MET_LINE("iceburger_textures_created_total", "counter", "Textures created (atlas and glyph cache; flat except on theme switches).", "%llu", (unsigned long long)t.v[MET_TEXTURES]);
+  MET_LINE("iceburger_inputs_total", "counter", "Player actions applied to the simulation.", "%llu", (unsigned long long)t.v[MET_INPUTS]);
+  met_histogram(tb, "iceburger_input_latency_seconds", "From input arrival to the tick that applied it.", t.input_hist, INPUT_BOUNDS_US, t.v[MET_INPUT_US]);
+  MET_LINE("iceburger_games_total", "counter", "Games started.", "%llu", (unsigned long long)t.v[MET_GAMES]);
+  MET_LINE("iceburger_gamepad_samples_total", "counter", "Gamepad polling passes.", "%llu", (unsigned long long)t.v[MET_PAD_SAMPLES]);
+  MET_LINE("iceburger_audio_callbacks_total", "counter", "Audio buffers mixed.", "%llu", (unsigned long long)t.v[MET_AUDIO_CALLBACKS]);
+  MET_LINE("iceburger_audio_voices_active", "gauge", "Voices playing in the last audio buffer.", "%llu", (unsigned long long)t.v[MET_VOICES]);
+  MET_LINE("iceburger_spectate_skips_total", "counter", "Times a lagging spectator jumped ahead to the newest keyframe.", "%llu", (unsigned long long)t.v[MET_SPEC_SKIPS]);
+  MET_LINE("iceburger_spectate_drops_total", "counter", "Spectators gone after the handshake, whether they left or were dropped.", "%llu", (unsigned long long)t.v[MET_SPEC_DROPS]);
+  #undef MET_LINE
+}
+
+typedef struct { int port; const char *stats_path; atomic_bool stop; } MetricsExport;
+
+static int met_listen(int port, int backlog){
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd<0) return -1;
+  int one = 1; setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in a = {0};
+  a.sin_family = AF_INET; a.sin_port = htons((Uint16)port); a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(fd, (struct sockaddr*)&a, sizeof a)!=0 || listen(fd, backlog)!=0){ close(fd); return -1; }
+  return fd;
+}
+
+// The soft descriptor limit is often 1024 well under the hard one; servers take all they may.
+static void fd_limit_raise(void){
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE, &rl)==0 && rl.rlim_cur < rl.rlim_max){ rl.rlim_cur = rl.rlim_max; setrlimit(RLIMIT_NOFILE, &rl); }
+}
+
+// Out of descriptors, accept fails but leaves the connection queued, so the
+// listener stays readable and the loop would spin; it sits out ACCEPT_PAUSE_MS.
+#define ACCEPT_PAUSE_MS 100
+static int accept_or_pause(int lfd, Uint32 *paused){
+  int fd = accept(lfd, NULL, NULL);
+  if(fd<0 && (errno==EMFILE || errno==ENFILE)) *paused = SDL_GetTicks() | 1;
+  return fd;
+}
+static short listen_events(Uint32 *paused){
+  if(*paused && SDL_GetTicks() - *paused < ACCEPT_PAUSE_MS) return 0;
+  *paused = 0; return POLLIN;
+}
+
+// One request per connection; anything but GET /metrics (or /) is a 404.
+static void met_serve(int fd, double ticks_per_sec){
+  struct timeval tv = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  char req[512]; ssize_t n = recv(fd, req, sizeof req - 1, 0);
+  req[n>0 ? n : 0] = 0;
+  static char body[16384]; char head[160];
+  TextBuf tb = { body, 0, sizeof body }; body[0] = 0;
+  bool ok = !strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6);
+  if(ok) met_render(&tb, ticks_per_sec); else tb_printf(&tb, "not found\n");
+  int hn = snprintf(head, sizeof head, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                    ok ? "200 OK" : "404 Not Found", tb.n);
+  if(send(fd, head, (size_t)hn, 0)==hn) send(fd, body, tb.n, 0);
+  close(fd);
+}
+
+static void met_write_file(const char *path, double ticks_per_sec){
+  static char body[16384];
+  TextBuf tb = { body, 0, sizeof body }; body[0] = 0;
+  met_render(&tb, ticks_per_sec);
+  write_file_atomic(path, body, tb.n);
+}
+
+static int metrics_thread(void *arg){
+  MetricsExport *me = arg;
+  int lfd = me->port ? met_listen(me->port, 8) : -1;
+  if(me->port && lfd<0) fprintf(stderr,"metrics: cannot listen on 127.0.0.1:%d\n", me->port);
+  Uint64 last_ticks = 0; Uint32 last_ms = SDL_GetTicks(), paused = 0; double tps = 0;
+  while(!atomic_load(&me->stop)){
+    if(lfd>=0){
+      struct pollfd p = { lfd, listen_events(&paused), 0 };
+      if(poll(&p, 1, 250)>0 && p.revents & POLLIN){ int c = accept_or_pause(lfd, &paused); if(c>=0) met_serve(c, tps); }
+    } else SDL_Delay(250);
+    Uint32 ms = SDL_GetTicks();
+    if(ms - last_ms >= 1000){
+      Uint64 ticks = atomic_load_explicit(&met_main.v[MET_TICKS], memory_order_relaxed);
+      tps = (double)(ticks - last_ticks) * 1000.0 / (ms - last_ms);
+      last_ticks = ticks; last_ms = ms;
+      if(me->stats_path) met_write_file(me->stats_path, tps);
+    }
+  }
+  if(lfd>=0) close(lfd);
+  return 0;
+}
+
+// Time-travel ring: the last TT_SEGMENTS seconds of per-tick snapshots, plus
+// the actions applied on each tick. A segment opens with a full keyframe;
+// every later tick is XOR'd against the previous one (with the tick counter
+// pre-advanced, since it is implied) and stored as (zero run, literal run,
+// literals) varint tokens up to the last change - typically ~5 bytes a tick.
+// A segment that fills early simply starts the next one sooner.
+#define TT_SEGMENTS 120
+#define TT_SEG_TICKS SIM_HZ
+#define TT_SEG_BYTES 2048
+#define TT_MAX_ACTS 15
+
+typedef struct {
+  Uint32 first_tick;
+  int count, used;              // ticks stored, bytes of data used
+  Uint16 off[TT_SEG_TICKS];     // record start per tick
+  Uint8 data[TT_SEG_BYTES];
+} TTSegment;
+
+typedef struct {
+  TTSegment seg[TT_SEGMENTS];
+  int head, nseg;               // head = newest segment
+  Uint8 prev[SNAP_BYTES];       // last packed state, the XOR reference
+} TimeTravel;
+
+static int put_varint(Uint8 *b, Uint32 v){
+  int n=0;
+  do { b[n] = (Uint8)(v & 0x7F); v >>= 7; if(v) b[n] |= 0x80; n++; } while(v);
+  return n;
+}
+static Uint32 get_varint(const Uint8 **p){
+  Uint32 v=0; int shift=0; Uint8 b;
+  do { b = *(*p)++; v |= (Uint32)(b&0x7F)<<shift; shift+=7; } while(b&0x80);
+  return v;
+}
+
+static void tt_clear(TimeTravel *tt){ tt->head=0; tt->nseg=0; }
+
+static int tt_encode_delta(const Uint8 *prev, const Uint8 *cur, Uint8 *out){
+  int n=0, i=0;
+  while(i<SNAP_BYTES){
+    int z=i; while(z<SNAP_BYTES && prev[z]==cur[z]) z++;
+    if(z==SNAP_BYTES) break; // trailing run is implied by the record length
+    int l=z; // literal run ends at two equal bytes in a row (or the end)
+    while(l<SNAP_BYTES && !(prev[l]==cur[l] && (l+1==SNAP_BYTES || prev[l+1]==cur[l+1]))) l++;
+    n += put_varint(out+n, (Uint32)(z-i)); n += put_varint(out+n, (Uint32)(l-z));
+    for(int k=z;k<l;k++) out[n++] = prev[k]^cur[k];
+    i = l;
+  }
+  return n;
+}
+
+// Records state at g->tick (before this tick's actions) and those actions.
+static void tt_record(TimeTravel *tt, const Game *g, const Uint8 *acts, int nacts){
+  Uint8 cur[SNAP_BYTES], rec[1 + TT_MAX_ACTS + SNAP_BYTES*2];
+  game_pack(g, cur);
+  if(nacts>TT_MAX_ACTS) nacts=TT_MAX_ACTS;
+  rec[0]=(Uint8)nacts; memcpy(rec+1,acts,(size_t)nacts);
+  int n = 1+nacts;
+  TTSegment *s = tt->nseg ? &tt->seg[tt->head] : NULL;
+  if(s && g->tick != s->first_tick + (Uint32)s->count){ tt_clear(tt); s = NULL; } // history jumped (restart)
+  bool key = !s || s->count==TT_SEG_TICKS;
+  if(!key){
+    put_u32(tt->prev + SNAP_TICK, g->tick);
+    n += tt_encode_delta(tt->prev, cur, rec+n);
+    key = s->used + n > TT_SEG_BYTES;
+  }
+  if(key){
+    tt->head = tt->nseg ? (tt->head+1)%TT_SEGMENTS : 0;
+    if(tt->nseg<TT_SEGMENTS) tt->nseg++;
+    s = &tt->seg[tt->head];
+    s->first_tick = g->tick; s->count = 0; s->used = 0;
+    n = 1+nacts; memcpy(rec+n, cur, SNAP_BYTES); n += SNAP_BYTES;
+  }
+  s->off[s->count++] = (Uint16)s->used;
+  memcpy(s->data + s->used, rec, (size_t)n); s->used += n;
+  memcpy(tt->prev, cur, SNAP_BYTES);
+}
+
+// Applies record idx of s to state (which must hold record idx-1 unless idx
+// is the keyframe) and returns its actions.
+static int tt_decode(const TTSegment *s, int idx, Uint8 *state, Uint8 *acts){
+  const Uint8 *p = s->data + s->off[idx];
+  const Uint8 *end = s->data + (idx+1<s->count ? s->off[idx+1] : s->used);
+  int nacts = *p++;
+  memcpy(acts, p, (size_t)nacts); p += nacts;
+  if(idx==0){ memcpy(state, p, SNAP_BYTES); return nacts; }
+  put_u32(state + SNAP_TICK, s->first_tick + (Uint32)idx);
+  for(int i=0;p<end;){
+    i += (int)get_varint(&p);
+    int l = (int)get_varint(&p);
+    for(;l;l--,i++) state[i] ^= *p++;
+  }
+  return nacts;
+}
+
+static int tt_oldest(const TimeTravel *tt){ return (tt->head - tt->nseg + 1 + TT_SEGMENTS) % TT_SEGMENTS; }
+static Uint32 tt_first_tick(const TimeTravel *tt){ return tt->seg[tt_oldest(tt)].first_tick; }
+static Uint32 tt_last_tick(const TimeTravel *tt){ const TTSegment *s=&tt->seg[tt->head]; return s->first_tick + (Uint32)s->count - 1; }
+
+static const TTSegment *tt_find(const TimeTravel *tt, Uint32 tick){
+  for(int i=0;i<tt->nseg;i++){
+    const TTSegment *s = &tt->seg[(tt->head - i + TT_SEGMENTS) % TT_SEGMENTS];
+    if(tick >= s->first_tick && tick < s->first_tick + (Uint32)s->count) return s;
+  }
+  return NULL;
+}
+
+static bool tt_restore(const TimeTravel *tt, Uint32 tick, Game *out){
+  const TTSegment *s = tt_find(tt, tick);
+  if(!s) return false;
+  Uint8 state[SNAP_BYTES], acts[TT_MAX_ACTS];
+  for(int i=0;i<=(int)(tick - s->first_tick);i++) tt_decode(s, i, state, acts);
+  game_unpack(out, state);
+  return true;
+}
+
+// Writes a replay that starts at `tick` and replays every recorded action up
+// to the newest tick in the ring, with checkpoints, so it can be --verify'd.
+static bool tt_dump(const TimeTravel *tt, Uint32 tick, const char *path){
+  const TTSegment *s = tt_find(tt, tick);
+  if(!s) return false;
+  Uint8 state[SNAP_BYTES], acts[TT_MAX_ACTS];
+  for(int i=0;i<(int)(tick - s->first_tick);i++) tt_decode(s, i, state, acts);
+  ReplayWriter w = {0};
+  for(Uint32 t=tick, last=tt_last_tick(tt); t<=last; t++){
+    s = tt_find(tt, t);
+    int n = tt_decode(s, (int)(t - s->first_tick), state, acts); // keyframes reset state, so chaining works
+    Game g; game_unpack(&g, state);
+    if(t==tick) replay_begin(&w, &g);
+    else if(n || t%REPLAY_CHECK_TICKS==0 || t==last) replay_put_check(&w, t, game_checksum(&g));
+    for(int i=0;i<n;i++) replay_put(&w, t, acts[i]);
+  }
+  bool ok = replay_save(&w, path);
+  free(w.buf);
+  return ok;
+}
+
+// Spectator gateway: a WebSocket server on 127.0.0.1:PORT for browser
+// overlays, on its own thread and fed only from the published state, so
+// nothing it does can hold up the game. Each frame is encoded once,
+// WebSocket header and all, into a shared ring; a subscriber is only a
+// cursor into it, and its socket is written straight from the ring with
+// sendmsg. A frame's payload is 'K' and the packed snapshot (game_pack), or
+// 'D' and the time-travel ring's XOR tokens against the frame before. A
+// keyframe goes out every SPEC_KEY_MS and whenever a new game starts, and
+// subscribers join at the newest one. One SPEC_LAG frames behind skips to
+// the newest keyframe at its next frame boundary; one whose half-sent frame
+// has been overwritten is dropped.
+#define SPEC_FRAME_MS 16
+#define SPEC_KEY_MS 1000
+#define SPEC_RING (1<<20)
+#define SPEC_FRAMES 4096 // frame descriptors kept; a power of two
+#define SPEC_LAG 64
+#define SPEC_MAX 4096
+#define SPEC_REQ 2048
+#define SPEC_IOV 32
+
+typedef struct { Uint64 at; Uint32 len; } SpecFrame;
+typedef struct { int fd; bool open; Uint64 seq; Uint32 off; char req[SPEC_REQ]; int nreq; char resp[192]; int nresp; } SpecSub;
+
+typedef struct {
+  int port; atomic_bool stop;
+  Uint8 ring[SPEC_RING]; Uint64 head;   // bytes ever written
+  SpecFrame frame[SPEC_FRAMES]; Uint64 nframes, last_key;
+  SpecSub sub[SPEC_MAX]; int nsub;
+} Spectate;
+
+// SHA-1 and base64, for the handshake's Sec-WebSocket-Accept and nothing else.
+static Uint32 rol32(Uint32 v, int n){ return v<<n | v>>(32-n); }
+
+static void sha1(const Uint8 *m, size_t n, Uint8 out[20]){
+  Uint32 h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  size_t total = (n + 8)/64*64 + 64;
+  for(size_t blk=0; blk<total; blk+=64){
+    Uint8 b[64]; Uint32 w[80];
+    for(size_t i=0;i<64;i++){
+      size_t at = blk+i;
+      b[i] = at<n ? m[at] : at==n ? 0x80 : at>=total-8 ? (Uint8)((Uint64)n*8 >> 8*(total-1-at)) : 0;
+    }
+    for(int i=0;i<16;i++) w[i] = (Uint32)b[4*i]<<24 | (Uint32)b[4*i+1]<<16 | (Uint32)b[4*i+2]<<8 | b[4*i+3];
+    for(int i=16;i<80;i++) w[i] = rol32(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+    Uint32 a=h[0], bb=h[1], c=h[2], d=h[3], e=h[4];
+    for(int i=0;i<80;i++){
+      Uint32 f = i<20 ? (bb&c)|(~bb&d) : i<40 ? bb^c^d : i<60 ? (bb&c)|(bb&d)|(c&d) : bb^c^d;
+      Uint32 k = i<20 ? 0x5A827999 : i<40 ? 0x6ED9EBA1 : i<60 ? 0x8F1BBCDC : 0xCA62C1D6;
+      Uint32 t = rol32(a,5) + f + e + k + w[i];
+      e = d; d = c; c = rol32(bb,30); bb = a; a = t;
+    }
+    h[0]+=a; h[1]+=bb; h[2]+=c; h[3]+=d; h[4]+=e;
+  }
+  for(int i=0;i<20;i++) out[i] = (Uint8)(h[i/4] >> (24 - 8*(i%4)));
+}
+
+static int base64(const Uint8 *in, int n, char *out){
+  static const char A[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int o = 0;
+  for(int i=0;i<n;i+=3){
+    Uint32 v = (Uint32)in[i]<<16 | (i+1<n ? (Uint32)in[i+1]<<8 : 0) | (i+2<n ? in[i+2] : 0);
+    out[o++] = A[v>>18]; out[o++] = A[v>>12 & 63];
+    out[o++] = i+1<n ? A[v>>6 & 63] : '='; out[o++] = i+2<n ? A[v & 63] : '=';
+  }
+  out[o] = 0;
+  return o;
+}
+
+// Appends one unmasked binary message to the ring.
+static void spec_push(Spectate *sp, bool key, const Uint8 *payload, int n){
+  Uint8 h[11]; int nh = 0;
+  h[nh++] = 0x82; // FIN, binary
+  if(n+1 < 126) h[nh++] = (Uint8)(n+1);
+  else { h[nh++] = 126; h[nh++] = (Uint8)((n+1)>>8); h[nh++] = (Uint8)(n+1); }
+  h[nh++] = key ? 'K' : 'D';
+  SpecFrame *f = &sp->frame[sp->nframes & (SPEC_FRAMES-1)];
+  f->at = sp->head; f->len = (Uint32)(nh + n);
+  for(int part=0; part<2; part++){
+    const Uint8 *src = part ? payload : h; int len = part ? n : nh;
+    size_t at = (size_t)(sp->head % SPEC_RING), first = imin(len, (int)(SPEC_RING - at));
+    memcpy(sp->ring + at, src, first); memcpy(sp->ring, src + first, (size_t)len - first);
+    sp->head += (Uint64)len;
+  }
+  if(key) sp->last_key = sp->nframes;
+  sp->nframes++;
+}
+
+static bool spec_live(const Spectate *sp, Uint64 seq){
+  return sp->nframes - seq <= SPEC_FRAMES && sp->frame[seq & (SPEC_FRAMES-1)].at + SPEC_RING >= sp->head;
+}
+
+// As much of the backlog as the socket takes, from the ring itself; false drops the subscriber.
+static bool spec_feed(Spectate *sp, SpecSub *s){
+  if(s->nresp){
+    ssize_t k = send(s->fd, s->resp, (size_t)s->nresp, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(k<0) return errno==EAGAIN || errno==EWOULDBLOCK;
+    s->nresp -= (int)k; memmove(s->resp, s->resp+k, (size_t)s->nresp);
+    if(s->nresp) return true;
+  }
+  while(s->seq < sp->nframes){
+    if(!spec_live(sp, s->seq)){ if(s->off) return false; s->seq = sp->last_key; met_add(&met_spec, MET_SPEC_SKIPS, 1); }
+    else if(!s->off && sp->nframes - s->seq > SPEC_LAG && s->seq < sp->last_key){ s->seq = sp->last_key; met_add(&met_spec, MET_SPEC_SKIPS, 1); }
+    struct iovec iov[SPEC_IOV]; int niov = 0;
+    for(Uint64 q=s->seq; q<sp->nframes && niov+2<=SPEC_IOV; q++){
+      const SpecFrame *f = &sp->frame[q & (SPEC_FRAMES-1)];
+      Uint32 skip = q==s->seq ? s->off : 0;
+      size_t at = (size_t)((f->at + skip) % SPEC_RING), len = f->len - skip, first = len < SPEC_RING - at ? len : SPEC_RING - at;
+      iov[niov++] = (struct iovec){ sp->ring + at, first };
+      if(len > first) iov[niov++] = (struct iovec){ sp->ring, len - first };
+    }
+    struct msghdr msg = {0}; msg.msg_iov = iov; msg.msg_iovlen = (size_t)niov;
+    ssize_t k = sendmsg(s->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(k<0) return errno==EAGAIN || errno==EWOULDBLOCK;
+    for(Uint64 left = (Uint64)k; left;){ // advance the cursor over what went
+      Uint32 rest = sp->frame[s->seq & (SPEC_FRAMES-1)].len - s->off;
+      if(left < rest){ s->off += (Uint32)left; break; }
+      left -= rest; s->off = 0; s->seq++;
+    }
+    if(s->off) return true; // the socket is full
+  }
+  return true;
+}
+
+// Reads the upgrade request; once it is whole, queues the 101 and starts the
+// subscriber at the newest keyframe. False for anything that isn't one.
+static bool spec_handshake(Spectate *sp, SpecSub *s){
+  ssize_t k = recv(s->fd, s->req + s->nreq, sizeof s->req - 1 - (size_t)s->nreq, MSG_DONTWAIT);
+  if(k<0) return errno==EAGAIN || errno==EWOULDBLOCK;
+  if(!k) return false;
+  s->nreq += (int)k; s->req[s->nreq] = 0;
+  if(!strstr(s->req, "\r\n\r\n")) return s->nreq < (int)sizeof s->req - 1;
+  if(strncmp(s->req, "GET ", 4)) return false;
+  const char *key = NULL;
+  for(char *line = s->req; (line = strstr(line, "\r\n")); ) if(!strncasecmp(line += 2, "Sec-WebSocket-Key:", 18)){ key = line + 18; break; }
+  if(!key) return false;
+  while(*key==' ') key++;
+  char in[128], acc[32]; int n = 0;
+  while(key[n] && key[n]!='\r' && key[n]!=' ' && n<64){ in[n] = key[n]; n++; }
+  memcpy(in+n, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+  Uint8 d[20]; sha1((const Uint8*)in, (size_t)n+36, d); base64(d, 20, acc);
+  s->nresp = snprintf(s->resp, sizeof s->resp, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", acc);
+  s->open = true; s->seq = sp->nframes ? sp->last_key : 0; s->off = 0;
+  return true;
+}
+
+static int spectate_thread(void *arg){
+  Spectate *sp = arg;
+  int lfd = met_listen(sp->port, SOMAXCONN); // overlays reconnect in herds
+  if(lfd<0){ fprintf(stderr,"spectate: cannot listen on 127.0.0.1:%d\n", sp->port); return 1; }
+  fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+  fd_limit_raise();
+  static struct pollfd pf[1+SPEC_MAX];
+  static Uint8 prev[PUB_WORDS*4], cur[PUB_WORDS*4], enc[2*SNAP_BYTES + 16];
+  unsigned last_seq = 0; Uint32 next_ms = SDL_GetTicks(), key_ms = 0, paused = 0;
+  while(!atomic_load(&sp->stop)){
+    pf[0] = (struct pollfd){ lfd, listen_events(&paused), 0 };
+    for(int i=0;i<sp->nsub;i++){
+      const SpecSub *s = &sp->sub[i];
+      bool backlog = s->nresp || (s->open && s->seq < sp->nframes);
+      pf[1+i] = (struct pollfd){ s->fd, (short)(POLLIN | (backlog ? POLLOUT : 0)), 0 };
+    }
+    Uint32 ms = SDL_GetTicks();
+    poll(pf, (nfds_t)(1+sp->nsub), (int)imax(0, imin(SPEC_FRAME_MS, (int)(next_ms - ms))));
+
+    ms = SDL_GetTicks();
+    bool pushed = false;
+    if((int)(ms - next_ms) >= 0){
+      next_ms = (int)(ms - next_ms) > 250 ? ms + SPEC_FRAME_MS : next_ms + SPEC_FRAME_MS;
+      unsigned seq = state_read_raw(&state_pub, cur);
+      if(seq && seq!=last_seq){
+        bool key = !last_seq || snap_tick(cur) < snap_tick(prev) || ms - key_ms >= SPEC_KEY_MS; // a new game restarts the tick
+        if(key){ spec_push(sp, true, cur, SNAP_BYTES); key_ms = ms; }
+        else spec_push(sp, false, enc, tt_encode_delta(prev, cur, enc));
+        memcpy(prev, cur, SNAP_BYTES); last_seq = seq; pushed = true;
+      }
+    }
+
+    for(int i=0;i<sp->nsub;i++){
+      SpecSub *s = &sp->sub[i];
+      bool ok = true, feed = pushed || pf[1+i].revents & POLLOUT; // a full socket isn't retried until it drains
+      if(pf[1+i].revents & (POLLIN|POLLHUP|POLLERR)){
+        if(!s->open){ ok = spec_handshake(sp, s); feed = true; }
+        else { // anything a browser sends is a ping or a close; closing is all that matters
+          Uint8 b[256]; ssize_t k = recv(s->fd, b, sizeof b, MSG_DONTWAIT);
+          ok = k>0 ? (b[0]&0x0F)!=8 : k<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
+        }
+      }
+      if(ok && feed && (s->open || s->nresp)) ok = spec_feed(sp, s);
+      if(!ok){ close(s->fd); met_add(&met_spec, MET_SPEC_DROPS, s->open); sp->nsub--; sp->sub[i] = sp->sub[sp->nsub]; pf[1+i] = pf[1+sp->nsub]; i--; }
+    }
+    if(pf[0].revents & POLLIN) for(int fd; (fd = accept_or_pause(lfd, &paused))>=0;){
+      if(sp->nsub==SPEC_MAX){ close(fd); continue; }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      SpecSub *s = &sp->sub[sp->nsub++];
+      s->fd = fd; s->open = false; s->nreq = s->nresp = 0;
+    }
+  }
+  for(int i=0;i<sp->nsub;i++) close(sp->sub[i].fd);
+  close(lfd);
+  return 0;
+}
+
+// Board-state database: every distinct (board, current piece) seen, keyed by a
+// Zobrist hash, in an mmap'd open-addressing table. Growth allocates a table of
+// twice the size and migrates old slots a chunk at a time on later inserts, so
+// no single insert ever pays for a full rehash.
+#define SDB_MAGIC 0x3142445342494349ULL // "ICIBSDB1"
+#define SDB_MIN_CAP (1u<<16)
+#define SDB_MIGRATE_CHUNK 256
+#define SDB_MAX_VISITS 4096             // per game, before the rest are dropped
+
+typedef struct {
+  Uint64 key;          // 0 = empty slot
+  Uint32 visits;
+  Uint32 best_gain;    // best score gained from here to game end
+  Uint64 sum_gain;     // score gained from here to game end
+  Uint64 sum_lines;    // lines cleared from here to game end
+  Uint64 sum_pieces;   // pieces survived from here to game end
+} StateEntry;
+
+typedef struct {
+  Uint64 magic;
+  Uint64 cap;          // slots, power of two
+  Uint64 count;
+  Uint64 games;
+  Uint64 reserved[4];
+} StateHeader;
+
+typedef struct {
+  StateHeader *h;
+  StateEntry *slots;
+  size_t bytes;
+} StateTable;
+
+typedef struct { Uint64 key; int score, lines, pieces; } StateVisit;
+
+typedef struct {
+  char path[512], grow_path[520];
+  StateTable cur, old;   // old.h != NULL while a migration is in flight
+  Uint64 mig;            // next old slot to migrate
+  StateVisit visits[SDB_MAX_VISITS];
+  int nvisits;
+} StateDB;
+
+static Uint64 zobrist_cell[ROWS][COLS];
+static Uint64 zobrist_piece[7];
+
+static Uint64 splitmix64(Uint64 *s){
+  Uint64 z = (*s += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+  return z ^ (z>>31);
+}
+
+// Keys are persisted on disk, so they come from a fixed seed rather than rand().
+static void zobrist_init(){
+  Uint64 s = 0x1CEB0B6E5ULL;
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) zobrist_cell[r][c]=splitmix64(&s);
+  for(int k=0;k<7;k++) zobrist_piece[k]=splitmix64(&s);
+}
+
+static Uint64 state_hash(const Game *g){
+  Uint64 h = zobrist_piece[g->cur.k];
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) if(CELL(g,r,c).filled) h ^= zobrist_cell[r][c];
+  return h ? h : 1; // 0 marks empty slots
+}
+
+static bool sdb_map(StateTable *t, const char *path, Uint64 cap, bool create){
+  int fd = open(path, O_RDWR | (create?O_CREAT|O_TRUNC:0), 0644);
+  if(fd<0) return false;
+  if(!create){ // a truncated copy would map past EOF and die of SIGBUS on first touch
+    StateHeader h; struct stat st;
+    if(read(fd,&h,sizeof h)!=(ssize_t)sizeof h || h.magic!=SDB_MAGIC || !h.cap || (h.cap&(h.cap-1)) || fstat(fd,&st)!=0
+       || h.cap > (Uint64)(st.st_size - (off_t)sizeof h)/sizeof(StateEntry)){ close(fd); return false; }
+    cap = h.cap;
+  }
+  size_t bytes = sizeof(StateHeader) + (size_t)cap*sizeof(StateEntry);
+  if(create && ftruncate(fd,(off_t)bytes)!=0){ close(fd); return false; }
+  void *mem = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(mem==MAP_FAILED) return false;
+  t->h = mem; t->slots = (StateEntry*)(t->h+1); t->bytes = bytes;
+  if(create){ t->h->magic=SDB_MAGIC; t->h->cap=cap; }
+  return true;
+}
+
+static void sdb_unmap(StateTable *t){
+  if(t->h) munmap(t->h, t->bytes);
+  memset(t,0,sizeof *t);
+}
+
+// Linear probe; returns the slot holding key, or the empty slot it would go in.
+static StateEntry *sdb_probe(const StateTable *t, Uint64 key){
+  Uint64 mask = t->h->cap-1;
+  for(Uint64 i=key&mask;;i=(i+1)&mask){
+    StateEntry *e = &t->slots[i];
+    if(e->key==key || !e->key) return e;
+  }
+}
+
+static void sdb_finish_growth(StateDB *db){
+  sdb_unmap(&db->old);
+  rename(db->grow_path, db->path);
+}
+
+static void sdb_migrate(StateDB *db, Uint64 n){
+  if(!db->old.h) return;
+  Uint64 cap = db->old.h->cap;
+  for(;n && db->mig<cap;n--,db->mig++){
+    const StateEntry *src = &db->old.slots[db->mig];
+    if(!src->key) continue;
+    StateEntry *dst = sdb_probe(&db->cur, src->key);
+    if(dst->key) continue; // already pulled forward by an insert
+    *dst = *src; db->cur.h->count++;
+  }
+  if(db->mig>=cap) sdb_finish_growth(db);
+}
+
+static void sdb_grow(StateDB *db){
+  StateTable next = {0};
+  if(!sdb_map(&next, db->grow_path, db->cur.h->cap*2, true)) return; // keep probing the full-ish table
+  next.h->games = db->cur.h->games;
+  db->old = db->cur; db->cur = next; db->mig = 0;
+}
+
+static const StateEntry *sdb_lookup(const StateDB *db, Uint64 key){
+  if(!db->cur.h) return NULL;
+  const StateEntry *e = sdb_probe(&db->cur, key);
+  if(!e->key && db->old.h) e = sdb_probe(&db->old, key);
+  return e->key ? e : NULL;
+}
+
+static StateEntry *sdb_upsert(StateDB *db, Uint64 key){
+  sdb_migrate(db, SDB_MIGRATE_CHUNK);
+  StateEntry *e = sdb_probe(&db->cur, key);
+  if(e->key) return e;
+  if(db->cur.h->count*10 > db->cur.h->cap*9) return NULL; // growth failed; stay probe-able
+  if(db->old.h){
+    const StateEntry *o = sdb_probe(&db->old, key);
+    if(o->key) *e = *o;
+  }
+  e->key = key; db->cur.h->count++;
+  if(!db->old.h && db->cur.h->count*10 > db->cur.h->cap*7){
+    sdb_grow(db);
+    e = sdb_probe(&db->cur, key); // moved along with the rest (or still here)
+    if(!e->key){ e->key=key; db->cur.h->count++; }
+  }
+  return e;
+}
+
+static bool sdb_open(StateDB *db, const char *path){
+  memset(db,0,sizeof *db);
+  snprintf(db->path, sizeof db->path, "%s", path);
+  snprintf(db->grow_path, sizeof db->grow_path, "%s.grow", path);
+  if(sdb_map(&db->cur, path, 0, false)) return true;
+  return access(path, F_OK)!=0 && sdb_map(&db->cur, path, SDB_MIN_CAP, true); // never write over a file we can't read
+}
+
+static void sdb_note(StateDB *db, const Game *g){
+  if(!db->cur.h || db->nvisits>=SDB_MAX_VISITS) return;
+  db->visits[db->nvisits++] = (StateVisit){ state_hash(g), g->score, g->lines, g->pieces };
+}
+
+// Outcomes are only known at game end, so visits are buffered and folded in here.
+static void sdb_end_game(StateDB *db, const Game *g){
+  if(!db->cur.h || !db->nvisits) return;
+  for(int i=0;i<db->nvisits;i++){
+    const StateVisit *v = &db->visits[i];
+    StateEntry *e = sdb_upsert(db, v->key);
+    if(!e) break;
+    Uint32 gain = (Uint32)imax(0, g->score - v->score);
+    e->visits++;
+    if(gain > e->best_gain) e->best_gain = gain;
+    e->sum_gain += gain;
+    e->sum_lines += (Uint64)imax(0, g->lines - v->lines);
+    e->sum_pieces += (Uint64)imax(0, g->pieces - v->pieces);
+  }
+  db->cur.h->games++;
+  db->nvisits = 0;
+}
+
+static void sdb_close(StateDB *db){
+  if(db->old.h) sdb_migrate(db, db->old.h->cap);
+  sdb_unmap(&db->cur);
+}
+
+// Headless play: random rotation + column, then hard drop. Used to seed the
+// database and as a stand-in for recorded games.
+static void headless_random_place(Game *g){
+  int rot = rand()%4;
+  for(int i=0;i<rot;i++) attempt_rotate(g,true);
+  int dx = rand()%COLS - COLS/2;
+  for(int step=dx<0?-1:1; dx && !collide(g,&g->cur,g->cur.x+step,g->cur.y); dx-=step) g->cur.x+=step;
+  hard_drop(g);
+}
+
+static int statedb_fill(const char *path, int games){
+  StateDB *db = malloc(sizeof *db);
+  if(!db || !sdb_open(db, path)){ fprintf(stderr,"statedb: cannot open %s\n", path); free(db); return 1; }
+  Game g;
+  for(int i=0;i<games;i++){
+    game_reset(&g, (Uint32)rand());
+    int last = -1;
+    while(!g.game_over){
+      if(g.pieces!=last){ sdb_note(db,&g); last=g.pieces; }
+      headless_random_place(&g);
+    }
+    sdb_end_game(db,&g);
+  }
+  printf("statedb: %s now holds %llu states from %llu games\n", path,
+         (unsigned long long)db->cur.h->count, (unsigned long long)db->cur.h->games);
+  sdb_close(db); free(db);
+  return 0;
+}
+
+static int statedb_info(const char *path){
+  StateDB *db = malloc(sizeof *db);
+  if(!db || !sdb_open(db, path)){ fprintf(stderr,"statedb: cannot open %s\n", path); free(db); return 1; }
+  const StateHeader *h = db->cur.h;
+  printf("states %llu  capacity %llu  load %.2f  games %llu\n", (unsigned long long)h->count,
+         (unsigned long long)h->cap, (double)h->count/(double)h->cap, (unsigned long long)h->games);
+  const StateEntry *top = NULL;
+  for(Uint64 i=0;i<h->cap;i++) if(db->cur.slots[i].key && (!top || db->cur.slots[i].visits>top->visits)) top=&db->cur.slots[i];
+  if(top) printf("most visited %016llx: %u visits, avg +%.0f pts, avg %.1f pieces after\n", (unsigned long long)top->key,
+                 top->visits, (double)top->sum_gain/top->visits, (double)top->sum_pieces/top->visits);
+  sdb_close(db); free(db);
+  return 0;
+}
+
+// Placement bot. Every placement of the current piece (and of the hold piece,
+// if holding is allowed) is played out on a scratch copy by the engine itself -
+// turns, then shifts, then a hard drop - so a plan is exactly the actions that
+// reproduce it. Each result is scored by a small int8 MLP over bit-planes of
+// the board it leaves:
+//   [0,200) filled   [200,400) holes (empty, covered)   [400,600) at or under the column top
+//   600..603 lines cleared (one-hot 1..4)   604 topped out
+// Inputs are 0/1 bytes; the hidden layer is int8 weights, int32 sums and bias,
+// shifted down and clamped to 0..127 (ReLU); the output is an int8 dot plus bias.
+// Weights come from a .ibn file (see net_load) or the built-in starter net.
+#define NN_INPUTS 608 // planes plus one-hots, padded to a multiple of 32
+#define NN_MAX_HIDDEN 256
+#define NN_MAGIC 0x4E4E4249u // "IBNN"
+#define NN_VERSION 1
+#define MAX_PLACEMENTS 96 // 2 pieces x 4 turns x (COLS+2) targets, before duplicates go
+
+typedef struct {
+  int hidden, shift;                     // hidden is padded to a multiple of 32 with zero units
+  Sint8 w1[NN_MAX_HIDDEN][NN_INPUTS]; Sint32 b1[NN_MAX_HIDDEN];
+  Sint8 w2[NN_MAX_HIDDEN]; Sint32 b2;
+} Net;
+
+typedef struct { Uint8 hold, turns; Sint8 x; Uint8 lines; } Placement;
+
+// Sum of a[i]*w[i]; n is a multiple of 32. a is at most 127 (u8), so the
+// pairwise 16-bit sums maddubs forms cannot saturate.
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2"))) static Sint32 nn_hsum(__m256i v){
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return _mm_cvtsi128_si32(s);
+}
+__attribute__((target("avx2"))) static Sint32 nn_dot_avx2(const Uint8 *a, const Sint8 *w, int n){
+  __m256i acc = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+  for(int i=0;i<n;i+=32){
+    __m256i p = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(w+i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
+  }
+  return nn_hsum(acc);
+}
+// Four hidden units at once: each input chunk is loaded once for all four.
+__attribute__((target("avx2"))) static void nn_dot4_avx2(const Uint8 *a, const Sint8 *w, Sint32 *out){
+  __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0, ones = _mm256_set1_epi16(1);
+  for(int i=0;i<NN_INPUTS;i+=32){
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+    s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w+0*NN_INPUTS+i))), ones));
+    s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w+1*NN_INPUTS+i))), ones));
+    s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w+2*NN_INPUTS+i))), ones));
+    s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w+3*NN_INPUTS+i))), ones));
+  }
+  out[0] = nn_hsum(s0); out[1] = nn_hsum(s1); out[2] = nn_hsum(s2); out[3] = nn_hsum(s3);
+}
+#endif
+#ifndef __AVX2__
+static Sint32 nn_dot_c(const Uint8 *a, const Sint8 *w, int n){
+  Sint32 s = 0; for(int i=0;i<n;i++) s += a[i]*w[i];
+  return s;
+}
+static void nn_dot4_c(const Uint8 *a, const Sint8 *w, Sint32 *out){
+  for(int k=0;k<4;k++) out[k] = nn_dot_c(a, w+k*NN_INPUTS, NN_INPUTS);
+}
+static Sint32 (*nn_dot)(const Uint8 *a, const Sint8 *w, int n) = nn_dot_c; // see simd_init
+static void (*nn_dot4)(const Uint8 *a, const Sint8 *w, Sint32 *out) = nn_dot4_c;
+#else
+static Sint32 (*const nn_dot)(const Uint8 *a, const Sint8 *w, int n) = nn_dot_avx2;
+static void (*const nn_dot4)(const Uint8 *a, const Sint8 *w, Sint32 *out) = nn_dot4_avx2;
+#endif
+
+// Scores n input rows (NN_INPUTS bytes each).
+static void net_eval(const Net *net, const Uint8 *in, int n, Sint32 *out){
+  Uint8 h[NN_MAX_HIDDEN];
+  for(int i=0;i<n;i++){
+    const Uint8 *x = in + (size_t)i*NN_INPUTS;
+    for(int j=0;j<net->hidden;j+=4){
+      Sint32 s[4]; nn_dot4(x, net->w1[j], s);
+      for(int k=0;k<4;k++){ Sint32 v = s[k] + net->b1[j+k]; h[j+k] = (Uint8)(v<=0 ? 0 : imin(127, v>>net->shift)); }
+    }
+    out[i] = nn_dot(h, net->w2, net->hidden) + net->b2;
+  }
+}
+
+// Hand-set weights in the same shape a trained net has: aggregate height,
+// holes, bumpiness (one unit per sign of each neighbouring height step), lines
+// and topping out, weighted like the well-known four-feature heuristic. It
+// plays a sound game and is the baseline learned weights have to beat.
+static void net_starter(Net *net){
+  memset(net,0,sizeof *net);
+  net->hidden = 32; net->shift = 1;
+  int u = 0;
+  for(int i=0;i<ROWS*COLS;i++) net->w1[u][400+i] = 1;
+  net->w2[u++] = -51;
+  for(int i=0;i<ROWS*COLS;i++) net->w1[u][200+i] = 1;
+  net->w2[u++] = -36;
+  for(int c=0;c<COLS-1;c++) for(int sgn=1;sgn>=-1;sgn-=2){
+    for(int r=0;r<ROWS;r++){ net->w1[u][400+r*COLS+c] = (Sint8)(2*sgn); net->w1[u][400+r*COLS+c+1] = (Sint8)(-2*sgn); }
+    net->w2[u++] = -9;
+  }
+  for(int k=1;k<=4;k++) net->w1[u][599+k] = (Sint8)(2*k);
+  net->w2[u++] = 38;
+  net->w1[u][604] = 127; net->w2[u++] = -127;
+}
+
+// .ibn: magic, version byte, u16 inputs (must be NN_INPUTS), u16 hidden, u8
+// shift, then w1 (hidden x inputs int8, row per unit), b1 (int32 each), w2
+// (hidden int8), b2 (int32). Multi-byte values are little-endian.
+static bool net_load(Net *net, const char *path){
+  size_t len = 0;
+  Uint8 *b = read_file(path, &len);
+  if(!b){ fprintf(stderr,"%s: cannot open\n", path); return false; }
+  memset(net,0,sizeof *net);
+  int in = len>=10 ? b[5] | b[6]<<8 : 0, hid = len>=10 ? b[7] | b[8]<<8 : 0;
+  bool ok = len>=10 && get_u32(b)==NN_MAGIC && b[4]==NN_VERSION && in==NN_INPUTS && hid>=1 && hid<=NN_MAX_HIDDEN && b[9]<31
+         && len==10 + (size_t)hid*in + 4*(size_t)hid + (size_t)hid + 4;
+  if(ok){
+    const Uint8 *p = b+10;
+    net->shift = b[9]; net->hidden = (hid+31)/32*32;
+    for(int j=0;j<hid;j++,p+=in) memcpy(net->w1[j], p, (size_t)in);
+    for(int j=0;j<hid;j++,p+=4) net->b1[j] = (Sint32)get_u32(p);
+    memcpy(net->w2, p, (size_t)hid); p += hid;
+    net->b2 = (Sint32)get_u32(p);
+  } else fprintf(stderr,"%s: not a %d-input net\n", path, NN_INPUTS);
+  free(b);
+  return ok;
+}
+
+static bool net_save(const Net *net, const char *path){
+  FILE *f = fopen(path, "wb");
+  if(!f) return false;
+  Uint8 h[10]; put_u32(h, NN_MAGIC); h[4] = NN_VERSION;
+  h[5] = NN_INPUTS & 0xFF; h[6] = NN_INPUTS>>8; h[7] = (Uint8)net->hidden; h[8] = (Uint8)(net->hidden>>8); h[9] = (Uint8)net->shift;
+  bool ok = fwrite(h, 1, sizeof h, f)==sizeof h && fwrite(net->w1, 1, (size_t)net->hidden*NN_INPUTS, f)==(size_t)net->hidden*NN_INPUTS;
+  for(int j=0;j<net->hidden && ok;j++){ Uint8 b[4]; put_u32(b, (Uint32)net->b1[j]); ok = fwrite(b, 1, 4, f)==4; }
+  if(ok) ok = fwrite(net->w2, 1, (size_t)net->hidden, f)==(size_t)net->hidden;
+  if(ok){ Uint8 b[4]; put_u32(b, (Uint32)net->b2); ok = fwrite(b, 1, 4, f)==4; }
+  if(fclose(f)!=0) ok = false;
+  return ok;
+}
+
+static void bot_features(const Game *g, int lines, Uint8 *x){
+  memset(x, 0, NN_INPUTS);
+  for(int c=0;c<COLS;c++){
+    bool covered = false;
+    for(int r=0;r<ROWS;r++){
+      bool f = CELL(g,r,c).filled;
+      covered |= f;
+      x[r*COLS+c] = f; x[200+r*COLS+c] = covered && !f; x[400+r*COLS+c] = covered;
+    }
+  }
+  if(lines>=1 && lines<=4) x[599+lines] = 1;
+  x[604] = g->game_over && !game_finished(g);
+}
+
+// Plays pl out on s, a scratch copy without delays so the lock resolves on the
+// spot. Returns the actions it took (written to acts if not NULL), 0 if the
+// piece can't reach the column.
+static int bot_try(const Game *g, Placement pl, Game *s, Uint8 *acts){
+  Uint8 scratch[4+COLS+1]; int n = 0;
+  if(!acts) acts = scratch;
+  *s = *g; s->clear_ticks = s->are_ticks = 0;
+  if(pl.hold){ game_apply(s, acts[n++] = ACT_HOLD); if(s->game_over) return n; }
+  for(int k=0;k<pl.turns;k++) game_apply(s, acts[n++] = ACT_CW);
+  for(int k=0;k<COLS && s->cur.x!=pl.x;k++) game_apply(s, acts[n++] = s->cur.x>pl.x ? ACT_LEFT : ACT_RIGHT);
+  if(s->cur.x!=pl.x) return 0;
+  game_apply(s, acts[n++] = ACT_HARD);
+  return n;
+}
+
+// Every distinct placement, with its input row in x. Returns how many.
+static int bot_placements(const Game *g, Placement *out, Uint8 *x){
+  Uint32 seen[MAX_PLACEMENTS]; int n = 0;
+  Game s;
+  for(int hold=0; hold<=(g->can_hold ? 1 : 0); hold++) for(int turns=0;turns<4;turns++) for(int px=-2;px<COLS;px++){
+    Placement pl = { (Uint8)hold, (Uint8)turns, (Sint8)px, 0 };
+    if(!bot_try(g, pl, &s, NULL)) continue;
+    Uint32 crc = game_checksum(&s);
+    int i = 0; while(i<n && seen[i]!=crc) i++;
+    if(i<n) continue;
+    pl.lines = (Uint8)(s.lines - g->lines);
+    seen[n] = crc; out[n] = pl;
+    bot_features(&s, pl.lines, x + (size_t)n*NN_INPUTS);
+    n++;
+  }
+  return n;
+}
+
+// The best placement for the piece in play; false if there is nothing to place.
+static bool bot_choose(const Net *net, const Game *g, Placement *best){
+  static Uint8 x[MAX_PLACEMENTS*NN_INPUTS];
+  Placement pl[MAX_PLACEMENTS]; Sint32 score[MAX_PLACEMENTS];
+  if(g->game_over || g->phase) return false;
+  int n = bot_placements(g, pl, x);
+  if(!n) return false;
+  net_eval(net, x, n, score);
+  int b = 0; for(int i=1;i<n;i++) if(score[i]>score[b]) b = i;
+  *best = pl[b];
+  return true;
+}
+
+// Monte Carlo tree search over placements (hold included), shared by a pool
+// of worker threads. Nodes keep no game state: a node's position is replayed
+// from the root along the path, which costs a few bot_try calls and lets the
+// pool hold hundreds of thousands of nodes. The hidden future is sampled,
+// never read: before a node's children move, the scratch game's randomizer is
+// reseeded from that node's seed, so every sibling sees the same sampled next
+// piece, and rollouts reseed per piece. Children are ranked by PUCT with the
+// net's placement scores as priors; a thread passing through a child adds a
+// virtual loss (a visit worth 0) so the others spread out until it backs up
+// the real value. Leaves are valued by a short rollout - MCTS_DEPTH pieces,
+// each the best of MCTS_SAMPLES random placements by the net - squashed
+// against the root's own score.
+// The search is anytime: mcts_best reads the current favourite at any
+// moment, and mcts_stop ends it without waiting. It runs on worker threads,
+// or - with none - in bounded slices on the caller's thread (mcts_slice).
+#define MCTS_NODES (1<<18)
+#define MCTS_THREADS 16
+#define MCTS_DEPTH 6
+#define MCTS_SAMPLES 6
+#define MCTS_PUCT 1.5
+#define MCTS_PRIOR_T 100.0  // net score units per e-fold of prior
+#define MCTS_SCALE 400.0    // net score units per e-fold of value
+#define MCTS_LINE 150       // score per line cleared below the root
+enum { MCTS_LEAF, MCTS_BUSY, MCTS_OPEN };
+
+typedef struct {
+  Placement move; Uint32 seed; // move from the parent; seed the children's moves run under
+  float prior;
+  int first; atomic_int nkids, state;
+  atomic_int visits, vloss;
+  atomic_llong sum;            // value sum in 1/65536ths
+} MctsNode;
+
+typedef struct {
+  const Net *net;
+  int threads;                 // workers; 0 = searched in slices by the caller
+  SDL_Thread *th[MCTS_THREADS]; SDL_sem *go;
+  atomic_bool quit;
+  atomic_int finished;         // workers done with the current search
+  Uint32 searches;             // seeds the sampled futures; never the game's own rng
+  atomic_long playouts;
+  Game root; double base;      // root position and its own score
+  atomic_ullong deadline;      // performance counter
+  Uint32 slice_rng;
+  MctsNode *node; atomic_int used;
+} Mcts;
+
+static Uint32 mcts_rand(Uint32 *s){ Uint32 x=*s; x ^= x<<13; x ^= x>>17; x ^= x<<5; return *s = x; }
+
+// Reseeds the scratch game's sampled future. With the 7-bag, a bag already
+// being dealt keeps what it dealt and takes the rest of its shapes in the
+// sample's order, so every future is one the real randomizer could deal.
+static void mcts_reseed(Game *g, Uint32 seed, Uint8 deal[7]){
+  if(g->bag){
+    int b = (g->pieces+2)/7, dealt = g->pieces+2 - 7*b, n = dealt;
+    for(int i=0;i<dealt;i++) deal[i] = (Uint8)bag_deal(g, 7*b+i);
+    for(int i=0;i<7;i++){ Uint8 k = (Uint8)bag_kind(seed, 7*b+i); if(!memchr(deal, k, (size_t)dealt)) deal[n++] = k; }
+    g->deal = deal; g->deal_bag = b;
+  }
+  g->rng = g->seed = seed;
+}
+
+static double mcts_score(const Mcts *m, const Game *s, int lines){
+  Uint8 x[NN_INPUTS]; Sint32 v;
+  bot_features(s, lines, x);
+  net_eval(m->net, x, 1, &v);
+  return v;
+}
+
+// Enumerates n's children; the caller owns n (state BUSY).
+static void mcts_expand(Mcts *m, MctsNode *n, const Game *s, Uint32 *rng){
+  static _Thread_local Uint8 x[MAX_PLACEMENTS*NN_INPUTS];
+  Placement pl[MAX_PLACEMENTS]; Sint32 score[MAX_PLACEMENTS];
+  Game g = *s; Uint8 deal[7];
+  mcts_reseed(&g, n->seed, deal); // the sampled future every child shares
+  int k = bot_placements(&g, pl, x);
+  int first = k ? atomic_fetch_add(&m->used, k) : 0;
+  if(first + k > MCTS_NODES){ atomic_store(&n->state, MCTS_LEAF); return; } // pool full: stays a leaf
+  net_eval(m->net, x, k, score);
+  Sint32 top = score[0]; for(int i=1;i<k;i++) top = score[i]>top ? score[i] : top;
+  double total = 0, p[MAX_PLACEMENTS];
+  for(int i=0;i<k;i++) total += p[i] = exp((score[i]-top)/MCTS_PRIOR_T);
+  for(int i=0;i<k;i++){
+    MctsNode *c = &m->node[first+i];
+    c->move = pl[i]; c->seed = mcts_rand(rng) | 1; c->prior = (float)(p[i]/total); c->first = 0;
+    atomic_init(&c->nkids, 0); atomic_init(&c->state, MCTS_LEAF);
+    atomic_init(&c->visits, 0); atomic_init(&c->vloss, 0); atomic_init(&c->sum, 0);
+  }
+  n->first = first;
+  atomic_store(&n->nkids, k);
+  atomic_store_explicit(&n->state, MCTS_OPEN, memory_order_release);
+}
+
+static MctsNode *mcts_select(MctsNode *n, MctsNode *kids, int k){
+  int nv = atomic_load_explicit(&n->visits, memory_order_relaxed) + atomic_load_explicit(&n->vloss, memory_order_relaxed);
+  double fpu = nv ? (double)atomic_load_explicit(&n->sum, memory_order_relaxed)/65536.0/nv : 0.5;
+  double sq = sqrt((double)nv + 1), best = -1e9; MctsNode *pick = kids;
+  for(int i=0;i<k;i++){
+    MctsNode *c = &kids[i];
+    int cv = atomic_load_explicit(&c->visits, memory_order_relaxed) + atomic_load_explicit(&c->vloss, memory_order_relaxed);
+    double q = cv ? (double)atomic_load_explicit(&c->sum, memory_order_relaxed)/65536.0/cv : fpu;
+    double u = q + MCTS_PUCT*c->prior*sq/(1 + cv);
+    if(u>best){ best = u; pick = c; }
+  }
+  return pick;
+}
+
+// From s, MCTS_DEPTH pieces of cheap play; returns the value in [0,1].
+static double mcts_rollout(const Mcts *m, Game *s, Uint32 *rng){
+  static _Thread_local Uint8 x[MCTS_SAMPLES*NN_INPUTS];
+  Game t; Uint8 deal[7];
+  for(int d=0; d<MCTS_DEPTH && !s->game_over; d++){
+    mcts_reseed(s, mcts_rand(rng) | 1, deal);
+    Placement c[MCTS_SAMPLES]; Sint32 v[MCTS_SAMPLES]; int n = 0;
+    for(int tries=0; tries<3*MCTS_SAMPLES && n<MCTS_SAMPLES; tries++){
+      Placement pl = { 0, (Uint8)(mcts_rand(rng)%4), (Sint8)((int)(mcts_rand(rng)%(COLS+2)) - 2), 0 };
+      if(!bot_try(s, pl, &t, NULL)) continue;
+      c[n] = pl; bot_features(&t, t.lines - s->lines, x + (size_t)n*NN_INPUTS); n++;
+    }
+    if(!n){ s->game_over = true; break; }
+    net_eval(m->net, x, n, v);
+    int b = 0; for(int i=1;i<n;i++) if(v[i]>v[b]) b = i;
+    bot_try(s, c[b], &t, NULL); *s = t;
+  }
+  if(s->game_over) return game_finished(s) ? 1 : 0;
+  double score = mcts_score(m, s, 0) + MCTS_LINE*(s->lines - m->root.lines);
+  return 1/(1 + exp(-(score - m->base)/MCTS_SCALE));
+}
+
+static void mcts_playout(Mcts *m, Uint32 *rng){
+  MctsNode *path[128]; int depth = 0;
+  Game s = m->root, t; Uint8 deal[7];
+  MctsNode *n = &m->node[0];
+  path[depth++] = n;
+  for(;;){
+    if(s.game_over) break;
+    int st = atomic_load_explicit(&n->state, memory_order_acquire);
+    if(st==MCTS_LEAF){
+      int want = MCTS_LEAF; // a fresh leaf is tried once before it grows; the root grows at once
+      if((depth==1 || atomic_load_explicit(&n->visits, memory_order_relaxed)) && atomic_compare_exchange_strong(&n->state, &want, MCTS_BUSY)){
+        mcts_expand(m, n, &s, rng);
+        if(depth==1) continue;
+      }
+      break; // rollout from here
+    }
+    if(st==MCTS_BUSY || depth==128) break; // another thread is expanding it
+    int k = atomic_load_explicit(&n->nkids, memory_order_relaxed);
+    if(!k) break;
+    MctsNode *c = mcts_select(n, &m->node[n->first], k);
+    atomic_fetch_add_explicit(&c->vloss, 1, memory_order_relaxed);
+    mcts_reseed(&s, n->seed, deal);
+    bot_try(&s, c->move, &t, NULL); s = t;
+    n = c; path[depth++] = n;
+  }
+  double v = mcts_rollout(m, &s, rng);
+  long long fixed = (long long)(v*65536.0);
+  for(int i=0;i<depth;i++){
+    atomic_fetch_add_explicit(&path[i]->sum, fixed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&path[i]->visits, 1, memory_order_relaxed);
+    if(i) atomic_fetch_sub_explicit(&path[i]->vloss, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&m->playouts, 1, memory_order_relaxed);
+}
+
+static void mcts_search(Mcts *m, Uint32 seed){
+  Uint32 rng = seed | 1;
+  while(SDL_GetPerformanceCounter() < atomic_load_explicit(&m->deadline, memory_order_relaxed) && !atomic_load_explicit(&m->quit, memory_order_relaxed))
+    mcts_playout(m, &rng);
+}
+
+static int mcts_worker(void *arg){
+  Mcts *m = arg;
+  static atomic_int ids;
+  Uint32 id = (Uint32)atomic_fetch_add(&ids, 1) + 1;
+  for(;;){
+    SDL_SemWait(m->go);
+    if(atomic_load(&m->quit)) break;
+    mcts_search(m, id*0x9E3779B9u ^ m->searches*0x85EBCA6Bu);
+    atomic_fetch_add(&m->finished, 1);
+  }
+  return 0;
+}
+
+// threads: 0 = none (sliced).
+static bool mcts_open(Mcts *m, const Net *net, int threads){
+  memset(m,0,sizeof *m);
+  m->net = net;
+  m->threads = imax(0, imin(MCTS_THREADS, threads));
+  m->node = malloc(sizeof *m->node * MCTS_NODES);
+  m->go = SDL_CreateSemaphore(0);
+  atomic_init(&m->finished, m->threads); // idle
+  if(!m->node || !m->go) return false;
+  for(int i=0;i<m->threads;i++) m->th[i] = SDL_CreateThread(mcts_worker, "mcts", m);
+  return true;
+}
+
+static void mcts_close(Mcts *m){
+  atomic_store(&m->quit, true);
+  for(int i=0;i<m->threads;i++) SDL_SemPost(m->go);
+  for(int i=0;i<m->threads;i++) if(m->th[i]) SDL_WaitThread(m->th[i], NULL);
+  if(m->go) SDL_DestroySemaphore(m->go);
+  free(m->node);
+}
+
+// Workers still finishing a stopped search? A new one can't start until they are.
+static bool mcts_idle(Mcts *m){ return atomic_load(&m->finished)==m->threads; }
+
+// Starts a budget_ms search of root and returns at once (false if the last
+// one is still winding down). Workers start on it now; sliced searches run
+// as mcts_slice is called.
+static bool mcts_begin(Mcts *m, const Game *root, int budget_ms){
+  if(!mcts_idle(m)) return false;
+  m->searches++;
+  m->root = *root;
+  m->base = mcts_score(m, root, 0);
+  m->slice_rng = m->searches*0x27D4EB2Fu | 1;
+  atomic_store(&m->used, 1); atomic_store(&m->finished, 0); atomic_store(&m->playouts, 0);
+  MctsNode *r = &m->node[0];
+  memset(&r->move, 0, sizeof r->move); r->seed = m->searches*0x9E3779B9u | 1; r->first = 0;
+  atomic_init(&r->nkids, 0); atomic_init(&r->state, MCTS_LEAF); atomic_init(&r->visits, 0); atomic_init(&r->vloss, 0); atomic_init(&r->sum, 0);
+  atomic_store(&m->deadline, SDL_GetPerformanceCounter() + (Uint64)budget_ms*SDL_GetPerformanceFrequency()/1000);
+  for(int i=0;i<m->threads;i++) SDL_SemPost(m->go);
+  return true;
+}
+
+// Playouts on this thread for up to budget_us (at least one, so a slice
+// always makes progress); a playout is ~0.1 ms.
+static void mcts_slice(Mcts *m, int budget_us){
+  Uint64 now = SDL_GetPerformanceCounter(), end = now + (Uint64)budget_us*SDL_GetPerformanceFrequency()/1000000;
+  Uint64 deadline = atomic_load(&m->deadline);
+  if(end>deadline) end = deadline;
+  do mcts_playout(m, &m->slice_rng); while(SDL_GetPerformanceCounter() < end);
+}
+
+static void mcts_stop(Mcts *m){ atomic_store(&m->deadline, 0); }
+
+static bool mcts_done(Mcts *m){ return SDL_GetPerformanceCounter() >= atomic_load(&m->deadline) && mcts_idle(m); }
+
+// The most visited root move (the net's favourite if nothing was visited).
+static bool mcts_best(Mcts *m, Placement *best){
+  const MctsNode *r = &m->node[0];
+  int k = atomic_load(&r->nkids), b = -1, bv = -1;
+  for(int i=0;i<k;i++){
+    const MctsNode *c = &m->node[r->first+i];
+    int v = atomic_load(&c->visits);
+    if(v>bv || (v==bv && c->prior>m->node[r->first+b].prior)){ bv = v; b = i; }
+  }
+  if(b<0) return false;
+  *best = m->node[r->first+b].move;
+  return true;
+}
+
+// Opening book for 7-bag games. Each of the 7! orders the first bag can come
+// in has a line: the placements (hold included) a beam search found best for
+// the first BOOK_MOVES pieces, knowing the whole bag. A line is indexed by
+// the bag's rank among the permutations, so a lookup is one array read. The
+// book holds no boards: a bot follows a line while its board is the one the
+// line left, and leaves it for good otherwise (garbage, a move gone wrong).
+// Each move also names the piece it places, and a bot whose piece differs
+// leaves the line.
+// .ibk: magic, version byte, moves byte, then BOOK_LINES lines of that many
+// 16-bit little-endian moves - kind<<8 | hold<<7 | turns<<4 | x+2, or 0xFFFF
+// where a line ended early.
+#define BOOK_MAGIC 0x4B424249u // "IBBK"
+#define BOOK_VERSION 2
+#define BOOK_MOVES 6      // the 7th placement may hold into the second bag, which is unknown
+#define BOOK_LINES 5040   // 7!
+#define BOOK_BEAM 32
+#define BOOK_MAX_BEAM 128
+
+typedef struct { int moves; Uint16 line[BOOK_LINES][BOOK_MOVES]; } Book;
+
+static Uint16 book_pack(int kind, Placement pl){ return (Uint16)(kind<<8 | pl.hold<<7 | pl.turns<<4 | (pl.x+2)); }
+static bool book_unpack(Uint16 b, int *kind, Placement *pl){
+  if(b==0xFFFF) return false;
+  *kind = b>>8;
+  *pl = (Placement){ (Uint8)(b>>7 & 1), (Uint8)(b>>4 & 3), (Sint8)((b&15) - 2), 0 };
+  return true;
+}
+
+// Lehmer code: perm's rank among the orders of 0..6, and back.
+static int bag_rank(const Uint8 *perm){
+  int r = 0;
+  for(int i=0;i<7;i++){
+    int smaller = 0; for(int j=i+1;j<7;j++) smaller += perm[j]<perm[i];
+    r = r*(7-i) + smaller;
+  }
+  return r;
+}
+static void bag_unrank(int r, Uint8 *perm){
+  int d[7]; bool used[7] = {0};
+  for(int i=6;i>=0;i--){ d[i] = r%(7-i); r /= 7-i; }
+  for(int i=0;i<7;i++){
+    int k = 0; while(used[k] || d[i]--) k++;
+    used[k] = true; perm[i] = (Uint8)k;
+  }
+}
+
+// Filled cells only, row by row: what a line expects the board to be.
+static Uint32 book_board(const Game *g){
+  Uint8 b[ROWS*2];
+  for(int r=0;r<ROWS;r++){
+    unsigned m = 0; for(int c=0;c<COLS;c++) m |= (unsigned)CELL(g,r,c).filled<<c;
+    b[2*r] = (Uint8)m; b[2*r+1] = (Uint8)(m>>8);
+  }
+  return crc32c(0, b, sizeof b);
+}
+
+static bool book_load(Book *bk, const char *path){
+  size_t len = 0;
+  Uint8 *b = read_file(path, &len);
+  if(!b){ fprintf(stderr,"%s: cannot open\n", path); return false; }
+  bool ok = len>=6 && get_u32(b)==BOOK_MAGIC && b[4]==BOOK_VERSION && b[5]>=1 && b[5]<=BOOK_MOVES
+         && len==6 + (size_t)BOOK_LINES*b[5]*2;
+  if(ok){
+    bk->moves = b[5];
+    memset(bk->line, 0xFF, sizeof bk->line);
+    const Uint8 *p = b+6;
+    for(int i=0;i<BOOK_LINES;i++) for(int m=0;m<bk->moves;m++,p+=2) bk->line[i][m] = (Uint16)get_u16(p);
+  } else fprintf(stderr,"%s: not an opening book\n", path);
+  free(b);
+  return ok;
+}
+
+static bool book_save(const Book *bk, const char *path){
+  FILE *f = fopen(path, "wb");
+  if(!f) return false;
+  Uint8 h[6]; put_u32(h, BOOK_MAGIC); h[4] = BOOK_VERSION; h[5] = (Uint8)bk->moves;
+  bool ok = fwrite(h, 1, sizeof h, f)==sizeof h;
+  for(int i=0;i<BOOK_LINES && ok;i++){
+    Uint8 line[2*BOOK_MOVES];
+    for(int m=0;m<bk->moves;m++) put_u16(line+2*m, bk->line[i][m]);
+    ok = fwrite(line, 2, (size_t)bk->moves, f)==(size_t)bk->moves;
+  }
+  if(fclose(f)!=0) ok = false;
+  return ok;
+}
+
+// Building: a beam search per bag, ranked by the net's score of each position
+// plus MCTS_LINE per line cleared so far. A beam of 1 is the greedy bot, which
+// the build reports alongside as the baseline.
+typedef struct { Game g; Uint16 moves[BOOK_MOVES]; Sint32 score; } BookState;
+typedef struct { Sint32 score; Uint16 parent, idx; Placement pl; } BookCand;
+typedef struct {
+  BookState beam[2][BOOK_MAX_BEAM];
+  BookCand cand[BOOK_MAX_BEAM*MAX_PLACEMENTS];
+  Uint32 crc[BOOK_MAX_BEAM];
+  Uint8 x[MAX_PLACEMENTS*NN_INPUTS];
+} BookScratch;
+
+static int book_cand_cmp(const void *a, const void *b){
+  const BookCand *x = a, *y = b;
+  if(x->score!=y->score) return x->score<y->score ? 1 : -1;
+  return x->parent!=y->parent ? x->parent - y->parent : x->idx - y->idx;
+}
+
+// Best line for bag perm from an empty board into line; returns its score.
+// The games deal perm on every spawn, holds included (Game.deal; the types
+// are the rng's).
+static Sint32 book_search(const Net *net, const Uint8 *perm, int width, Uint16 *line, BookScratch *w){
+  BookState *cur = w->beam[0], *nxt = w->beam[1];
+  game_reset(&cur[0].g, 1); cur[0].g.deal = perm; game_use_bag(&cur[0].g);
+  memset(cur[0].moves, 0xFF, sizeof cur[0].moves); cur[0].score = 0;
+  int n = 1;
+  for(int d=0; d<BOOK_MOVES; d++){
+    int nc = 0;
+    for(int i=0;i<n;i++){
+      if(cur[i].g.game_over) continue;
+      Placement pl[MAX_PLACEMENTS]; Sint32 v[MAX_PLACEMENTS];
+      int k = bot_placements(&cur[i].g, pl, w->x);
+      net_eval(net, w->x, k, v);
+      for(int j=0;j<k;j++) w->cand[nc++] = (BookCand){ v[j] + MCTS_LINE*(cur[i].g.lines + pl[j].lines), (Uint16)i, (Uint16)j, pl[j] };
+    }
+    if(!nc) break;
+    qsort(w->cand, (size_t)nc, sizeof w->cand[0], book_cand_cmp);
+    int m = 0;
+    for(int c=0; c<nc && m<width; c++){
+      const BookCand *bc = &w->cand[c]; const BookState *p = &cur[bc->parent]; BookState *s = &nxt[m];
+      bot_try(&p->g, bc->pl, &s->g, NULL);
+      Uint32 crc = game_checksum(&s->g);
+      int e = 0; while(e<m && w->crc[e]!=crc) e++;
+      if(e<m) continue; // the same position by another route
+      w->crc[m] = crc;
+      memcpy(s->moves, p->moves, sizeof s->moves); s->moves[d] = book_pack(p->g.cur.k, bc->pl); s->score = bc->score;
+      m++;
+    }
+    BookState *tmp = cur; cur = nxt; nxt = tmp; n = m;
+  }
+  memcpy(line, cur[0].moves, sizeof cur[0].moves);
+  return cur[0].score;
+}
+
+typedef struct {
+  const Net *net; Book *book; int width;
+  atomic_int next;
+  Sint32 best[BOOK_LINES], greedy[BOOK_LINES];
+} BookJob;
+
+typedef struct { BookJob *job; BookScratch *w; } BookWorker;
+
+static int book_worker(void *arg){
+  BookWorker *bw = arg; BookJob *j = bw->job;
+  for(int r; (r = atomic_fetch_add(&j->next, 1)) < BOOK_LINES;){
+    Uint8 perm[7]; Uint16 greedy[BOOK_MOVES]; bag_unrank(r, perm);
+    j->best[r] = book_search(j->net, perm, j->width, j->book->line[r], bw->w);
+    j->greedy[r] = book_search(j->net, perm, 1, greedy, bw->w);
+  }
+  return 0;
+}
+
+// Searches every bag on all cores and writes the book.
+static int book_build(const char *path, const Net *net, int width){
+  static Book book; static BookJob job;
+  int threads = imax(1, imin(MCTS_THREADS, SDL_GetCPUCount()));
+  BookWorker bw[MCTS_THREADS]; SDL_Thread *th[MCTS_THREADS] = {0};
+  for(int i=0;i<threads;i++) if(!(bw[i].w = malloc(sizeof *bw[i].w))){
+    fprintf(stderr,"book: out of memory\n");
+    while(i--) free(bw[i].w);
+    return 1;
+  }
+  book.moves = BOOK_MOVES;
+  job.net = net; job.book = &book; job.width = width; atomic_init(&job.next, 0);
+  Uint64 t0 = SDL_GetPerformanceCounter();
+  for(int i=0;i<threads;i++) bw[i].job = &job;
+  for(int i=1;i<threads;i++) th[i] = SDL_CreateThread(book_worker, "book", &bw[i]);
+  book_worker(&bw[0]);
+  for(int i=1;i<threads;i++) if(th[i]) SDL_WaitThread(th[i], NULL);
+  for(int i=0;i<threads;i++) free(bw[i].w);
+  double best = 0, greedy = 0; int better = 0;
+  for(int r=0;r<BOOK_LINES;r++){ best += job.best[r]; greedy += job.greedy[r]; better += job.best[r]>job.greedy[r]; }
+  printf("book: %d bags, %d moves, beam %d: mean score %.0f (greedy %.0f), better on %d, %.1fs on %d threads\n",
+         BOOK_LINES, BOOK_MOVES, width, best/BOOK_LINES, greedy/BOOK_LINES, better,
+         (double)(SDL_GetPerformanceCounter()-t0)/(double)SDL_GetPerformanceFrequency(), threads);
+  if(!book_save(&book, path)){ fprintf(stderr,"%s: cannot write\n", path); return 1; }
+  return 0;
+}
+
+// Plays one board through its input queue: a short pause on each new piece
+// (so people can follow), then the whole plan in one tick. With MCTS the bot
+// keeps thinking until the budget is spent or the piece has fallen
+// BOT_HANG_ROWS (or is about to land) - slow gravity buys better moves - and
+// then plays the best so far. Sliced searches get BOT_SLICE_US a frame from
+// bot_think; nothing the bot does on the main thread takes longer.
+#define BOT_PACE_TICKS 25
+#define BOT_HANG_ROWS 2
+#define BOT_SLICE_US 2000
+typedef struct {
+  const Net *net; Mcts *mcts; int budget_ms;
+  int planned, wait, top; bool acted, searching;
+  const Book *book; const Uint16 *line; int line_at; Uint32 line_board; // the opening line being followed
+  bool booked; Placement book_pl;
+} Bot;
+
+// The book's move for g while the bot is on a line, which it takes up at the
+// first piece of a 7-bag game on an empty board. The key is the whole first
+// bag, five pieces more than the preview shows: the book is the bot's own
+// knowledge of the deal, as its name says.
+static bool bot_book(Bot *bot, const Game *g, Placement *pl){
+  if(!bot->book || !g->bag) return false;
+  if(g->pieces==0 && !g->has_hold){
+    bool empty = true;
+    for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) empty &= !CELL(g,r,c).filled;
+    Uint8 perm[7]; for(int i=0;i<7;i++) perm[i] = (Uint8)bag_kind(g->seed, i);
+    bot->line = empty ? bot->book->line[bag_rank(perm)] : NULL; bot->line_at = 0; bot->line_board = book_board(g);
+  }
+  Game s; int kind;
+  if(!bot->line) return false;
+  if(bot->line_at>=bot->book->moves || book_board(g)!=bot->line_board || !book_unpack(bot->line[bot->line_at], &kind, pl)
+     || kind!=g->cur.k || !bot_try(g, *pl, &s, NULL)){
+    bot->line = NULL;
+    return false;
+  }
+  bot->line_at++; bot->line_board = book_board(&s);
+  return true;
+}
+
+// Up to 4+COLS+1 actions into acts.
+static int bot_act(Bot *bot, const Game *g, Uint8 *acts){
+  if(g->phase || g->game_over) return 0;
+  if(g->pieces!=bot->planned){
+    if(bot->searching) mcts_stop(bot->mcts);
+    bot->planned = g->pieces; bot->wait = BOT_PACE_TICKS; bot->acted = bot->searching = false; bot->top = g->cur.y;
+    bot->booked = bot_book(bot, g, &bot->book_pl);
+  }
+  if(bot->acted) return 0;
+  if(bot->mcts && !bot->searching && !bot->booked) bot->searching = mcts_begin(bot->mcts, g, bot->budget_ms); // retried while the last search winds down
+  if(bot->wait && --bot->wait) return 0;
+  Placement pl; Game s;
+  bool ok;
+  if(bot->booked){ pl = bot->book_pl; ok = true; }
+  else if(bot->mcts){
+    bool hanging = g->cur.y - bot->top < BOT_HANG_ROWS && !collide(g,&g->cur,g->cur.x,g->cur.y+1);
+    if(hanging && !(bot->searching && mcts_done(bot->mcts))) return 0;
+    ok = bot->searching && mcts_best(bot->mcts, &pl);
+    if(bot->searching) mcts_stop(bot->mcts);
+    bot->searching = false;
+  } else ok = bot_choose(bot->net, g, &pl);
+  bot->acted = true;
+  int n = ok ? bot_try(g, pl, &s, acts) : 0;
+  // The piece fell while the search ran and can't get there any more: the net's pick from here.
+  if(!n && bot_choose(bot->net, g, &pl)) n = bot_try(g, pl, &s, acts);
+  return n;
+}
+
+// Per frame: a slice of a search that has no workers.
+static void bot_think(Bot *bot){
+  if(bot->searching && !bot->mcts->threads && !mcts_done(bot->mcts)) mcts_slice(bot->mcts, BOT_SLICE_US);
+}
+
+// Headless games with the bot, straight from placement to placement (no
+// gravity, no pacing), to compare nets, search budgets, thread counts and books.
+#define BOT_EVAL_PIECES 500
+static int bot_eval(Bot *bot, int games, bool bag){
+  long score = 0, lines = 0, tops = 0, playouts = 0, moves = 0, booked = 0;
+  Uint64 t0 = SDL_GetPerformanceCounter();
+  for(int i=0;i<games;i++){
+    Game g, t; game_reset(&g, 1000u + (Uint32)i);
+    if(bag) game_use_bag(&g);
+    while(!g.game_over && g.pieces<BOT_EVAL_PIECES){
+      Placement pl;
+      if(bot_book(bot, &g, &pl)) booked++;
+      else if(bot->mcts){
+        while(!mcts_begin(bot->mcts, &g, bot->budget_ms)) SDL_Delay(1);
+        while(!mcts_done(bot->mcts)) if(bot->mcts->threads) SDL_Delay(1); else mcts_slice(bot->mcts, BOT_SLICE_US);
+        playouts += atomic_load(&bot->mcts->playouts); moves++;
+        if(!mcts_best(bot->mcts, &pl)) break;
+      } else if(!bot_choose(bot->net, &g, &pl)) break;
+      bot_try(&g, pl, &t, NULL); g = t;
+    }
+    printf("game %d: %d pieces, %d lines, score %d%s\n", i, g.pieces, g.lines, g.score, g.game_over ? ", topped out" : "");
+    score += g.score; lines += g.lines; tops += g.game_over;
+  }
+  double secs = (double)(SDL_GetPerformanceCounter()-t0)/(double)SDL_GetPerformanceFrequency();
+  printf("%d games: %.1f lines, %.0f points a game, %ld topped out, %.1fs", games, (double)lines/games, (double)score/games, tops, secs);
+  if(moves) printf(", %.0f playouts/move on %d threads", (double)playouts/moves, imax(1, bot->mcts->threads));
+  if(bot->book) printf(", %ld moves from the book", booked);
+  printf("\n");
+  return 0;
+}
+
+// Audio: sound effects and music synthesised once at startup straight into
+// the device's sample rate, then mixed in the SDL audio callback. The game
+// thread only posts commands through an SPSC queue; the callback never
+// allocates or locks, and voices live in a fixed array.
+#define AUDIO_RATE 48000
+#define AUDIO_CHANNELS 2
+#define AUDIO_BUFFER 256        // frames per callback: ~5 ms at 48 kHz
+#define MAX_VOICES 16
+
+enum { SFX_MOVE, SFX_ROTATE, SFX_LOCK, SFX_CLEAR1, SFX_CLEAR2, SFX_CLEAR3, SFX_CLEAR4, SFX_LEVELUP, SFX_MUSIC, SFX_COUNT };
+enum { AUD_PLAY, AUD_MUSIC_ON, AUD_MUSIC_OFF };
+
+typedef struct { Uint8 op, sfx; float gain; } AudioCmd;
+typedef struct { const float *pcm; int len, pos; float gain; bool loop; } Voice;
+
+typedef struct {
+  SDL_AudioDeviceID dev;
+  int rate, channels;
+  float *pcm[SFX_COUNT];        // mono, device rate
+  int len[SFX_COUNT];
+  SpscQueue q;
+  AudioCmd qbuf[64];
+  Voice voices[MAX_VOICES];     // callback-owned
+  int music;                    // voice index of the music loop, -1 when off
+  bool music_on;                // game-thread view of the toggle
+} Audio;
+
+static float note_hz(int midi){ return 440.0f * powf(2.0f, (float)(midi-69)/12.0f); }
+
+typedef enum { WAVE_SQUARE, WAVE_TRI, WAVE_SINE, WAVE_NOISE } Wave;
+
+// Adds a tone into dst: frequency glides f0 -> f1, linear attack, exponential decay.
+static void synth(float *dst, int rate, float start_s, float dur_s, float f0, float f1, Wave wave, float gain, float decay){
+  int a = (int)(start_s*rate), n = (int)(dur_s*rate), atk = rate/500;
+  float ph = 0.0f;
+  Uint32 noise = 0x1234567u;
+  for(int i=0;i<n;i++){
+    float t = (float)i/(float)n, f = f0 + (f1-f0)*t;
+    ph += f/(float)rate; ph -= floorf(ph);
+    float v;
+    switch(wave){
+      case WAVE_SQUARE: v = ph<0.5f ? 1.0f : -1.0f; break;
+      case WAVE_TRI:    v = 4.0f*fabsf(ph-0.5f) - 1.0f; break;
+      case WAVE_SINE:   v = sinf(ph*6.28318f); break;
+      default:          noise ^= noise<<13; noise ^= noise>>17; noise ^= noise<<5; v = (float)(noise&0xFFFF)/32768.0f - 1.0f; break;
+    }
+    float env = (i<atk ? (float)i/(float)atk : 1.0f) * expf(-decay*t) * (1.0f - t*t*t); // tail fades to 0, no click
+    dst[a+i] += v*env*gain;
+  }
+}
+
+static float *sfx_alloc(Audio *au, int id, float seconds){
+  au->len[id] = (int)(seconds*au->rate);
+  au->pcm[id] = calloc((size_t)au->len[id], sizeof(float));
+  return au->pcm[id];
+}
+
+// Korobeiniki (A part) as (midi note, eighths); 0 is a rest.
+static const Uint8 MELODY[][2] = {
+  {76,2},{71,1},{72,1},{74,2},{72,1},{71,1},{69,2},{69,1},{72,1},{76,2},{74,1},{72,1},{71,3},{72,1},{74,2},{76,2},{72,2},{69,2},{69,2},{0,2},
+  {0,1},{74,2},{77,1},{81,2},{79,1},{77,1},{76,3},{72,1},{76,2},{74,1},{72,1},{71,2},{71,1},{72,1},{74,2},{76,2},{72,2},{69,2},{69,2},{0,2},
+};
+static const Uint8 BASS_ROOTS[8] = { 45, 40, 45, 45, 38, 45, 40, 45 }; // one per bar
+
+static void audio_synth_all(Audio *au){
+  int r = au->rate;
+  float *p;
+  if((p = sfx_alloc(au, SFX_MOVE, 0.04f))) synth(p, r, 0, 0.04f, 900, 700, WAVE_SQUARE, 0.12f, 4);
+  if((p = sfx_alloc(au, SFX_ROTATE, 0.07f))) synth(p, r, 0, 0.07f, 620, 1040, WAVE_TRI, 0.25f, 3);
+  if((p = sfx_alloc(au, SFX_LOCK, 0.12f))){ synth(p, r, 0, 0.12f, 150, 60, WAVE_SINE, 0.5f, 5); synth(p, r, 0, 0.03f, 0, 0, WAVE_NOISE, 0.12f, 6); }
+  static const int chord[4] = { 72, 76, 79, 84 };
+  for(int k=0;k<4;k++){ // bigger clears stack more notes and ring longer
+    float len = 0.25f + 0.12f*(float)k;
+    if(!(p = sfx_alloc(au, SFX_CLEAR1+k, len))) continue;
+    for(int i=0;i<=k;i++) synth(p, r, 0.03f*(float)i, len-0.03f*(float)i, note_hz(chord[i]), note_hz(chord[i]), WAVE_SQUARE, 0.12f, 2);
+    synth(p, r, 0, 0.08f, 0, 0, WAVE_NOISE, 0.15f, 5);
+  }
+  if((p = sfx_alloc(au, SFX_LEVELUP, 0.5f)))
+    for(int i=0;i<4;i++) synth(p, r, 0.09f*(float)i, 0.14f, note_hz(chord[i]+12), note_hz(chord[i]+12), WAVE_TRI, 0.3f, 2);
+  const float eighth = 0.2f; // 150 bpm
+  if((p = sfx_alloc(au, SFX_MUSIC, 64*eighth))){
+    float t = 0;
+    for(size_t i=0;i<sizeof MELODY/sizeof MELODY[0];i++){
+      float d = MELODY[i][1]*eighth;
+      if(MELODY[i][0]) synth(p, r, t, d*0.95f, note_hz(MELODY[i][0]), note_hz(MELODY[i][0]), WAVE_SQUARE, 0.07f, 1.5f);
+      t += d;
+    }
+    for(int e=0;e<64;e++){ // pumping root / octave bass
+      int root = BASS_ROOTS[e/8] + (e&1 ? 12 : 0);
+      synth(p, r, (float)e*eighth, eighth*0.9f, note_hz(root), note_hz(root), WAVE_TRI, 0.14f, 2);
+    }
+  }
+}
+
+static void audio_callback(void *ud, Uint8 *stream, int len){
+  Audio *au = ud;
+  AudioCmd c;
+  while(spsc_pop(&au->q, &c)){
+    if(c.op==AUD_MUSIC_OFF){ if(au->music>=0) au->voices[au->music].pcm = NULL; au->music = -1; continue; }
+    if(c.op==AUD_MUSIC_ON && au->music>=0) continue;
+    int v=0, oldest=-1; // free voice, else steal the effect closest to its end
+    for(;v<MAX_VOICES && au->voices[v].pcm;v++){
+      const Voice *o = &au->voices[v];
+      if(!o->loop && (oldest<0 || o->len-o->pos < au->voices[oldest].len-au->voices[oldest].pos)) oldest=v;
+    }
+    if(v==MAX_VOICES) v = oldest;
+    if(v<0) continue;
+    au->voices[v] = (Voice){ au->pcm[c.sfx], au->len[c.sfx], 0, c.gain, c.op==AUD_MUSIC_ON };
+    if(c.op==AUD_MUSIC_ON) au->music = v;
+  }
+  int playing = 0; for(int v=0;v<MAX_VOICES;v++) playing += au->voices[v].pcm!=NULL;
+  met_add(&met_audio, MET_AUDIO_CALLBACKS, 1); met_set(&met_audio, MET_VOICES, (Uint64)playing);
+  float *out = (float*)stream;
+  int frames = len / (int)(sizeof(float)*(size_t)au->channels);
+  memset(stream, 0, (size_t)len);
+  for(int v=0;v<MAX_VOICES;v++){
+    Voice *vo = &au->voices[v];
+    if(!vo->pcm) continue;
+    for(int i=0;i<frames;i++){
+      if(vo->pos>=vo->len){ if(!vo->loop){ vo->pcm=NULL; break; } vo->pos=0; }
+      float s = vo->pcm[vo->pos++]*vo->gain;
+      for(int ch=0;ch<au->channels;ch++) out[i*au->channels+ch] += s;
+    }
+  }
+  for(int i=0;i<frames*au->channels;i++) out[i] = out[i]>1.0f ? 1.0f : out[i]<-1.0f ? -1.0f : out[i];
+}
+
+// Silent (dev==0) if the audio subsystem or device is unavailable.
+static void audio_open(Audio *au, int buffer_frames){
+  memset(au,0,sizeof *au);
+  au->music = -1;
+  spsc_init(&au->q, au->qbuf, sizeof au->qbuf[0], sizeof au->qbuf/sizeof au->qbuf[0]);
+  if(SDL_InitSubSystem(SDL_INIT_AUDIO)!=0){ fprintf(stderr,"audio: %s\n", SDL_GetError()); return; }
+  SDL_AudioSpec want = {0}, have;
+  want.freq = AUDIO_RATE; want.format = AUDIO_F32SYS; want.channels = AUDIO_CHANNELS;
+  want.samples = (Uint16)buffer_frames; want.callback = audio_callback; want.userdata = au;
+  au->dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE|SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+  if(!au->dev){ fprintf(stderr,"audio: %s\n", SDL_GetError()); return; }
+  au->rate = have.freq; au->channels = have.channels;
+  audio_synth_all(au);
+  SDL_PauseAudioDevice(au->dev, 0);
+}
+
+static void audio_close(Audio *au){
+  if(au->dev) SDL_CloseAudioDevice(au->dev);
+  for(int i=0;i<SFX_COUNT;i++) free(au->pcm[i]);
+  au->dev = 0;
+}
+
+static void sfx_post(Audio *au, int op, int sfx, float gain){
+  if(!au->dev) return;
+  AudioCmd c = { (Uint8)op, (Uint8)sfx, gain };
+  spsc_push(&au->q, &c); // full queue: drop the sound rather than wait
+}
+static void sfx_play(Audio *au, int sfx){ sfx_post(au, AUD_PLAY, sfx, 1.0f); }
+static void music_toggle(Audio *au){
+  au->music_on = !au->music_on;
+  sfx_post(au, au->music_on ? AUD_MUSIC_ON : AUD_MUSIC_OFF, SFX_MUSIC, 1.0f);
+}
+
+// Sounds for one simulation tick, from what changed across it.
+// With delays, clears sound as the rows start flashing and locks as the piece
+// lands, not when the next piece finally spawns.
+typedef struct { int x, y, pieces, lines, level, phase; Uint8 rot[4][4]; } SfxProbe;
+static SfxProbe sfx_probe(const Game *g){
+  SfxProbe p = { g->cur.x, g->cur.y, g->pieces, g->lines, g->level, g->phase, {{0}} };
+  memcpy(p.rot, g->cur.m, sizeof p.rot);
+  return p;
+}
+static void sfx_for_tick(Audio *au, const SfxProbe *before, const Game *g, bool acted){
+  int entered = g->phase==PHASE_CLEAR && before->phase!=PHASE_CLEAR ? popcount32(full_rows(g)) : 0;
+  if(entered) sfx_play(au, SFX_CLEAR1 + imin(entered, 4) - 1);
+  else if(g->lines > before->lines && before->phase!=PHASE_CLEAR) sfx_play(au, SFX_CLEAR1 + imin(g->lines - before->lines, 4) - 1);
+  else if(before->phase==PHASE_FALL && (g->phase==PHASE_ARE || g->pieces != before->pieces) && !g->game_over) sfx_play(au, SFX_LOCK);
+  else if(acted && memcmp(before->rot, g->cur.m, sizeof before->rot)) sfx_play(au, SFX_ROTATE);
+  else if(acted && g->cur.x != before->x) sfx_play(au, SFX_MOVE);
+  if(g->level > before->level) sfx_play(au, SFX_LEVELUP);
+}
+
+// Input. Keyboard events come off SDL's queue on the main thread, stamped
+// with their arrival time. Gamepads are sampled by their own thread at ~1 kHz
+// and reach the main thread through an SPSC queue, stamped when a sample saw
+// the change. Either way the fixed-step loop applies an event on the tick
+// whose slice of wall time it arrived in, not the first tick after the frame.
+#define INPUT_PAUSE ACT_COUNT   // not a simulation action
+#define MAX_PADS 4
+#define PAD_DAS_MS 167          // held direction: delay before auto-repeat...
+#define PAD_ARR_MS 33           // ...then one step per interval
+#define PAD_DEADZONE 16000
+
+typedef struct { Uint64 t_us; Uint8 player, act; } InputEvent;
+
+static Uint64 perf_hz; // set before any thread reads the clock
+
+static Uint64 perf_us(void){
+  Uint64 c = SDL_GetPerformanceCounter();
+  return c/perf_hz*1000000 + c%perf_hz*1000000/perf_hz;
+}
+
+// Keeps q sorted by time; keyboard and pad events arrive on separate paths.
+static void input_queue(InputEvent *q, int *n, int cap, InputEvent ev){
+  if(*n==cap) return;
+  int i = (*n)++;
+  for(; i>0 && q[i-1].t_us > ev.t_us; i--) q[i] = q[i-1];
+  q[i] = ev;
+}
+
+static const struct { SDL_GameControllerButton b; Uint8 act; } PAD_MAP[] = {
+  { SDL_CONTROLLER_BUTTON_DPAD_LEFT, ACT_LEFT }, { SDL_CONTROLLER_BUTTON_DPAD_RIGHT, ACT_RIGHT },
+  { SDL_CONTROLLER_BUTTON_DPAD_DOWN, ACT_SOFT }, { SDL_CONTROLLER_BUTTON_DPAD_UP, ACT_HARD },
+  { SDL_CONTROLLER_BUTTON_A, ACT_CW }, { SDL_CONTROLLER_BUTTON_B, ACT_CCW },
+  { SDL_CONTROLLER_BUTTON_X, ACT_CCW }, { SDL_CONTROLLER_BUTTON_Y, ACT_CW },
+  { SDL_CONTROLLER_BUTTON_LEFTSHOULDER, ACT_HOLD }, { SDL_CONTROLLER_BUTTON_RIGHTSHOULDER, ACT_HOLD },
+  { SDL_CONTROLLER_BUTTON_START, INPUT_PAUSE },
+};
+
+// Held actions as a bitmask; the left stick doubles as the d-pad (minus hard drop).
+static unsigned pad_sample(SDL_GameController *c){
+  unsigned m = 0;
+  for(size_t i=0;i<sizeof PAD_MAP/sizeof PAD_MAP[0];i++)
+    if(SDL_GameControllerGetButton(c, PAD_MAP[i].b)) m |= 1u<<PAD_MAP[i].act;
+  Sint16 x = SDL_GameControllerGetAxis(c, SDL_CONTROLLER_AXIS_LEFTX), y = SDL_GameControllerGetAxis(c, SDL_CONTROLLER_AXIS_LEFTY);
+  if(x < -cfg->pad_deadzone) m |= 1u<<ACT_LEFT;
+  if(x >  cfg->pad_deadzone) m |= 1u<<ACT_RIGHT;
+  if(y >  cfg->pad_deadzone) m |= 1u<<ACT_SOFT;
+  return m;
+}
+
+typedef struct {
+  SpscQueue q; InputEvent qbuf[256];
+  atomic_bool stop;
+  SDL_Thread *th;
+  SDL_GameController *pad[MAX_PADS]; // slot = player
+  unsigned held[MAX_PADS];
+  Uint64 repeat_at[MAX_PADS][ACT_COUNT];
+} PadPoll;
+
+// Picks up newly attached controllers and drops unplugged ones.
+static void pad_scan(PadPoll *pp){
+  for(int i=0;i<MAX_PADS;i++)
+    if(pp->pad[i] && !SDL_GameControllerGetAttached(pp->pad[i])){ SDL_GameControllerClose(pp->pad[i]); pp->pad[i] = NULL; }
+  for(int j=0;j<SDL_NumJoysticks();j++){
+    if(!SDL_IsGameController(j)) continue;
+    SDL_GameController *c = SDL_GameControllerOpen(j); // already-open pads come back refcounted
+    if(!c) continue;
+    int slot = -1, free_slot = -1;
+    for(int i=0;i<MAX_PADS;i++){ if(pp->pad[i]==c) slot = i; if(!pp->pad[i] && free_slot<0) free_slot = i; }
+    if(slot>=0 || free_slot<0){ SDL_GameControllerClose(c); continue; }
+    pp->pad[free_slot] = c;
+    pp->held[free_slot] = pad_sample(c); // buttons held while plugging in don't fire
+  }
+}
+
+static void pad_emit(PadPoll *pp, Uint64 t, int player, int act){
+  InputEvent ev = { t, (Uint8)player, (Uint8)act };
+  spsc_push(&pp->q, &ev); // full only if the main thread stalled; drop
+}
+
+static int pad_thread(void *arg){
+  PadPoll *pp = arg;
+  SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+  Uint64 next_scan = 0;
+  while(!atomic_load(&pp->stop)){
+    SDL_LockJoysticks();
+    SDL_GameControllerUpdate();
+    Uint64 t = perf_us();
+    if(t >= next_scan){ pad_scan(pp); next_scan = t + 500000; }
+    for(int i=0;i<MAX_PADS;i++){
+      if(!pp->pad[i]) continue;
+      unsigned now = pad_sample(pp->pad[i]), was = pp->held[i];
+      for(int a=0;a<=INPUT_PAUSE;a++){
+        if(!(now & 1u<<a)) continue;
+        bool repeats = a==ACT_LEFT || a==ACT_RIGHT || a==ACT_SOFT;
+        if(!(was & 1u<<a)){ pad_emit(pp, t, i, a); if(repeats) pp->repeat_at[i][a] = t + cfg->pad_das_us; }
+        else if(repeats && t >= pp->repeat_at[i][a]){ pad_emit(pp, t, i, a); pp->repeat_at[i][a] = t + cfg->pad_arr_us; }
+      }
+      pp->held[i] = now;
+    }
+    SDL_UnlockJoysticks();
+    met_add(&met_pad, MET_PAD_SAMPLES, 1);
+    SDL_Delay(1);
+  }
+  SDL_LockJoysticks();
+  for(int i=0;i<MAX_PADS;i++) if(pp->pad[i]) SDL_GameControllerClose(pp->pad[i]);
+  SDL_UnlockJoysticks();
+  return 0;
+}
+
+// Keyboard-only (no thread) if the controller subsystem is unavailable.
+static void pads_start(PadPoll *pp){
+  memset(pp,0,sizeof *pp);
+  spsc_init(&pp->q, pp->qbuf, sizeof pp->qbuf[0], sizeof pp->qbuf/sizeof pp->qbuf[0]);
+  // The pad thread owns joystick updates; the main thread's event pump keeps out.
+  SDL_SetHint(SDL_HINT_AUTO_UPDATE_JOYSTICKS, "0");
+  if(SDL_InitSubSystem(SDL_INIT_GAMECONTROLLER)!=0){ fprintf(stderr,"gamepad: %s\n", SDL_GetError()); return; }
+  SDL_GameControllerEventState(SDL_IGNORE);
+  SDL_JoystickEventState(SDL_IGNORE);
+  pp->th = SDL_CreateThread(pad_thread, "gamepad", pp);
+}
+
+static void pads_stop(PadPoll *pp){
+  if(!pp->th) return;
+  atomic_store(&pp->stop, true);
+  SDL_WaitThread(pp->th, NULL);
+  pp->th = NULL;
+}
+
+// Rendering helpers
+
+// Themes: how tiles, backgrounds and particles look, as data (see theme_load).
+// A tile face is "glyph:<utf-8>" from the emoji font, "image:<file.bmp>", or
+// empty for plain colored squares.
+#define THEME_PATH 256
+typedef struct {
+  char name[32];
+  char face[2][THEME_PATH];  // per tile type: ice, burger
+  char background[THEME_PATH], particle[THEME_PATH]; // BMP files, optional
+  int particle_size;
+  SDL_Color bg, grid, text, piece[8], burst;
+} Theme;
+#define MAX_THEMES 8
+
+// Atlas: a theme compiled into one texture. Every tile, the empty cell, the
+// background and the particle sprite are rasterised once, rect-packed into a
+// single surface and uploaded, along with the colors the renderer needs. Every
+// board, preview and particle of a frame then goes out in one
+// SDL_RenderGeometry call, and a fancier theme changes texels, not draw calls.
+enum { ATLAS_WHITE, ATLAS_EMPTY, ATLAS_BG, ATLAS_PARTICLE, ATLAS_TILES, ATLAS_SLOTS = ATLAS_TILES + 2*8 };
+#define ATLAS_MAX_W 4096
+
+typedef struct {
+  SDL_Texture *tex; float w, h;
+  float uv[ATLAS_SLOTS][4]; // u0 v0 u1 v1 per slot
+  bool has_bg;
+  int particle_size;
+  SDL_Color bg, grid, text, piece[8], burst;
+} Atlas;
+
+// Skyline bottom-left packing: rects go in tallest first, each where its top
+// edge lands lowest on the skyline. Zero-size rects are left at 0,0. Returns
+// the height used, or -1 if something is wider than w.
+static int pack_rects(SDL_Rect *r, int n, int w){
+  int order[ATLAS_SLOTS], nsky = 1, height = 0;
+  struct { int x, y, w; } sky[2*ATLAS_SLOTS+1] = { { 0, 0, w } };
+  for(int i=0;i<n;i++){
+    int j = i;
+    while(j>0 && r[order[j-1]].h < r[i].h){ order[j] = order[j-1]; j--; }
+    order[j] = i;
+  }
+  for(int k=0;k<n;k++){
+    SDL_Rect *q = &r[order[k]];
+    if(!q->w || !q->h){ q->x = q->y = 0; continue; }
+    if(q->w > w) return -1;
+    int best = -1, best_y = 0;
+    for(int i=0;i<nsky && sky[i].x + q->w <= w;i++){
+      int y = 0;
+      for(int j=i, left=q->w; left>0; left -= sky[j].w, j++) y = imax(y, sky[j].y);
+      if(best<0 || y<best_y){ best = i; best_y = y; }
+    }
+    q->x = sky[best].x; q->y = best_y;
+    height = imax(height, best_y + q->h);
+    // the new segment covers [x, x+w); trim or drop what it shadows
+    int x1 = q->x + q->w, i = best;
+    while(i<nsky && sky[i].x + sky[i].w <= x1){ memmove(sky+i, sky+i+1, sizeof sky[0]*(size_t)(nsky-i-1)); nsky--; }
+    if(i<nsky && sky[i].x < x1){ sky[i].w -= x1 - sky[i].x; sky[i].x = x1; }
+    memmove(sky+best+1, sky+best, sizeof sky[0]*(size_t)(nsky-best)); nsky++;
+    sky[best].x = q->x; sky[best].y = best_y + q->h; sky[best].w = q->w;
+    for(i=0;i+1<nsky;) if(sky[i].y==sky[i+1].y){ sky[i].w += sky[i+1].w; memmove(sky+i+1, sky+i+2, sizeof sky[0]*(size_t)(nsky-i-2)); nsky--; } else i++;
+  }
+  return height;
+}
+
+static void surf_fill(SDL_Surface *s, int x, int y, int w, int h, SDL_Color c){
+  SDL_Rect r = { x, y, w, h };
+  SDL_FillRect(s, &r, SDL_MapRGBA(s->format, c.r, c.g, c.b, c.a));
+}
+
+// First code point of a UTF-8 string (0 if malformed).
+static Uint32 utf8_first(const char *p){
+  const unsigned char *u = (const unsigned char*)p;
+  if(u[0] < 0x80) return u[0];
+  int n = u[0]>=0xF0 ? 3 : u[0]>=0xE0 ? 2 : 1;
+  Uint32 c = u[0] & (0x3F >> n);
+  for(int i=1;i<=n;i++){ if((u[i]&0xC0)!=0x80) return 0; c = c<<6 | (u[i]&0x3F); }
+  return c;
+}
+
+static SDL_Surface *theme_face(const char *face, TTF_Font *emoji_font){
+  SDL_Surface *f = NULL;
+  if(!strncmp(face, "glyph:", 6) && emoji_font && TTF_GlyphIsProvided32(emoji_font, utf8_first(face+6)))
+    f = TTF_RenderUTF8_Blended(emoji_font, face+6, (SDL_Color){255,255,255,255});
+  else if(!strncmp(face, "image:", 6) && !(f = SDL_LoadBMP(face+6))) fprintf(stderr,"theme: cannot load %s\n", face+6);
+  if(f) SDL_SetSurfaceBlendMode(f, SDL_BLENDMODE_BLEND);
+  return f;
+}
+
+// The CPU half of a build: loads, rasterises and packs the theme into a
+// surface and fills in everything but the texture. No renderer calls, so it
+// can run off the render thread; NULL if nothing could be packed.
+static SDL_Surface *atlas_raster(Atlas *a, TTF_Font *emoji_font, const Theme *th){
+  memset(a,0,sizeof *a);
+  a->bg = th->bg; a->grid = th->grid; a->text = th->text; a->burst = th->burst;
+  memcpy(a->piece, th->piece, sizeof a->piece);
+  a->particle_size = th->particle_size;
+  SDL_Surface *face[2] = { theme_face(th->face[0], emoji_font), theme_face(th->face[1], emoji_font) };
+  SDL_Surface *bg = th->background[0] ? SDL_LoadBMP(th->background) : NULL;
+  SDL_Surface *sprite = th->particle[0] ? SDL_LoadBMP(th->particle) : NULL;
+  if(th->background[0] && !bg) fprintf(stderr,"theme %s: cannot load %s\n", th->name, th->background);
+  if(th->particle[0] && !sprite) fprintf(stderr,"theme %s: cannot load %s\n", th->name, th->particle);
+  // sizes plus a 1px gutter, so filtering never bleeds a neighbour in
+  SDL_Rect r[ATLAS_SLOTS]; int widest = 0;
+  for(int i=0;i<ATLAS_SLOTS;i++){
+    int w = i==ATLAS_WHITE ? 4 : i==ATLAS_BG ? (bg ? bg->w : 0) : i==ATLAS_PARTICLE ? (sprite ? sprite->w : 0) : TILE;
+    int h = i==ATLAS_WHITE ? 4 : i==ATLAS_BG ? (bg ? bg->h : 0) : i==ATLAS_PARTICLE ? (sprite ? sprite->h : 0) : TILE;
+    r[i] = (SDL_Rect){ 0, 0, w ? w+1 : 0, h ? h+1 : 0 };
+    widest = imax(widest, r[i].w);
+  }
+  int w = 256, h;
+  while(w < widest) w *= 2;
+  while((h = pack_rects(r, ATLAS_SLOTS, w)) > w && w < ATLAS_MAX_W) w *= 2;
+  SDL_Surface *s = h>0 && w<=ATLAS_MAX_W ? SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888) : NULL;
+  for(int i=0;i<ATLAS_SLOTS;i++) if(r[i].w){ r[i].w--; r[i].h--; }
+  if(s){
+    surf_fill(s, r[ATLAS_WHITE].x, r[ATLAS_WHITE].y, 4, 4, (SDL_Color){255,255,255,255});
+    surf_fill(s, r[ATLAS_EMPTY].x, r[ATLAS_EMPTY].y, TILE-1, TILE-1, (SDL_Color){30,35,40,255});
+    if(bg){ SDL_Rect d = r[ATLAS_BG]; SDL_SetSurfaceBlendMode(bg, SDL_BLENDMODE_NONE); SDL_BlitSurface(bg, NULL, s, &d); a->has_bg = true; }
+    if(sprite){ SDL_Rect d = r[ATLAS_PARTICLE]; SDL_SetSurfaceBlendMode(sprite, SDL_BLENDMODE_NONE); SDL_BlitSurface(sprite, NULL, s, &d); }
+    else r[ATLAS_PARTICLE] = r[ATLAS_WHITE]; // plain square particles
+    for(int type=0;type<2;type++) for(int tint=0;tint<8;tint++){
+      SDL_Color tc = th->piece[tint];
+      SDL_Color shadow = { (Uint8)(tc.r*0.6f), (Uint8)(tc.g*0.6f), (Uint8)(tc.b*0.6f), 255 };
+      SDL_Rect o = r[ATLAS_TILES + type*8 + tint];
+      surf_fill(s, o.x+2, o.y+2, TILE-4, TILE-4, shadow);
+      surf_fill(s, o.x, o.y, TILE-4, TILE-4, tc);
+      if(face[type]){
+        float scale = (float)(TILE-6) / (float)imax(1, imax(face[type]->w, face[type]->h));
+        int fw = (int)(face[type]->w * scale); int fh=(int)(face[type]->h * scale);
+        SDL_Rect dst = { o.x + (TILE-4-fw)/2, o.y + (TILE-4-fh)/2, fw, fh };
+        SDL_BlitScaled(face[type], NULL, s, &dst);
+      }
+    }
+    a->w = (float)s->w; a->h = (float)s->h;
+    for(int i=0;i<ATLAS_SLOTS;i++){
+      a->uv[i][0] = r[i].x/a->w; a->uv[i][1] = r[i].y/a->h; a->uv[i][2] = (r[i].x+r[i].w)/a->w; a->uv[i][3] = (r[i].y+r[i].h)/a->h;
+    }
+    a->uv[ATLAS_WHITE][0] = a->uv[ATLAS_WHITE][2] = (r[ATLAS_WHITE].x+2)/a->w; // flat color samples one texel
+    a->uv[ATLAS_WHITE][1] = a->uv[ATLAS_WHITE][3] = (r[ATLAS_WHITE].y+2)/a->h;
+  }
+  for(int t=0;t<2;t++) if(face[t]) SDL_FreeSurface(face[t]);
+  if(bg) SDL_FreeSurface(bg);
+  if(sprite) SDL_FreeSurface(sprite);
+  return s;
+}
+
+// The render-thread half: the upload. Takes the surface.
+// Without a texture the batch falls back to the theme's flat colors.
+static void atlas_upload(Atlas *a, SDL_Renderer *ren, SDL_Surface *s){
+  if(!s) return;
+  a->tex = SDL_CreateTextureFromSurface(ren, s);
+  met_add(&met_main, MET_TEXTURES, 1);
+  if(a->tex) SDL_SetTextureBlendMode(a->tex, SDL_BLENDMODE_BLEND);
+  SDL_FreeSurface(s);
+}
+
+static void atlas_build(Atlas *a, SDL_Renderer *ren, TTF_Font *emoji_font, const Theme *th){
+  atlas_upload(a, ren, atlas_raster(a, emoji_font, th));
+}
+
+// A theme switch rasterises on a worker thread (font rendering, BMP loads and
+// packing can take several frames); the render thread polls between frames
+// and only uploads and swaps. The emoji font is the worker's while it runs.
+typedef struct {
+  SDL_Thread *th; atomic_bool done; bool busy;
+  TTF_Font *font; const Theme *theme; int want; // the theme index being built
+  Atlas a; SDL_Surface *surf;
+} AtlasJob;
+
+static int atlas_job_run(void *p){
+  AtlasJob *j = p;
+  j->surf = atlas_raster(&j->a, j->font, j->theme);
+  atomic_store(&j->done, true);
+  return 0;
+}
+
+static void atlas_job_start(AtlasJob *j, TTF_Font *emoji_font, const Theme *th, int want){
+  j->font = emoji_font; j->theme = th; j->want = want; j->busy = true;
+  atomic_store(&j->done, false);
+  if(!(j->th = SDL_CreateThread(atlas_job_run, "atlas", j))) atlas_job_run(j); // no thread: build inline
+}
+
+// True once the job's atlas has replaced *out (whose texture is freed).
+static bool atlas_job_poll(AtlasJob *j, SDL_Renderer *ren, Atlas *out){
+  if(!j->busy || !atomic_load(&j->done)) return false;
+  if(j->th) SDL_WaitThread(j->th, NULL);
+  j->th = NULL; j->busy = false;
+  atlas_upload(&j->a, ren, j->surf);
+  if(out->tex) SDL_DestroyTexture(out->tex);
+  *out = j->a;
+  return true;
+}
+
+// At shutdown: lets a build in flight finish and drops it.
+static void atlas_job_cancel(AtlasJob *j){
+  if(!j->busy) return;
+  if(j->th) SDL_WaitThread(j->th, NULL);
+  if(j->surf) SDL_FreeSurface(j->surf);
+  j->th = NULL; j->busy = false;
+}
+
+typedef struct { SDL_Vertex *v; int *idx; int nv, ni, cap; } Batch; // cap in vertices
+
+static void batch_quad(Batch *b, float x, float y, float w, float h, float u0, float v0, float u1, float v1, SDL_Color c){
+  if(b->nv+4 > b->cap){
+    int cap = b->cap ? b->cap*2 : 4096;
+    SDL_Vertex *v = realloc(b->v, sizeof *v*(size_t)cap); int *idx = realloc(b->idx, sizeof *idx*(size_t)(cap/4*6));
+    if(v) b->v = v;
+    if(idx) b->idx = idx;
+    if(!v || !idx) return;
+    b->cap = cap;
+  }
+  SDL_Vertex *v = b->v + b->nv;
+  v[0] = (SDL_Vertex){ { x,   y   }, c, { u0, v0 } };
+  v[1] = (SDL_Vertex){ { x+w, y   }, c, { u1, v0 } };
+  v[2] = (SDL_Vertex){ { x+w, y+h }, c, { u1, v1 } };
+  v[3] = (SDL_Vertex){ { x,   y+h }, c, { u0, v1 } };
+  int *i = b->idx + b->ni;
+  i[0]=b->nv; i[1]=b->nv+1; i[2]=b->nv+2; i[3]=b->nv; i[4]=b->nv+2; i[5]=b->nv+3;
+  b->nv += 4; b->ni += 6;
+}
+
+// Flat color: every corner samples the middle of the white slot.
+static void batch_rect(Batch *b, const Atlas *a, float x, float y, float w, float h, SDL_Color c){
+  const float *t = a->uv[ATLAS_WHITE];
+  batch_quad(b, x, y, w, h, t[0], t[1], t[2], t[3], c);
+}
+
+static void batch_slot(Batch *b, const Atlas *a, float x, float y, float w, float h, int slot){
+  const float *t = a->uv[slot];
+  batch_quad(b, x, y, w, h, t[0], t[1], t[2], t[3], (SDL_Color){255,255,255,255});
+}
+
+static void batch_tile(Batch *b, const Atlas *a, float x, float y, int type, int tint){
+  if(!a->tex){ batch_rect(b, a, x, y, TILE-4, TILE-4, a->piece[tint]); return; }
+  batch_slot(b, a, x, y, TILE, TILE, ATLAS_TILES + type*8 + tint);
+}
+
+// Vertically scaled about the tile's middle (k = 1 is a normal tile).
+static void batch_tile_squashed(Batch *b, const Atlas *a, float x, float y, int type, int tint, float k){
+  float h = TILE*k, dy = (TILE-4)*(1-k)/2;
+  if(!a->tex){ batch_rect(b, a, x, y+dy, TILE-4, (TILE-4)*k, a->piece[tint]); return; }
+  batch_slot(b, a, x, y+dy, TILE, h, ATLAS_TILES + type*8 + tint);
+}
+
+static void batch_empty(Batch *b, const Atlas *a, float x, float y){
+  if(!a->tex){ batch_rect(b, a, x, y, TILE-1, TILE-1, (SDL_Color){30,35,40,255}); return; }
+  batch_slot(b, a, x, y, TILE, TILE, ATLAS_EMPTY);
+}
+
+static void batch_flush(Batch *b, SDL_Renderer *ren, const Atlas *a){
+  if(b->ni) SDL_RenderGeometry(ren, a->tex, b->v, b->nv, b->idx, b->ni);
+  b->nv = b->ni = 0;
+}
+
+// Text: printable ASCII rasterised once, white, into a glyph strip and drawn as
+// batched quads tinted by vertex color. Rendering each string through TTF every
+// frame meant a surface and a texture upload per line, enough to drop frames
+// under a running timer.
+#define GLYPH_FIRST 32
+#define GLYPH_COUNT 95
+
+typedef struct { Atlas a; SDL_Rect src[GLYPH_COUNT]; int adv[GLYPH_COUNT]; } Glyphs;
+
+static void glyphs_build(Glyphs *gl, SDL_Renderer *ren, TTF_Font *font){
+  memset(gl,0,sizeof *gl);
+  if(!font) return;
+  SDL_Surface *gs[GLYPH_COUNT]; int w = 0, h = 1;
+  for(int i=0;i<GLYPH_COUNT;i++){
+    Uint32 ch = (Uint32)(GLYPH_FIRST + i);
+    gs[i] = TTF_RenderGlyph32_Blended(font, ch, (SDL_Color){255,255,255,255});
+    TTF_GlyphMetrics32(font, ch, NULL, NULL, NULL, NULL, &gl->adv[i]);
+    if(!gs[i]) continue;
+    gl->src[i] = (SDL_Rect){ w, 0, gs[i]->w, gs[i]->h };
+    w += gs[i]->w + 1; h = imax(h, gs[i]->h);
+  }
+  SDL_Surface *s = w ? SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888) : NULL;
+  if(s){
+    for(int i=0;i<GLYPH_COUNT;i++) if(gs[i]){
+      SDL_Rect dst = gl->src[i];
+      SDL_SetSurfaceBlendMode(gs[i], SDL_BLENDMODE_NONE); // copy coverage into alpha as is
+      SDL_BlitSurface(gs[i], NULL, s, &dst);
+    }
+    gl->a.tex = SDL_CreateTextureFromSurface(ren, s);
+    met_add(&met_main, MET_TEXTURES, 1);
+    gl->a.w = (float)s->w; gl->a.h = (float)s->h;
+    SDL_FreeSurface(s);
+    if(gl->a.tex) SDL_SetTextureBlendMode(gl->a.tex, SDL_BLENDMODE_BLEND);
+  }
+  for(int i=0;i<GLYPH_COUNT;i++) if(gs[i]) SDL_FreeSurface(gs[i]);
+}
+
+// Non-ASCII bytes are skipped. Returns the width drawn.
+static float batch_text(Batch *b, const Glyphs *gl, const char *txt, float x, float y, SDL_Color c){
+  if(!gl->a.tex || !txt) return 0;
+  float x0 = x;
+  for(; *txt; txt++){
+    int i = (unsigned char)*txt - GLYPH_FIRST;
+    if(i<0 || i>=GLYPH_COUNT) continue;
+    const SDL_Rect *r = &gl->src[i];
+    if(r->w) batch_quad(b, x, y, (float)r->w, (float)r->h, r->x/gl->a.w, r->y/gl->a.h, (r->x+r->w)/gl->a.w, (r->y+r->h)/gl->a.h, c);
+    x += (float)gl->adv[i];
+  }
+  return x - x0;
+}
+
+// Rows being cleared, and how far along their animation is: flash goes 0..1
+// over the first half, then the rows above fall (0..1, eased) over the second.
+static Uint32 clear_anim(const Game *g, float sub, float *flash, float *fall){
+  Uint32 doomed = g->phase==PHASE_CLEAR && g->clear_ticks ? full_rows(g) : 0;
+  *flash = *fall = 0;
+  if(doomed){
+    float t = ((float)(g->clear_ticks - g->phase_left) + sub) / (float)g->clear_ticks;
+    t = t<0 ? 0 : t>1 ? 1 : t;
+    *flash = t<0.5f ? t*2 : 1;
+    float f = t<0.5f ? 0 : (t-0.5f)*2; *fall = f*f*(3-2*f);
+  }
+  return doomed;
+}
+
+// sub is how far (0..1) the frame sits into the next tick. During a line
+// clear the full rows flash for the first half of the delay, then squash away
+// while the stack above eases down over them.
+static void render_board(Batch *b, const Atlas *a, const Game *g, int ox, int oy, float sub){
+  // grid bg
+  batch_rect(b, a, ox-8, oy-8, COLS*TILE+16, ROWS*TILE+16, a->grid);
+  int q = imin(garbage_queued(g), ROWS); // incoming garbage meter
+  if(q) batch_rect(b, a, ox-16, oy + (ROWS-q)*TILE, 6, q*TILE, (SDL_Color){255,90,90,255});
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) batch_empty(b, a, ox + c*TILE, oy + r*TILE);
+  float flash, fall;
+  Uint32 doomed = clear_anim(g, sub, &flash, &fall);
+  int below = 0; // doomed rows under the current one
+  for(int r=ROWS-1;r>=0;r--){
+    bool gone = doomed>>r & 1;
+    float py = (float)(oy + r*TILE) + (gone ? 0 : below*TILE*fall);
+    for(int c=0;c<COLS;c++){
+      const Cell *x = &CELL(g,r,c);
+      if(!x->filled) continue;
+      if(gone) batch_tile_squashed(b, a, ox + c*TILE, py, x->type, x->tint, 1-fall);
+      else batch_tile(b, a, ox + c*TILE, py, x->type, x->tint);
+    }
+    if(gone){
+      float pulse = 0.5f + 0.5f*cosf(flash*6*3.14159f);
+      batch_rect(b, a, ox, py, COLS*TILE-4, TILE-4, (SDL_Color){255,255,255,(Uint8)(200*pulse*(1-fall))});
+      below++;
+    }
+  }
+  if(g->phase!=PHASE_FALL) return; // no piece in play
+  // current piece
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(g->cur.m[r][c]){
+    int x = g->cur.x+c, y=g->cur.y+r; if(y<0) continue; if(x<0||x>=COLS||y>=ROWS) continue;
+    batch_tile(b, a, ox + x*TILE, oy + y*TILE, g->cur.type, g->cur.tint);
+  }
+}
+
+static void render_preview(Batch *b, const Atlas *a, const Piece *p, int ox, int oy){
+  batch_rect(b, a, ox-8, oy-8, PREVIEW_W*TILE+16, PREVIEW_H*TILE+16, a->grid);
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(p->m[r][c])
+    batch_tile(b, a, ox + c*TILE, oy + r*TILE, p->type, p->tint);
+}
+
+static void render_particles(Batch *b, const Atlas *a, const FxPool *fx, int ox, int oy){
+  for(int i=0;i<fx->live;i++){
+    const Particle *p = &fx->p[i];
+    float alpha = 1.0f - (p->life / p->maxlife);
+    const float *t = a->uv[ATLAS_PARTICLE];
+    batch_quad(b, (float)ox + (int)p->x, (float)oy + (int)p->y, (float)a->particle_size, (float)a->particle_size,
+               t[0], t[1], t[2], t[3], (SDL_Color){ p->c.r, p->c.g, p->c.b, (Uint8)(alpha*255) });
+  }
+}
+
+// Bloom (fx.bloom): glow on the CPU, for kiosks whose renderer can't be
+// trusted with shaders. What glows is known without reading the frame back:
+// particles, tiles and the flash of clearing rows are splatted into a float
+// buffer at a quarter of the view each way, blurred with a separable Gaussian
+// (SIMD along rows, stripes of rows across threads) straight into a streaming
+// texture, which is then stretched over the frame with additive blending.
+#define BLOOM_DOWN 4      // view pixels per buffer pixel, each way
+#define BLOOM_R 8         // blur radius in buffer pixels: 17 taps, 68 view pixels
+#define BLOOM_STRIPE 8    // rows per job
+#define BLOOM_THREADS 7   // workers at most; the rendering thread takes jobs too
+#define BLOOM_MAX_W 2048  // buffer row, in floats
+#define BLOOM_TILE 0.3f   // glow per source, as a fraction of its color
+#define BLOOM_PIECE 0.5f
+#define BLOOM_FLASH 1.5f
+#define BLOOM_SPARK 3.0f
+
+typedef struct {
+  int w, h, stride;       // buffer size; rows are stride floats (a multiple of 8)
+  float *plane[3];        // r g b, with BLOOM_R zero rows above and below
+  float k[BLOOM_R+1];     // centre tap, then each distance out
+  float gain;             // fx.bloom, scaled to bytes
+  int x0, y0, x1, y1;     // bounds of what was splatted (none while x0 >= x1)
+  Uint32 *out; int pitch; // this pass's destination (pitch in pixels)
+  int threads, jobs;
+  atomic_int next, done;
+  atomic_bool quit;
+  SDL_sem *go, *finished;  // finished: posted once a pass, by whoever ends its last stripe
+  SDL_Thread *th[BLOOM_THREADS];
+  SDL_Texture *tex;
+} Bloom;
+
+// dst[x] = the kernel across c[x - R*step .. x + R*step]: step is the stride
+// for the vertical pass and 1 for the horizontal. n is a multiple of 8.
+// The kernel is symmetric, so each pair of taps costs one multiply.
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2,fma"))) static void bloom_conv_avx2(const float *c, ptrdiff_t step, int n, const float *k, float *dst){
+  for(int x=0;x<n;x+=8){
+    __m256 s = _mm256_mul_ps(_mm256_set1_ps(k[0]), _mm256_loadu_ps(c+x));
+    for(int d=1;d<=BLOOM_R;d++){
+      __m256 pair = _mm256_add_ps(_mm256_loadu_ps(c+x-d*step), _mm256_loadu_ps(c+x+d*step));
+      s = _mm256_fmadd_ps(_mm256_set1_ps(k[d]), pair, s);
+    }
+    _mm256_storeu_ps(dst+x, s);
+  }
+}
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+static void (*const bloom_conv)(const float *c, ptrdiff_t step, int n, const float *k, float *dst) = bloom_conv_avx2;
+#elif defined(__SSE2__) // every x86-64: two halves of the same
+static void bloom_conv_sse2(const float *c, ptrdiff_t step, int n, const float *k, float *dst){
+  for(int x=0;x<n;x+=8){
+    __m128 k0 = _mm_set1_ps(k[0]), s0 = _mm_mul_ps(k0, _mm_loadu_ps(c+x)), s1 = _mm_mul_ps(k0, _mm_loadu_ps(c+x+4));
+    for(int d=1;d<=BLOOM_R;d++){
+      const float *a = c+x-d*step, *b = c+x+d*step;
+      __m128 kd = _mm_set1_ps(k[d]);
+      s0 = _mm_add_ps(s0, _mm_mul_ps(kd, _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))));
+      s1 = _mm_add_ps(s1, _mm_mul_ps(kd, _mm_add_ps(_mm_loadu_ps(a+4), _mm_loadu_ps(b+4))));
+    }
+    _mm_storeu_ps(dst+x, s0); _mm_storeu_ps(dst+x+4, s1);
+  }
+}
+static void (*bloom_conv)(const float *c, ptrdiff_t step, int n, const float *k, float *dst) = bloom_conv_sse2; // see simd_init
+#else
+static void bloom_conv(const float *c, ptrdiff_t step, int n, const float *k, float *dst){
+  for(int x=0;x<n;x++) dst[x] = k[0]*c[x];
+  for(int d=1;d<=BLOOM_R;d++){
+    const float *a = c - d*step, *b = c + d*step;
+    for(int x=0;x<n;x++) dst[x] += k[d]*(a[x]+b[x]);
+  }
+}
+#endif
+
+// Switches the nn kernels to AVX2, and bloom's to AVX2+FMA, when the CPU has
+// them and the build's baseline doesn't. Once, at startup, before any
+// thread. Returns what the kernels now use, for the bench.
+static const char *simd_init(void){
+#ifdef HAVE_AVX2_KERNELS
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2"), fma = avx2 && __builtin_cpu_supports("fma");
+#ifndef __AVX2__
+  if(avx2){ nn_dot = nn_dot_avx2; nn_dot4 = nn_dot4_avx2; }
+#endif
+#if defined(__SSE2__) && !(defined(__AVX2__) && defined(__FMA__))
+  if(fma) bloom_conv = bloom_conv_avx2;
+#endif
+  return fma ? "avx2+fma" : avx2 ? "avx2 (nn only)" : "sse2";
+#else
+  return "portable";
+#endif
+}
+
+// One output row: down the planes, along the row, then packed to ARGB. Only
+// the columns near the splats are blurred, and rows far from them are blank.
+static void bloom_row(Bloom *b, int y, float (*v)[BLOOM_R+BLOOM_MAX_W+BLOOM_R], float *h){
+  Uint32 *o = b->out + y*b->pitch;
+  if(b->x0>=b->x1 || y < b->y0-BLOOM_R || y >= b->y1+BLOOM_R){ memset(o, 0, (size_t)b->w*4); return; }
+  int vx0 = b->x0 & ~7, vx1 = (b->x1+7) & ~7; // in multiples of 8, which the stride is
+  int hx0 = imax(0, b->x0-BLOOM_R) & ~7, hx1 = imin(b->stride, (b->x1+BLOOM_R+7) & ~7), end = imin(b->w, hx1);
+  for(int ch=0;ch<3;ch++){
+    bloom_conv(b->plane[ch] + (y+BLOOM_R)*b->stride + vx0, b->stride, vx1-vx0, b->k, v[ch]+BLOOM_R+vx0);
+    bloom_conv(v[ch]+BLOOM_R+hx0, 1, hx1-hx0, b->k, h + ch*BLOOM_MAX_W + hx0);
+  }
+  memset(o, 0, (size_t)hx0*4);
+  for(int x=hx0;x<end;x++){
+    float r = h[x]*b->gain, g = h[BLOOM_MAX_W+x]*b->gain, bl = h[2*BLOOM_MAX_W+x]*b->gain;
+    o[x] = 0xFF000000u | (Uint32)(r<255 ? r : 255)<<16 | (Uint32)(g<255 ? g : 255)<<8 | (Uint32)(bl<255 ? bl : 255);
+  }
+  if(end < b->w) memset(o+end, 0, (size_t)(b->w-end)*4);
+}
+
+static void bloom_work(Bloom *b){
+  float v[3][BLOOM_R+BLOOM_MAX_W+BLOOM_R], h[3*BLOOM_MAX_W];
+  for(int ch=0;ch<3;ch++) memset(v[ch], 0, (size_t)(b->stride+2*BLOOM_R)*sizeof(float)); // the horizontal pass reads R past the splats
+  for(int j; (j = atomic_fetch_add(&b->next, 1)) < b->jobs; ){
+    for(int y=j*BLOOM_STRIPE, end=imin(b->h, y+BLOOM_STRIPE); y<end; y++) bloom_row(b, y, v, h);
+    if(atomic_fetch_add(&b->done, 1) + 1 == b->jobs) SDL_SemPost(b->finished);
+  }
+}
+
+static int bloom_worker(void *arg){
+  Bloom *b = arg;
+  for(;;){
+    SDL_SemWait(b->go);
+    if(atomic_load(&b->quit)) break;
+    bloom_work(b); // a late wake-up finds the jobs taken, or helps with the next pass
+  }
+  return 0;
+}
+
+// For a view of vw x vh; ren NULL blurs into memory only (the bench).
+static bool bloom_open(Bloom *b, SDL_Renderer *ren, int vw, int vh, int threads){
+  memset(b,0,sizeof *b);
+  b->w = (vw + BLOOM_DOWN-1)/BLOOM_DOWN; b->h = (vh + BLOOM_DOWN-1)/BLOOM_DOWN;
+  b->stride = (b->w + 7) & ~7;
+  if(b->stride > BLOOM_MAX_W) return false;
+  float sigma = BLOOM_R/2.5f, sum = 0;
+  for(int d=0;d<=BLOOM_R;d++){ b->k[d] = expf(-(float)(d*d)/(2*sigma*sigma)); sum += d ? 2*b->k[d] : b->k[d]; }
+  for(int d=0;d<=BLOOM_R;d++) b->k[d] /= sum;
+  b->gain = 255.0f*(float)cfg->bloom/100;
+  for(int ch=0;ch<3;ch++) if(!(b->plane[ch] = calloc((size_t)(b->h + 2*BLOOM_R)*b->stride, sizeof(float)))) return false;
+  b->jobs = (b->h + BLOOM_STRIPE-1)/BLOOM_STRIPE;
+  b->x0 = b->w; b->y0 = b->h;
+  if(ren){
+    b->tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, b->w, b->h);
+    if(!b->tex) return false;
+    SDL_SetTextureBlendMode(b->tex, SDL_BLENDMODE_ADD);
+    SDL_SetTextureScaleMode(b->tex, SDL_ScaleModeLinear);
+  }
+  b->go = SDL_CreateSemaphore(0); b->finished = SDL_CreateSemaphore(0);
+  if(!b->go || !b->finished) return false;
+  b->threads = imax(0, imin(BLOOM_THREADS, threads));
+  for(int i=0;i<b->threads;i++) b->th[i] = SDL_CreateThread(bloom_worker, "bloom", b);
+  return true;
+}
+
+static void bloom_close(Bloom *b){
+  atomic_store(&b->quit, true);
+  for(int i=0;i<b->threads;i++) SDL_SemPost(b->go);
+  for(int i=0;i<b->threads;i++) if(b->th[i]) SDL_WaitThread(b->th[i], NULL);
+  if(b->go) SDL_DestroySemaphore(b->go);
+  if(b->finished) SDL_DestroySemaphore(b->finished);
+  if(b->tex) SDL_DestroyTexture(b->tex);
+  for(int ch=0;ch<3;ch++) free(b->plane[ch]);
+  memset(b,0,sizeof *b);
+}
+
+static void bloom_clear(Bloom *b){
+  if(b->x0<b->x1) for(int ch=0;ch<3;ch++) memset(b->plane[ch] + (b->y0+BLOOM_R)*b->stride, 0, (size_t)(b->y1-b->y0)*b->stride*sizeof(float));
+  b->x0 = b->w; b->y0 = b->h; b->x1 = b->y1 = 0;
+}
+
+// Adds color c times k over a rect in view pixels, spread evenly over the
+// buffer pixels it touches so a small spark glows as much as its area.
+static void bloom_splat(Bloom *b, float x, float y, float w, float h, SDL_Color c, float k){
+  int x0 = imax(0, (int)floorf(x/BLOOM_DOWN)), x1 = imin(b->w, (int)ceilf((x+w)/BLOOM_DOWN));
+  int y0 = imax(0, (int)floorf(y/BLOOM_DOWN)), y1 = imin(b->h, (int)ceilf((y+h)/BLOOM_DOWN));
+  if(x0>=x1 || y0>=y1) return;
+  b->x0 = imin(b->x0, x0); b->x1 = imax(b->x1, x1); b->y0 = imin(b->y0, y0); b->y1 = imax(b->y1, y1);
+  k *= w*h/((float)((x1-x0)*(y1-y0))*BLOOM_DOWN*BLOOM_DOWN*255);
+  float rgb[3] = { c.r*k, c.g*k, c.b*k };
+  for(int ch=0;ch<3;ch++) for(int yy=y0;yy<y1;yy++){
+    float *p = b->plane[ch] + (yy+BLOOM_R)*b->stride;
+    for(int xx=x0;xx<x1;xx++) p[xx] += rgb[ch];
+  }
+}
+
+// The bright parts of render_board: settled tiles faintly, the piece in play
+// more, clearing rows with their flash.
+static void bloom_board(Bloom *b, const Atlas *a, const Game *g, int ox, int oy, float sub){
+  float flash, fall;
+  Uint32 doomed = clear_anim(g, sub, &flash, &fall);
+  int below = 0;
+  for(int r=ROWS-1;r>=0;r--){
+    float py = (float)(oy + r*TILE) + (doomed>>r & 1 ? 0 : below*TILE*fall);
+    if(doomed>>r & 1){
+      float pulse = 0.5f + 0.5f*cosf(flash*6*3.14159f);
+      bloom_splat(b, (float)ox, py, COLS*TILE-4, TILE-4, (SDL_Color){255,255,255,255}, BLOOM_FLASH*pulse*(1-fall));
+      below++; continue;
+    }
+    for(int c=0;c<COLS;c++){
+      const Cell *x = &CELL(g,r,c);
+      if(x->filled) bloom_splat(b, (float)(ox + c*TILE), py, TILE-4, TILE-4, a->piece[x->tint], BLOOM_TILE);
+    }
+  }
+  if(g->phase!=PHASE_FALL) return;
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++) if(g->cur.m[r][c] && g->cur.y+r>=0)
+    bloom_splat(b, (float)(ox + (g->cur.x+c)*TILE), (float)(oy + (g->cur.y+r)*TILE), TILE-4, TILE-4, a->piece[g->cur.tint], BLOOM_PIECE);
+}
+
+static void bloom_particles(Bloom *b, const Atlas *a, const FxPool *fx, int ox, int oy){
+  float s = (float)a->particle_size;
+  for(int i=0;i<fx->live;i++){
+    const Particle *p = &fx->p[i];
+    bloom_splat(b, (float)ox + (int)p->x, (float)oy + (int)p->y, s, s, p->c, BLOOM_SPARK*(1.0f - p->life/p->maxlife));
+  }
+}
+
+// Blurs the splatted buffer into out (pitch in pixels), all threads helping.
+static void bloom_run(Bloom *b, Uint32 *out, int pitch){
+  b->out = out; b->pitch = pitch;
+  atomic_store(&b->done, 0); atomic_store(&b->next, 0);
+  for(int i=0;i<b->threads;i++) SDL_SemPost(b->go);
+  bloom_work(b);
+  SDL_SemWait(b->finished); // the last stripes, on other threads
+}
+
+// Blur into the texture and add it over everything drawn so far.
+static void bloom_draw(Bloom *b, SDL_Renderer *ren){
+  void *px; int pitch;
+  if(SDL_LockTexture(b->tex, NULL, &px, &pitch)!=0) return;
+  bloom_run(b, px, pitch/4);
+  SDL_UnlockTexture(b->tex);
+  SDL_RenderCopy(ren, b->tex, NULL, NULL);
+}
+
+// Local versus: up to MAX_PLAYERS boards in one process, all stepped on the
+// same tick. Everyone gets the same seed (so the same pieces); lines cleared
+// become garbage for the next board still standing. One player is a Match of one.
+#define MAX_PLAYERS 4
+#define PANEL_W 600 // board + previews + gap, in unscaled pixels
+
+typedef struct {
+  Game g;
+  FxPool fx;
+  InputEvent pending[64]; int npending; // stamped actions waiting for their tick
+} Board;
+
+typedef struct { Board b[MAX_PLAYERS]; int n; Uint32 rng; Uint8 clear_ticks, are_ticks, mode, bag; } Match;
+
+static void match_reset(Match *m, Uint32 seed){
+  for(int i=0;i<m->n;i++){
+    Game *g = &m->b[i].g;
+    game_reset(g, seed); g->clear_ticks = m->clear_ticks; g->are_ticks = m->are_ticks; g->mode = m->mode;
+    if(m->bag) game_use_bag(g);
+    fx_reset(&m->b[i].fx, seed ^ (Uint32)i*0x85EBCA6Bu); m->b[i].npending = 0;
+  }
+  m->rng = seed ^ 0x27D4EB2Fu; // garbage holes; kept apart from the boards' piece streams
+  if(!m->rng) m->rng = 1;
+}
+
+// Every board starts from the same fixture, under the match's delays and mode.
+static void match_load(Match *m, const Game *fix){
+  match_reset(m, fix->seed);
+  for(int i=0;i<m->n;i++){
+    Game *g = &m->b[i].g;
+    *g = *fix; g->clear_ticks = m->clear_ticks; g->are_ticks = m->are_ticks; g->mode = m->mode; g->bag = m->bag;
+  }
+}
+
+// Queues each board's new attack on the next board still standing. Runs after
+// every board has stepped, so no board sees garbage sent during the same tick.
+static void match_exchange(Match *m){
+  for(int i=0;i<m->n;i++){
+    int n = m->b[i].g.attack; m->b[i].g.attack = 0;
+    if(!n) continue;
+    for(int k=1;k<m->n;k++){
+      Game *dst = &m->b[(i+k)%m->n].g;
+      if(dst->game_over) continue;
+      m->rng ^= m->rng<<13; m->rng ^= m->rng>>17; m->rng ^= m->rng<<5;
+      game_queue_garbage(dst, n, (int)(m->rng%COLS));
+      break;
+    }
+  }
+}
+
+// Index of the last board standing, -1 while more than one is (or nobody is).
+static int match_winner(const Match *m){
+  int alive = 0, last = -1;
+  for(int i=0;i<m->n;i++) if(!m->b[i].g.game_over){ alive++; last = i; }
+  return alive==1 ? last : -1;
+}
+
+static bool match_over(const Match *m){
+  if(m->n==1) return m->b[0].g.game_over;
+  int alive = 0; for(int i=0;i<m->n;i++) alive += !m->b[i].g.game_over;
+  return alive<=1;
+}
+
+// Stamped actions due by tick_end_us, oldest first.
+static int board_take(Board *b, Uint64 tick_end_us, Uint64 frame_us, Uint8 *acts){
+  int n = 0;
+  for(; n<b->npending && b->pending[n].t_us <= tick_end_us; n++){
+    acts[n] = b->pending[n].act;
+    met_observe(&met_main, met_main.input_hist, INPUT_BOUNDS_US, MET_INPUT_US, frame_us > b->pending[n].t_us ? frame_us - b->pending[n].t_us : 0);
+  }
+  met_add(&met_main, MET_INPUTS, (Uint64)n);
+  b->npending -= n; memmove(b->pending, b->pending+n, (size_t)b->npending*sizeof b->pending[0]);
+  return n;
+}
+
+// Battle royale: up to ROYALE_MAX boards a match and many matches a process,
+// all on the headless engine, stepped by one server thread at SIM_HZ. Clients
+// only send keys; the server owns every board. Cleared lines go to a target
+// picked by the sender's strategy - random, whoever is targeting it, whoever
+// is nearest to topping out, or whoever holds the most badges - and a board
+// that tops out credits the KO (and its badge points) to the last board that
+// sent it garbage. Routing never walks the players: the standing set is an
+// array with swap-removal, and who-targets-whom, stack heights and badges
+// are RoyLists keyed by small numbers, so each attack, lock and KO costs the
+// same in a match of 99 as in a match of 2.
+#define ROYALE_MAX 99
+#define ROYALE_MATCHES 32
+#define ROYALE_SEND_TICKS 4           // a frame to every client each 16 ms
+#define ROYALE_LOBBY_MS 3000          // a match short of ROYALE_MAX starts this long after its first join
+#define ROYALE_RETARGET (2*SIM_HZ)    // random targets hold this long
+#define ROYALE_OUT 32768              // bytes of unsent frames a slow client may queue before it is dropped
+#define ROYALE_BADGES 4
+enum { TGT_RANDOM, TGT_ATTACKERS, TGT_KOS, TGT_BADGES, TGT_COUNT };
+static const char *TGT_NAMES[TGT_COUNT] = { "random", "attackers", "KOs", "badges" };
+
+// Wire. Client to server, two bytes a message: ROY_ACT act, or ROY_TARGET
+// strategy. Server to client, a u16 length and then a frame: ROY_FRAME, you,
+// players, standing, place (0 while playing), KOs, badges, strategy, target
+// (0xFF: none), attackers; a u16 length and the client's own board as XOR
+// tokens against the state sent before (the time-travel ring's encoding);
+// then a count of boards whose stack or flags changed, each as id, flags
+// (standing<<7 | badges), a u32 of changed rows and each changed row's mask.
+// Mini-boards are stacks only, so a board costs bytes only when it locks.
+enum { ROY_ACT, ROY_TARGET };
+#define ROY_FRAME 2 // 1: snapshots without the garbage queue
+#define ROY_HEADER 10
+
+// Intrusive doubly linked lists of players, one per key. Moving a player is
+// O(1); the top of the highest key is a scan over the keys, never the players.
+typedef struct { Sint8 prev[ROYALE_MAX], next[ROYALE_MAX], head[ROYALE_MAX]; Uint8 size[ROYALE_MAX]; Sint16 key[ROYALE_MAX]; } RoyList;
+
+static void roy_list_init(RoyList *l){
+  memset(l->head, -1, sizeof l->head); memset(l->size, 0, sizeof l->size);
+  for(int i=0;i<ROYALE_MAX;i++) l->key[i] = -1;
+}
+
+static void roy_unlink(RoyList *l, int p){
+  int k = l->key[p];
+  if(k<0) return;
+  if(l->prev[p]>=0) l->next[l->prev[p]] = l->next[p]; else l->head[k] = l->next[p];
+  if(l->next[p]>=0) l->prev[l->next[p]] = l->prev[p];
+  l->key[p] = -1; l->size[k]--;
+}
+
+static void roy_link(RoyList *l, int p, int key){
+  roy_unlink(l, p);
+  l->key[p] = (Sint16)key; l->prev[p] = -1; l->next[p] = l->head[key];
+  if(l->head[key]>=0) l->prev[l->head[key]] = (Sint8)p;
+  l->head[key] = (Sint8)p; l->size[key]++;
+}
+
+// A player under the highest key below nkeys, other than not; -1 if none.
+static int roy_top(const RoyList *l, int nkeys, int not){
+  for(int k=nkeys-1;k>=0;k--) for(int p=l->head[k]; p>=0; p=l->next[p]) if(p!=not) return p;
+  return -1;
+}
+
+typedef struct {
+  Game g;
+  int fd;                       // -1 once the client is gone; the board plays on without input
+  Uint8 strat, kos, badge_pts, place, height; // place: 0 while standing
+  Sint8 target, last_hit;       // -1: none
+  int pieces;                   // g.pieces when height was last taken
+  Uint32 retarget_tick;
+  Uint8 acts[64]; int nacts;    // for the next tick
+  Uint8 in[2]; int nin;         // a message split across reads
+  Uint8 *out; int nout;         // frames the socket hasn't taken yet
+  Uint8 sent[SNAP_BYTES];       // own state as the client has it
+} RoyPlayer;
+
+typedef struct {
+  RoyPlayer p[ROYALE_MAX]; int n;
+  bool started, over;
+  Uint32 tick, rng, lobby_ms, over_ms;
+  Uint8 alive[ROYALE_MAX], slot[ROYALE_MAX]; int nalive; // standing players, and where each sits
+  RoyList attackers, heights, badges;                    // keyed by target, stack height, badges
+  Uint16 rows_sent[ROYALE_MAX][ROWS]; Uint8 flags_sent[ROYALE_MAX];
+} Royale;
+
+static Uint32 roy_rand(Royale *r){ r->rng ^= r->rng<<13; r->rng ^= r->rng>>17; r->rng ^= r->rng<<5; return r->rng; }
+static int roy_badges(int pts){ return pts>=30 ? 4 : pts>=14 ? 3 : pts>=6 ? 2 : pts>=2 ? 1 : 0; }
+
+static int roy_height(const Game *g){
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++) if(CELL(g,r,c).filled) return ROWS-r;
+  return 0;
+}
+
+static void roy_set_target(Royale *r, int i, int t){
+  r->p[i].target = (Sint8)t;
+  if(t>=0) roy_link(&r->attackers, i, t); else roy_unlink(&r->attackers, i);
+}
+
+static int roy_random(Royale *r, int not){
+  if(r->nalive<2) return -1;
+  int k = (int)(roy_rand(r)%(Uint32)r->nalive), p = r->alive[k];
+  return p!=not ? p : r->alive[(k+1)%r->nalive];
+}
+
+// i's target for an attack now. Strategies that find nobody (no attackers,
+// no badges anywhere) fall back to random.
+static int roy_pick(Royale *r, int i){
+  RoyPlayer *p = &r->p[i]; int t = -1;
+  if(p->strat==TGT_ATTACKERS) t = r->attackers.head[i];
+  else if(p->strat==TGT_KOS) t = roy_top(&r->heights, ROWS+1, i);
+  else if(p->strat==TGT_BADGES){ t = roy_top(&r->badges, ROYALE_BADGES+1, i); if(t>=0 && !r->badges.key[t]) t = -1; }
+  if(t<0){
+    t = p->target;
+    if(t<0 || r->p[t].place || r->tick>=p->retarget_tick){ t = roy_random(r, i); p->retarget_tick = r->tick + ROYALE_RETARGET; }
+  }
+  if(t!=p->target) roy_set_target(r, i, t);
+  return t;
+}
+
+// Badges add a quarter each to every attack.
+static void roy_send(Royale *r, int i, int lines){
+  int n = lines + lines*roy_badges(r->p[i].badge_pts)/4, t = roy_pick(r, i);
+  if(t<0) return;
+  game_queue_garbage(&r->p[t].g, n, (int)(roy_rand(r)%COLS));
+  r->p[t].last_hit = (Sint8)i;
+}
+
+static void roy_ko(Royale *r, int v){
+  if(r->over) return;
+  RoyPlayer *p = &r->p[v];
+  p->place = (Uint8)r->nalive;
+  int s = r->slot[v], last = r->alive[--r->nalive];
+  r->alive[s] = (Uint8)last; r->slot[last] = (Uint8)s;
+  roy_unlink(&r->heights, v); roy_unlink(&r->badges, v); roy_set_target(r, v, -1);
+  while(r->attackers.head[v]>=0) roy_set_target(r, r->attackers.head[v], -1); // they pick again on their next attack
+  int k = p->last_hit;
+  if(k>=0 && !r->p[k].place){
+    RoyPlayer *q = &r->p[k];
+    q->kos++; q->badge_pts = (Uint8)imin(255, q->badge_pts + 1 + p->badge_pts);
+    roy_link(&r->badges, k, roy_badges(q->badge_pts));
+  }
+  if(r->nalive==1){ r->p[r->alive[0]].place = 1; r->over = true; }
+}
+
+// Everyone gets the same seed and a 7-bag, as in versus.
+static void roy_start(Royale *r){
+  Uint32 seed = roy_rand(r);
+  r->started = true; r->tick = 0; r->nalive = r->n;
+  roy_list_init(&r->attackers); roy_list_init(&r->heights); roy_list_init(&r->badges);
+  memset(r->rows_sent, 0, sizeof r->rows_sent); memset(r->flags_sent, 0xFF, sizeof r->flags_sent);
+  for(int i=0;i<r->n;i++){
+    RoyPlayer *p = &r->p[i];
+    game_reset(&p->g, seed); game_use_bag(&p->g);
+    p->g.clear_ticks = (Uint8)cfg->clear_ticks; p->g.are_ticks = (Uint8)cfg->are_ticks;
+    r->alive[i] = r->slot[i] = (Uint8)i;
+    p->target = p->last_hit = -1; p->pieces = p->g.pieces; p->height = 0;
+    roy_link(&r->heights, i, 0); roy_link(&r->badges, i, 0);
+  }
+  for(int i=0;i<r->n;i++){ roy_set_target(r, i, roy_random(r, i)); r->p[i].retarget_tick = ROYALE_RETARGET; }
+  if(r->n==1){ r->p[0].place = 1; r->over = true; }
+}
+
+static void roy_step(Royale *r){
+  for(int i=0;i<r->n;i++){
+    RoyPlayer *p = &r->p[i];
+    if(p->place) continue;
+    sim_tick(&p->g, p->acts, p->nacts, NULL, NULL); p->nacts = 0;
+    if(p->g.pieces!=p->pieces){
+      p->pieces = p->g.pieces;
+      int h = roy_height(&p->g);
+      if(h!=p->height){ p->height = (Uint8)h; roy_link(&r->heights, i, h); }
+    }
+  }
+  for(int i=0;i<r->n;i++) if(!r->p[i].place && r->p[i].g.attack){ roy_send(r, i, r->p[i].g.attack); r->p[i].g.attack = 0; }
+  for(int i=0;i<r->n;i++) if(!r->p[i].place && r->p[i].g.game_over) roy_ko(r, i);
+  r->tick++;
+}
+
+static void roy_drop(RoyPlayer *p){
+  if(p->fd>=0) close(p->fd);
+  p->fd = -1; free(p->out); p->out = NULL; p->nout = 0;
+}
+
+static void roy_flush(RoyPlayer *p){
+  while(p->nout){
+    ssize_t k = send(p->fd, p->out, (size_t)p->nout, MSG_DONTWAIT);
+    if(k<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+    if(k<=0){ roy_drop(p); return; }
+    p->nout -= (int)k; memmove(p->out, p->out+k, (size_t)p->nout);
+  }
+}
+
+static void roy_put16(Uint8 *b, int v){ b[0] = (Uint8)v; b[1] = (Uint8)(v>>8); }
+
+// One frame per client. The stack changes are the same for everyone, so
+// they are found and encoded once.
+static void roy_broadcast(Royale *r){
+  static Uint8 shared[1 + ROYALE_MAX*(6 + 2*ROWS)];
+  int ns = 1, nb = 0;
+  for(int i=0;i<r->n;i++){
+    const RoyPlayer *p = &r->p[i];
+    Uint8 flags = (Uint8)(!p->place<<7 | roy_badges(p->badge_pts));
+    Uint16 rows[ROWS]; Uint32 changed = 0;
+    for(int y=0;y<ROWS;y++){
+      unsigned m = 0; for(int c=0;c<COLS;c++) m |= (unsigned)CELL(&p->g,y,c).filled<<c;
+      rows[y] = (Uint16)m;
+      if(rows[y]!=r->rows_sent[i][y]) changed |= 1u<<y;
+    }
+    if(!changed && flags==r->flags_sent[i]) continue;
+    shared[ns++] = (Uint8)i; shared[ns++] = flags; put_u32(shared+ns, changed); ns += 4;
+    for(int y=0;y<ROWS;y++) if(changed>>y & 1){ roy_put16(shared+ns, rows[y]); ns += 2; r->rows_sent[i][y] = rows[y]; }
+    r->flags_sent[i] = flags; nb++;
+  }
+  shared[0] = (Uint8)nb;
+  for(int i=0;i<r->n;i++){
+    RoyPlayer *p = &r->p[i];
+    if(p->fd<0) continue;
+    Uint8 f[2 + ROY_HEADER + 2 + 2*SNAP_BYTES], cur[SNAP_BYTES];
+    game_pack(&p->g, cur);
+    int own = tt_encode_delta(p->sent, cur, f + 2 + ROY_HEADER + 2);
+    memcpy(p->sent, cur, SNAP_BYTES);
+    Uint8 *h = f+2;
+    h[0] = ROY_FRAME; h[1] = (Uint8)i; h[2] = (Uint8)r->n; h[3] = (Uint8)r->nalive; h[4] = p->place; h[5] = p->kos;
+    h[6] = (Uint8)roy_badges(p->badge_pts); h[7] = p->strat; h[8] = p->target<0 ? 0xFF : (Uint8)p->target; h[9] = r->attackers.size[i];
+    roy_put16(h + ROY_HEADER, own);
+    int head = 2 + ROY_HEADER + 2 + own, len = head - 2 + ns;
+    roy_put16(f, len);
+    if(p->nout + head + ns > ROYALE_OUT){ roy_drop(p); continue; } // this far behind, it isn't coming back
+    memcpy(p->out + p->nout, f, (size_t)head); memcpy(p->out + p->nout + head, shared, (size_t)ns);
+    p->nout += head + ns;
+    roy_flush(p);
+  }
+}
+
+static void roy_read(Royale *r, RoyPlayer *p){
+  Uint8 b[256];
+  ssize_t k = recv(p->fd, b, sizeof b, MSG_DONTWAIT);
+  if(k<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+  if(k<=0){ roy_drop(p); return; }
+  for(ssize_t j=0;j<k;j++){
+    p->in[p->nin++] = b[j];
+    if(p->nin<2) continue;
+    p->nin = 0;
+    if(p->in[0]==ROY_ACT && p->in[1]<ACT_COUNT && r->started && !p->place && p->nacts<(int)sizeof p->acts) p->acts[p->nacts++] = p->in[1];
+    else if(p->in[0]==ROY_TARGET && p->in[1]<TGT_COUNT) p->strat = p->in[1];
+  }
+}
+
+static void tcp_nodelay(int fd){
+  int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// A non-blocking listener on every interface (the metrics one is loopback only).
+static int tcp_listen(int port){
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd<0) return -1;
+  int one = 1; setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in a = {0};
+  a.sin_family = AF_INET; a.sin_port = htons((Uint16)port); a.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(bind(fd, (struct sockaddr*)&a, sizeof a)!=0 || listen(fd, 128)!=0){ close(fd); return -1; }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+// Into the newest match still forming, or a new one; false if the server is full.
+static bool roy_join(Royale **m, int fd){
+  int mi = 0;
+  while(mi<ROYALE_MATCHES && !(m[mi] && !m[mi]->started && m[mi]->n<ROYALE_MAX)) mi++;
+  if(mi==ROYALE_MATCHES){
+    mi = 0; while(mi<ROYALE_MATCHES && m[mi]) mi++;
+    if(mi==ROYALE_MATCHES || !(m[mi] = calloc(1, sizeof **m))) return false;
+    m[mi]->rng = ((Uint32)SDL_GetPerformanceCounter() ^ (Uint32)mi*0x9E3779B9u) | 1;
+  }
+  Royale *r = m[mi];
+  RoyPlayer *p = &r->p[r->n];
+  memset(p, 0, sizeof *p);
+  if(!(p->out = malloc(ROYALE_OUT))) return false;
+  tcp_nodelay(fd);
+  p->fd = fd; p->target = p->last_hit = -1;
+  if(!r->n++) r->lobby_ms = SDL_GetTicks();
+  return true;
+}
+
+// Runs until `matches` matches have finished (0: for good).
+static int royale_server(int port, int matches){
+  signal(SIGPIPE, SIG_IGN);
+  perf_hz = SDL_GetPerformanceFrequency();
+  int lfd = tcp_listen(port);
+  if(lfd<0){ fprintf(stderr,"royale: cannot listen on port %d\n", port); return 1; }
+  fd_limit_raise();
+  printf("royale: listening on port %d\n", port); fflush(stdout);
+
+  static Royale *m[ROYALE_MATCHES];
+  static struct pollfd pf[1 + ROYALE_MATCHES*ROYALE_MAX]; static int who[1 + ROYALE_MATCHES*ROYALE_MAX];
+  int done = 0; Uint64 next = perf_us(), ticks = 0, busy_us = 0, worst_us = 0; Uint32 paused = 0;
+  while(!matches || done<matches){
+    int np = 0;
+    pf[np++] = (struct pollfd){ lfd, listen_events(&paused), 0 };
+    for(int mi=0;mi<ROYALE_MATCHES;mi++) if(m[mi]) for(int i=0;i<m[mi]->n;i++){
+      const RoyPlayer *p = &m[mi]->p[i];
+      if(p->fd<0) continue;
+      pf[np] = (struct pollfd){ p->fd, (short)(POLLIN | (p->nout ? POLLOUT : 0)), 0 }; who[np++] = mi*ROYALE_MAX + i;
+    }
+    Uint64 now = perf_us();
+    poll(pf, (nfds_t)np, next>now ? (int)((next-now)/1000) : 0);
+    if(pf[0].revents & POLLIN) for(int c; (c = accept_or_pause(lfd, &paused))>=0;) if(!roy_join(m, c)) close(c);
+    for(int k=1;k<np;k++){
+      Royale *r = m[who[k]/ROYALE_MAX]; RoyPlayer *p = &r->p[who[k]%ROYALE_MAX];
+      if(pf[k].revents & (POLLIN|POLLHUP|POLLERR)) roy_read(r, p);
+      if(p->fd>=0 && pf[k].revents & POLLOUT) roy_flush(p);
+    }
+
+    now = perf_us();
+    if(now > next + 250000) next = now; // don't spiral after a stall
+    while(now >= next){
+      next += TICK_US;
+      Uint64 t0 = perf_us();
+      Uint32 ms = SDL_GetTicks();
+      for(int mi=0;mi<ROYALE_MATCHES;mi++){
+        Royale *r = m[mi];
+        if(!r) continue;
+        if(!r->started){
+          if(r->n==ROYALE_MAX || (r->n>=2 && ms - r->lobby_ms >= ROYALE_LOBBY_MS)) roy_start(r);
+          continue;
+        }
+        if(!r->over){
+          roy_step(r);
+          if(r->over || r->tick%ROYALE_SEND_TICKS==0) roy_broadcast(r);
+          if(r->over){
+            int w = r->alive[0];
+            printf("match %d: %d boards, won by %d (%s, %d KOs) after %.1fs\n", mi, r->n, w, TGT_NAMES[r->p[w].strat], r->p[w].kos, (double)r->tick/SIM_HZ);
+            fflush(stdout);
+            r->over_ms = ms;
+          }
+          continue;
+        }
+        // Finished: closed once every client has its last frame (or a second has passed).
+        bool drained = true;
+        for(int i=0;i<r->n;i++) drained &= r->p[i].fd<0 || !r->p[i].nout;
+        if(drained || ms - r->over_ms > 1000){
+          for(int i=0;i<r->n;i++) roy_drop(&r->p[i]);
+          free(r); m[mi] = NULL; done++;
+        }
+      }
+      Uint64 us = perf_us() - t0;
+      ticks++; busy_us += us; if(us>worst_us) worst_us = us;
+    }
+  }
+  printf("royale: %d matches, %llu ticks, %.1f us a tick on average, %llu us at worst\n", done,
+         (unsigned long long)ticks, ticks ? (double)busy_us/ticks : 0.0, (unsigned long long)worst_us);
+  close(lfd);
+  return 0;
+}
+
+// Client side: the decoded frames.
+typedef struct {
+  int fd;
+  Uint8 in[1<<16]; int nin;
+  Uint8 snap[SNAP_BYTES]; Game g; bool has_game;
+  Uint8 you, players, alive, place, kos, badges, strat, target, attackers;
+  Uint16 rows[ROYALE_MAX][ROWS]; Uint8 flags[ROYALE_MAX];
+} RoyClient;
+
+static int tcp_connect(const char *addr){
+  char host[256]; const char *colon = strrchr(addr, ':');
+  if(!colon || colon==addr || (size_t)(colon-addr)>=sizeof host){ fprintf(stderr,"%s: expected HOST:PORT\n", addr); return -1; }
+  memcpy(host, addr, (size_t)(colon-addr)); host[colon-addr] = 0;
+  struct addrinfo hints = {0}, *res = NULL;
+  hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host, colon+1, &hints, &res)!=0 || !res){ fprintf(stderr,"%s: cannot resolve\n", addr); return -1; }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if(fd>=0 && connect(fd, res->ai_addr, res->ai_addrlen)!=0){ close(fd); fd = -1; }
+  freeaddrinfo(res);
+  if(fd<0){ fprintf(stderr,"%s: cannot connect\n", addr); return -1; }
+  tcp_nodelay(fd);
+  return fd;
+}
+
+static bool get_varint_in(const Uint8 **p, const Uint8 *end, Uint32 *v){
+  *v = 0;
+  for(int s=0;s<35;s+=7){
+    if(*p>=end) return false;
+    Uint8 b = *(*p)++; *v |= (Uint32)(b&0x7F)<<s;
+    if(!(b&0x80)) return true;
+  }
+  return false;
+}
+
+// Frames come off the network, so unlike the ring's own records they are checked.
+static bool roy_frame(RoyClient *c, const Uint8 *f, int len){
+  if(len < ROY_HEADER+2+1 || f[0]!=ROY_FRAME || f[1]>=ROYALE_MAX || f[2]>ROYALE_MAX) return false;
+  c->you = f[1]; c->players = f[2]; c->alive = f[3]; c->place = f[4]; c->kos = f[5]; c->badges = f[6]; c->strat = f[7]; c->target = f[8]; c->attackers = f[9];
+  int own = f[ROY_HEADER] | f[ROY_HEADER+1]<<8;
+  if(ROY_HEADER+2+own+1 > len) return false;
+  const Uint8 *p = f + ROY_HEADER + 2, *end = p + own;
+  for(Uint64 i=0; p<end;){
+    Uint32 z, l;
+    if(!get_varint_in(&p, end, &z) || !get_varint_in(&p, end, &l) || i+z+l > SNAP_BYTES || l > (Uint64)(end-p)) return false;
+    for(i+=z; l; l--,i++) c->snap[i] ^= *p++;
+  }
+  if(!snap_sane(c->snap)) return false;
+  game_unpack(&c->g, c->snap); c->has_game = true;
+  end = f + len;
+  int nb = *p++;
+  for(int b=0;b<nb;b++){
+    if(end-p < 6 || p[0]>=ROYALE_MAX) return false;
+    int id = p[0]; c->flags[id] = p[1];
+    Uint32 changed = get_u32(p+2); p += 6;
+    for(int y=0;y<ROWS;y++) if(changed>>y & 1){
+      if(end-p < 2) return false;
+      c->rows[id][y] = (Uint16)(p[0] | p[1]<<8); p += 2;
+    }
+  }
+  return true;
+}
+
+// Takes whatever has arrived; false once the server has closed (or garbled) the stream.
+static bool roy_client_read(RoyClient *c){
+  for(;;){
+    ssize_t k = recv(c->fd, c->in + c->nin, sizeof c->in - (size_t)c->nin, MSG_DONTWAIT);
+    if(k<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+    if(k<=0) return false;
+    c->nin += (int)k;
+    int at = 0;
+    while(c->nin - at >= 2){
+      int len = c->in[at] | c->in[at+1]<<8;
+      if(c->nin - at - 2 < len) break;
+      if(!roy_frame(c, c->in + at + 2, len)) return false;
+      at += 2 + len;
+    }
+    c->nin -= at; memmove(c->in, c->in + at, (size_t)c->nin);
+    if(c->nin==(int)sizeof c->in) return false;
+  }
+  return true;
+}
+
+static bool roy_client_send(RoyClient *c, int kind, const Uint8 *args, int n){
+  Uint8 b[128]; n = imin(n, (int)sizeof b/2);
+  for(int i=0;i<n;i++){ b[2*i] = (Uint8)kind; b[2*i+1] = args[i]; }
+  return !n || send(c->fd, b, (size_t)(2*n), 0)==2*n;
+}
+
+static void roy_client_close(RoyClient *c){ if(c->fd>=0) close(c->fd); c->fd = -1; }
+
+// n bot clients from one thread, each decoding its own stream and playing
+// its own board with the greedy bot - a whole match's load on one box.
+// Strategies go round-robin; the tally says how each did.
+static int royale_bots(const char *addr, int n, const Net *net){
+  signal(SIGPIPE, SIG_IGN);
+  perf_hz = SDL_GetPerformanceFrequency();
+  RoyClient *c = calloc((size_t)n, sizeof *c); Bot *bots = calloc((size_t)n, sizeof *bots);
+  struct pollfd *pf = calloc((size_t)n, sizeof *pf);
+  if(!c || !bots || !pf){ fprintf(stderr,"royale: out of memory\n"); free(c); free(bots); free(pf); return 1; }
+  int open = 0;
+  for(int i=0;i<n;i++){
+    c[i].fd = tcp_connect(addr);
+    Uint8 s = (Uint8)(i%TGT_COUNT);
+    if(c[i].fd<0 || !roy_client_send(&c[i], ROY_TARGET, &s, 1)){ roy_client_close(&c[i]); continue; }
+    bots[i] = (Bot){ net, NULL, 0, -1, 0, 0, false, false, NULL, NULL, 0, 0, false, {0} };
+    open++;
+  }
+  int played[TGT_COUNT] = {0}, wins[TGT_COUNT] = {0}, kos[TGT_COUNT] = {0}; long places[TGT_COUNT] = {0};
+  Uint64 next = perf_us();
+  while(open){
+    int np = 0;
+    for(int i=0;i<n;i++) if(c[i].fd>=0) pf[np++] = (struct pollfd){ c[i].fd, POLLIN, 0 };
+    Uint64 now = perf_us();
+    poll(pf, (nfds_t)np, next>now ? (int)((next-now)/1000) : 0);
+    now = perf_us();
+    if(now < next) continue;
+    next = now > next + 250000 ? now : next + TICK_US;
+    for(int i=0;i<n;i++){
+      RoyClient *rc = &c[i];
+      if(rc->fd<0) continue;
+      bool ok = roy_client_read(rc);
+      if(ok && rc->has_game && !rc->place){
+        Uint8 acts[4+COLS+1]; int na = bot_act(&bots[i], &rc->g, acts);
+        ok = roy_client_send(rc, ROY_ACT, acts, na);
+      }
+      if(!ok){
+        roy_client_close(rc); open--;
+        if(rc->has_game && rc->place){ int s = rc->strat%TGT_COUNT; played[s]++; wins[s] += rc->place==1; kos[s] += rc->kos; places[s] += rc->place; }
+      }
+    }
+  }
+  for(int s=0;s<TGT_COUNT;s++) if(played[s])
+    printf("%-9s %3d boards: %d won, mean place %.1f, %.2f KOs each\n", TGT_NAMES[s], played[s], wins[s], (double)places[s]/played[s], (double)kos[s]/played[s]);
+  free(c); free(bots); free(pf);
+  return 0;
+}
+
+// The GUI client's mini-boards: everyone else's stack, 3 px a cell.
+#define ROY_CELL 3
+#define ROY_MINI_W (COLS*ROY_CELL + 6)
+#define ROY_MINI_H (ROWS*ROY_CELL + 8)
+#define ROY_MINI_COLS 14
+
+static void roy_render_minis(Batch *b, const Atlas *a, const RoyClient *c, int x, int y){
+  for(int id=0,k=0; id<c->players; id++){
+    if(id==c->you) continue;
+    float bx = (float)(x + k%ROY_MINI_COLS*ROY_MINI_W), by = (float)(y + k/ROY_MINI_COLS*ROY_MINI_H); k++;
+    bool standing = c->flags[id]>>7;
+    batch_rect(b, a, bx, by, COLS*ROY_CELL, ROWS*ROY_CELL, id==c->target ? (SDL_Color){90,70,30,255} : (SDL_Color){30,35,40,255});
+    SDL_Color fill = standing ? (SDL_Color){170,180,200,255} : (SDL_Color){110,50,50,255};
+    for(int r=0;r<ROWS;r++) for(int col=0;col<COLS;col++)
+      if(c->rows[id][r]>>col & 1) batch_rect(b, a, bx + col*ROY_CELL, by + r*ROY_CELL, ROY_CELL-1, ROY_CELL-1, fill);
+    for(int j=0;j<(c->flags[id]&7);j++) batch_rect(b, a, bx + j*5, by + ROWS*ROY_CELL + 2, 4, 4, (SDL_Color){255,210,60,255});
+  }
+}
+
+// Timed runs (sprint/ultra): a split every SPLIT_LINES credited lines, timed on
+// the sim clock, compared live against the personal best. Bests live in a text
+// file, one line per mode: name, result, then split times in us. The result is
+// the finish time in us for sprint (lower wins) and the score for ultra.
+#define SPLIT_LINES 10
+#define MAX_SPLITS 32
+
+typedef struct { Uint64 result; int nsplits; Uint64 split_us[MAX_SPLITS]; } RunRecord;
+typedef struct { RunRecord cur, best[3]; bool has_best[3], new_best; } Run; // best[] by mode
+
+static const char *MODE_NAMES[3] = { "marathon", "sprint", "ultra" };
+
+static Uint64 game_us(const Game *g){ return (Uint64)g->tick*TICK_US; }
+
+// After every tick: several splits crossed by one lock share its time.
+static void run_note(RunRecord *r, const Game *g){
+  int due = imin(lines_credited(g)/SPLIT_LINES, MAX_SPLITS);
+  while(r->nsplits < due) r->split_us[r->nsplits++] = game_us(g);
+}
+
+static void pb_load(Run *run, const char *path){
+  FILE *f = fopen(path, "r");
+  if(!f) return;
+  char line[1024];
+  while(fgets(line, sizeof line, f)){
+    char name[16]; unsigned long long v; int off = 0;
+    if(sscanf(line, "%15s %llu%n", name, &v, &off)!=2) continue;
+    for(int m=MODE_SPRINT;m<=MODE_ULTRA;m++) if(!strcmp(name, MODE_NAMES[m])){
+      RunRecord *r = &run->best[m]; memset(r,0,sizeof *r);
+      r->result = v; run->has_best[m] = true;
+      for(const char *p = line+off; r->nsplits<MAX_SPLITS && sscanf(p, " %llu%n", &v, &off)==1; p += off) r->split_us[r->nsplits++] = v;
+    }
+  }
+  fclose(f);
+}
+
+static bool pb_save(const Run *run, const char *path){
+  char body[4096]; TextBuf tb = { body, 0, sizeof body }; body[0] = 0;
+  for(int m=MODE_SPRINT;m<=MODE_ULTRA;m++){
+    if(!run->has_best[m]) continue;
+    const RunRecord *r = &run->best[m];
+    tb_printf(&tb, "%s %llu", MODE_NAMES[m], (unsigned long long)r->result);
+    for(int i=0;i<r->nsplits;i++) tb_printf(&tb, " %llu", (unsigned long long)r->split_us[i]);
+    tb_printf(&tb, "\n");
+  }
+  return write_file_atomic(path, body, tb.n);
+}
+
+// A finished run becomes the best if it beats the stored one (or there is none).
+static bool run_finish(Run *run, const Game *g){
+  RunRecord *r = &run->cur;
+  r->result = g->mode==MODE_SPRINT ? game_us(g) : (Uint64)g->score;
+  const RunRecord *b = &run->best[g->mode];
+  bool better = !run->has_best[g->mode] || (g->mode==MODE_SPRINT ? r->result < b->result : r->result > b->result);
+  if(better){ run->best[g->mode] = *r; run->has_best[g->mode] = true; }
+  return run->new_best = better;
+}
+
+static void fmt_time(char *out, size_t n, Uint64 us){
+  Uint64 ms = us/1000;
+  snprintf(out, n, "%u:%02u.%03u", (unsigned)(ms/60000), (unsigned)(ms/1000%60), (unsigned)(ms%1000));
+}
+
+// Timer, the last few splits against the best, and the best itself.
+#define HUD_SPLITS 6
+static void render_run_hud(Batch *b, const Glyphs *gl, const Run *run, const Game *g, float x, float y, SDL_Color text){
+  char buf[64], t[24];
+  const RunRecord *r = &run->cur, *best = run->has_best[g->mode] ? &run->best[g->mode] : NULL;
+  if(g->mode==MODE_SPRINT) snprintf(buf, sizeof buf, "SPRINT  %d/%d", imin(lines_credited(g), SPRINT_LINES), SPRINT_LINES);
+  else snprintf(buf, sizeof buf, "ULTRA  %d", g->score);
+  batch_text(b, gl, buf, x, y, text);
+  Uint64 us = g->mode==MODE_ULTRA ? (Uint64)(ULTRA_TICKS - imin((int)g->tick, ULTRA_TICKS))*TICK_US : game_us(g);
+  fmt_time(t, sizeof t, us);
+  batch_text(b, gl, t, x, y+28, (SDL_Color){255,210,60,255});
+  int first = imax(0, r->nsplits - HUD_SPLITS);
+  for(int i=first;i<r->nsplits;i++){
+    float ly = y + 64 + (float)(i-first)*24;
+    snprintf(buf, sizeof buf, "%3d  ", (i+1)*SPLIT_LINES);
+    fmt_time(t, sizeof t, r->split_us[i]); strcat(buf, t);
+    float w = batch_text(b, gl, buf, x, ly, text);
+    if(!best || i>=best->nsplits) continue;
+    double d = ((double)r->split_us[i] - (double)best->split_us[i])/1e6;
+    snprintf(buf, sizeof buf, "  %+.3f", d);
+    batch_text(b, gl, buf, x+w, ly, d<=0 ? (SDL_Color){120,230,140,255} : (SDL_Color){255,120,120,255});
+  }
+  if(!best) return;
+  if(g->mode==MODE_SPRINT){ fmt_time(t, sizeof t, best->result); snprintf(buf, sizeof buf, "PB %s", t); }
+  else snprintf(buf, sizeof buf, "PB %llu", (unsigned long long)best->result);
+  batch_text(b, gl, buf, x, y + 72 + HUD_SPLITS*24, (SDL_Color){160,170,180,255});
+}
+
+// Leaderboard: every marathon score submitted, as a count per score bucket
+// under a Fenwick tree, so adding a score and asking where one places are
+// both O(log buckets) however many there are. Scores below LB_EXACT have a
+// bucket each and rank exactly; above it each power of two is cut into
+// LB_SUB buckets whose scores rank as ties. The counts are also kept flat,
+// for the snapshot thread and the file: magic, version, total, then the
+// non-empty buckets as (gap, count) varints and a crc32c of it all - a few
+// bytes per distinct score, not per game.
+#define LB_MAGIC 0x424C4249u // "IBLB"
+#define LB_VERSION 1
+#define LB_EXACT_BITS 20
+#define LB_EXACT (1u<<LB_EXACT_BITS)
+#define LB_SUB_BITS 6
+#define LB_SUB (1<<LB_SUB_BITS)
+#define LB_BUCKETS ((int)LB_EXACT + (32-LB_EXACT_BITS)*LB_SUB)
+#define LB_SNAPSHOT_MS 10000
+#define LB_CLIENTS 1024
+#define LB_LINE 64
+#define LB_IN 4096        // received and not yet parsed
+#define LB_OUT 4096
+#define LB_REPLY 24       // longest reply, "RANK OF\n"
+#define LB_STALL_MS 10000 // a client whose replies sit unread this long is dropped
+#define LB_PENDING 65536
+
+typedef struct {
+  Uint32 tree[LB_BUCKETS+1];        // Fenwick, 1-based; only the thread that adds touches it
+  _Atomic Uint32 count[LB_BUCKETS]; // the same counts flat, read by the snapshot thread
+  _Atomic Uint32 total;
+} Leaderboard;
+
+static int lb_bucket(Uint32 score){
+  if(score < LB_EXACT) return (int)score;
+  int e = 31; while(!(score>>e)) e--;
+  return (int)LB_EXACT + (e-LB_EXACT_BITS)*LB_SUB + (int)(score>>(e-LB_SUB_BITS) & (LB_SUB-1));
+}
+
+static void lb_bump(_Atomic Uint32 *v, Uint32 n){ atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed); }
+
+static void lb_add(Leaderboard *lb, Uint32 score){
+  int b = lb_bucket(score);
+  for(int i=b+1;i<=LB_BUCKETS;i+=i&-i) lb->tree[i]++;
+  lb_bump(&lb->count[b], 1); lb_bump(&lb->total, 1);
+}
+
+// Where score places: one past the scores above it, out of `of`.
+static Uint32 lb_rank(const Leaderboard *lb, Uint32 score, Uint32 *of){
+  Uint32 at_or_below = 0;
+  for(int i=lb_bucket(score)+1;i>0;i-=i&-i) at_or_below += lb->tree[i];
+  *of = atomic_load_explicit(&lb->total, memory_order_relaxed);
+  return *of - at_or_below + 1;
+}
+
+// A missing file is an empty board.
+static bool lb_load(Leaderboard *lb, const char *path){
+  memset(lb, 0, sizeof *lb);
+  size_t len = 0;
+  Uint8 *b = read_file(path, &len);
+  if(!b) return true;
+  const Uint8 *p = b+9, *end = b + (len>=4 ? len-4 : 0);
+  Uint32 n = 0, total = 0, sum = 0;
+  bool ok = len>=13 && get_u32(b)==LB_MAGIC && b[4]==LB_VERSION && get_u32(end)==crc32c(0, b, len-4) && get_varint_in(&p, end, &n);
+  if(ok) total = get_u32(b+5);
+  for(Uint32 i=0, at=0; ok && i<n; i++){
+    Uint32 gap, c;
+    ok = get_varint_in(&p, end, &gap) && get_varint_in(&p, end, &c) && gap < (Uint32)LB_BUCKETS - at && c && c <= total - sum;
+    if(ok){ at += gap; atomic_store_explicit(&lb->count[at], c, memory_order_relaxed); sum += c; at++; }
+  }
+  ok = ok && p==end && sum==total;
+  free(b);
+  if(!ok){ fprintf(stderr,"%s: not a leaderboard\n", path); return false; }
+  // The tree from the counts in one pass: each node passes its sum up to its parent.
+  for(int i=1;i<=LB_BUCKETS;i++) lb->tree[i] += atomic_load_explicit(&lb->count[i-1], memory_order_relaxed);
+  for(int i=1;i<=LB_BUCKETS;i++) if(i + (i&-i) <= LB_BUCKETS) lb->tree[i + (i&-i)] += lb->tree[i];
+  atomic_store_explicit(&lb->total, total, memory_order_relaxed);
+  return true;
+}
+
+// Safe beside lb_add on another thread: each bucket is read once, and the
+// total written is the sum of what was read, so the file is always whole.
+static bool lb_save(const Leaderboard *lb, const char *path){
+  Uint8 *b = malloc(9 + 5 + (size_t)LB_BUCKETS*10 + 4);
+  if(!b) return false;
+  Uint8 *body = b + 9 + 5, *p = body;
+  Uint32 n = 0, total = 0;
+  for(int i=0, last=0; i<LB_BUCKETS; i++){
+    Uint32 c = atomic_load_explicit(&lb->count[i], memory_order_relaxed);
+    if(!c) continue;
+    p += put_varint(p, (Uint32)(i-last)); p += put_varint(p, c);
+    last = i+1; n++; total += c;
+  }
+  Uint8 h[14]; put_u32(h, LB_MAGIC); h[4] = LB_VERSION; put_u32(h+5, total);
+  int nh = 9 + put_varint(h+9, n);
+  memcpy(body - nh, h, (size_t)nh); // the header goes right in front of the body
+  size_t len = (size_t)(p - (body - nh));
+  put_u32(p, crc32c(0, body - nh, len)); len += 4;
+  bool ok = write_file_atomic(path, body - nh, len);
+  free(b);
+  return ok;
+}
+
+// Every LB_SNAPSHOT_MS while there is something new, and once more on the way out.
+typedef struct { const Leaderboard *lb; const char *path; atomic_bool stop; } LbSaver;
+
+static int lb_saver(void *arg){
+  LbSaver *s = arg;
+  Uint32 saved = atomic_load(&s->lb->total), last_ms = SDL_GetTicks();
+  for(bool last = false; !last;){
+    SDL_Delay(100);
+    last = atomic_load(&s->stop);
+    Uint32 total = atomic_load_explicit(&s->lb->total, memory_order_relaxed), ms = SDL_GetTicks();
+    if(total==saved || (!last && ms - last_ms < LB_SNAPSHOT_MS)) continue;
+    if(lb_save(s->lb, s->path)) saved = total; else fprintf(stderr,"leaderboard: cannot write %s\n", s->path);
+    last_ms = ms;
+  }
+  return 0;
+}
+
+// The service: one thread and one poll loop over up to LB_CLIENTS
+// connections, in lines. "add SCORE" and "rank SCORE" are both answered
+// "RANK OF" (add counts the new score in both). Every reply in a round comes
+// from the board as it stood at the start of the round, and the round's adds
+// go in after the last reply - so a burst of writes from the whole fleet is
+// never queued in front of a read, and costs the reads nothing but its
+// share of one pass of O(log n) updates. A client that pipelines faster than
+// it reads is not parsed further while its replies can't fit; its requests
+// wait in in[] (and then in the socket), and only one whose replies stay
+// unread for LB_STALL_MS is dropped.
+typedef struct { int fd; char in[LB_IN]; int nin; char out[LB_OUT]; int nout; Uint32 full_ms; } LbClient; // full_ms: 0 = not full
+
+static volatile sig_atomic_t lb_quit;
+static void lb_on_signal(int sig){ (void)sig; lb_quit = 1; }
+
+static void lb_reply(LbClient *c, const char *s){
+  int n = (int)strlen(s); // lb_parse leaves room for LB_REPLY
+  memcpy(c->out + c->nout, s, (size_t)n); c->nout += n;
+}
+
+static void lb_line(LbClient *c, const char *line, const Leaderboard *lb, Uint32 *pending, int *npending){
+  char cmd[8], rest; unsigned long v; char buf[LB_REPLY];
+  int k = sscanf(line, "%7s %lu %c", cmd, &v, &rest);
+  bool add = k==2 && !strcmp(cmd, "add");
+  if(k!=2 || (!add && strcmp(cmd, "rank")) || v > 0xFFFFFFFFul){ lb_reply(c, "error\n"); return; }
+  Uint32 of, r = lb_rank(lb, (Uint32)v, &of);
+  if(add){ pending[(*npending)++] = (Uint32)v; of++; }
+  snprintf(buf, sizeof buf, "%u %u\n", r, of);
+  lb_reply(c, buf);
+}
+
+// Answers c's complete lines while a reply still fits in out; the rest stay
+// in in[] for a later round. False on a line longer than LB_LINE.
+static bool lb_parse(LbClient *c, Leaderboard *lb, Uint32 *pending, int *npending){
+  int at = 0;
+  while(c->nout + LB_REPLY <= LB_OUT){
+    char *line = c->in + at, *nl = memchr(line, '\n', (size_t)(c->nin - at));
+    if(!nl) break;
+    if(nl - line >= LB_LINE) return false;
+    *nl = 0; if(nl>line && nl[-1]=='\r') nl[-1] = 0;
+    if(*npending==LB_PENDING){ for(int q=0;q<*npending;q++) lb_add(lb, pending[q]); *npending = 0; }
+    lb_line(c, line, lb, pending, npending);
+    at = (int)(nl+1 - c->in);
+  }
+  memmove(c->in, c->in + at, (size_t)(c->nin - at)); c->nin -= at;
+  return c->nout + LB_REPLY > LB_OUT || c->nin < LB_LINE || memchr(c->in, '\n', (size_t)c->nin);
+}
+
+static int leaderboard_server(int port, const char *path){
+  static Leaderboard lb;
+  if(!lb_load(&lb, path)) return 1;
+  signal(SIGPIPE, SIG_IGN); signal(SIGINT, lb_on_signal); signal(SIGTERM, lb_on_signal);
+  int lfd = tcp_listen(port);
+  if(lfd<0){ fprintf(stderr,"leaderboard: cannot listen on port %d\n", port); return 1; }
+  fd_limit_raise();
+  printf("leaderboard: %u scores from %s, listening on port %d\n", atomic_load(&lb.total), path, port); fflush(stdout);
+  static LbSaver saver; saver.lb = &lb; saver.path = path; atomic_init(&saver.stop, false);
+  SDL_Thread *saver_th = SDL_CreateThread(lb_saver, "leaderboard", &saver);
+
+  static LbClient c[LB_CLIENTS]; static struct pollfd pf[1 + LB_CLIENTS]; static Uint32 pending[LB_PENDING];
+  int nc = 0; Uint32 paused = 0;
+  while(!lb_quit){
+    pf[0] = (struct pollfd){ lfd, listen_events(&paused), 0 };
+    for(int i=0;i<nc;i++) pf[1+i] = (struct pollfd){ c[i].fd, (short)((c[i].nin < LB_IN ? POLLIN : 0) | (c[i].nout ? POLLOUT : 0)), 0 };
+    if(poll(pf, (nfds_t)(1+nc), 250)<0) continue; // a timeout still runs the stall checks
+    int npending = 0; Uint32 ms = SDL_GetTicks();
+    for(int i=0;i<nc;i++){
+      LbClient *cl = &c[i];
+      bool ok = true;
+      if((pf[1+i].revents & (POLLIN|POLLHUP|POLLERR)) && cl->nin < LB_IN){
+        ssize_t k = recv(cl->fd, cl->in + cl->nin, (size_t)(LB_IN - cl->nin), MSG_DONTWAIT);
+        ok = k>0 || (k<0 && (errno==EAGAIN || errno==EWOULDBLOCK));
+        if(k>0) cl->nin += (int)k;
+      }
+      if(ok) ok = lb_parse(cl, &lb, pending, &npending);
+      while(ok && cl->nout){
+        ssize_t k = send(cl->fd, cl->out, (size_t)cl->nout, MSG_DONTWAIT);
+        if(k<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+        ok = k>0;
+        if(ok){ cl->nout -= (int)k; memmove(cl->out, cl->out+k, (size_t)cl->nout); }
+      }
+      if(ok) ok = lb_parse(cl, &lb, pending, &npending); // what the send made room for
+      if(cl->nout + LB_REPLY <= LB_OUT) cl->full_ms = 0;
+      else if(!cl->full_ms) cl->full_ms = ms | 1;
+      else if(ms - cl->full_ms > LB_STALL_MS) ok = false; // not reading its replies
+      if(!ok){ close(cl->fd); nc--; c[i] = c[nc]; pf[1+i] = pf[1+nc]; i--; } // the last one moves in and is handled next
+    }
+    for(int q=0;q<npending;q++) lb_add(&lb, pending[q]);
+    if(pf[0].revents & POLLIN) for(int fd; (fd = accept_or_pause(lfd, &paused))>=0;){
+      if(nc==LB_CLIENTS){ close(fd); continue; }
+      tcp_nodelay(fd);
+      c[nc++] = (LbClient){ .fd = fd };
+    }
+  }
+  atomic_store(&saver.stop, true);
+  if(saver_th) SDL_WaitThread(saver_th, NULL); else lb_save(&lb, path);
+  for(int i=0;i<nc;i++) close(c[i].fd);
+  close(lfd);
+  printf("leaderboard: %u scores saved to %s\n", atomic_load(&lb.total), path);
+  return 0;
+}
+
+// The game's side: a FILE is a board of its own (the stand-in for the
+// service), HOST:PORT the service. The rank comes back within a frame or two.
+typedef struct { Leaderboard *local; const char *path; int fd; char in[LB_LINE]; int nin; Uint32 rank, of; bool waiting, has; } LbView;
+
+static void lb_submit(LbView *v, Uint32 score){
+  v->has = v->waiting = false;
+  if(v->local){
+    v->rank = lb_rank(v->local, score, &v->of); v->of++; v->has = true;
+    lb_add(v->local, score);
+    if(!lb_save(v->local, v->path)) fprintf(stderr,"leaderboard: cannot write %s\n", v->path);
+    return;
+  }
+  char b[32]; int n = snprintf(b, sizeof b, "add %u\n", score);
+  if(v->fd>=0 && send(v->fd, b, (size_t)n, MSG_NOSIGNAL)!=n){ close(v->fd); v->fd = -1; }
+  v->waiting = v->fd>=0;
+}
+
+static void lb_poll(LbView *v){
+  if(!v->waiting) return;
+  ssize_t k = recv(v->fd, v->in + v->nin, sizeof v->in - 1 - (size_t)v->nin, MSG_DONTWAIT);
+  if(k<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+  if(k<=0){ close(v->fd); v->fd = -1; v->waiting = false; return; }
+  v->nin += (int)k; v->in[v->nin] = 0;
+  char *nl = strchr(v->in, '\n');
+  if(!nl){ if(v->nin==(int)sizeof v->in - 1) v->nin = 0; return; }
+  v->has = sscanf(v->in, "%u %u", &v->rank, &v->of)==2; v->waiting = false;
+  v->nin -= (int)(nl+1 - v->in); memmove(v->in, nl+1, (size_t)v->nin);
+}
+
+// 3100000 -> "3,100,000"
+static void fmt_count(char *out, size_t n, Uint32 v){
+  char d[16]; int nd = snprintf(d, sizeof d, "%u", v), o = 0;
+  for(int i=0;i<nd && o+2<(int)n;i++){ if(i && (nd-i)%3==0) out[o++] = ','; out[o++] = d[i]; }
+  out[o] = 0;
+}
+
+// Load: `writers` connections stream adds as fast as the service takes them
+// while one more asks ranks one at a time; rank latency is timed idle first,
+// then under the burst.
+#define LB_LOAD_WRITERS 8
+#define LB_LOAD_WINDOW 256 // adds in flight per writer
+
+static int lb_cmp_u64(const void *a, const void *b){ Uint64 x = *(const Uint64*)a, y = *(const Uint64*)b; return (x>y) - (x<y); }
+
+static void lb_load_report(const char *what, Uint64 *us, int n){
+  if(!n) return;
+  qsort(us, (size_t)n, sizeof *us, lb_cmp_u64);
+  printf("%-6s %6d ranks: p50 %llu us  p99 %llu us  max %llu us\n", what, n,
+         (unsigned long long)us[n/2], (unsigned long long)us[n*99/100], (unsigned long long)us[n-1]);
+}
+
+static int leaderboard_load(const char *addr, long adds){
+  signal(SIGPIPE, SIG_IGN);
+  perf_hz = SDL_GetPerformanceFrequency();
+  int rfd = tcp_connect(addr), w[LB_LOAD_WRITERS];
+  if(rfd<0) return 1;
+  for(int i=0;i<LB_LOAD_WRITERS;i++) if((w[i] = tcp_connect(addr))<0) return 1;
+  enum { IDLE_RANKS = 2000, BUSY_RANKS = 1<<20 };
+  Uint64 *idle = malloc(IDLE_RANKS*sizeof *idle), *busy = malloc(BUSY_RANKS*sizeof *busy);
+  if(!idle || !busy){ free(idle); free(busy); return 1; }
+  long sent[LB_LOAD_WRITERS] = {0}, got[LB_LOAD_WRITERS] = {0}, per = adds/LB_LOAD_WRITERS, done = 0;
+  int nidle = 0, nbusy = 0; Uint32 rng = 0x2545F491u; Uint64 asked = 0, t0 = 0, t1 = 0;
+  bool lost = false;
+  while(!lost){
+    bool burst = nidle==IDLE_RANKS;
+    if(burst && !t0) t0 = perf_us();
+    if(burst && done==per*LB_LOAD_WRITERS){ t1 = perf_us(); break; }
+    if(!asked){
+      rng ^= rng<<13; rng ^= rng>>17; rng ^= rng<<5;
+      char b[32]; int n = snprintf(b, sizeof b, "rank %u\n", rng%200000);
+      lost = send(rfd, b, (size_t)n, 0)!=n; asked = perf_us();
+    }
+    struct pollfd pf[1+LB_LOAD_WRITERS]; int np = 0;
+    pf[np++] = (struct pollfd){ rfd, POLLIN, 0 };
+    for(int i=0;burst && i<LB_LOAD_WRITERS;i++) pf[np++] = (struct pollfd){ w[i], (short)(POLLIN | (sent[i]<per && sent[i]-got[i]<LB_LOAD_WINDOW ? POLLOUT : 0)), 0 };
+    poll(pf, (nfds_t)np, 1000);
+    for(int i=0;i<np && !lost;i++){
+      int fd = i ? w[i-1] : rfd;
+      if(pf[i].revents & (POLLIN|POLLHUP)){
+        char b[4096]; ssize_t k = recv(fd, b, sizeof b, MSG_DONTWAIT);
+        lost = k==0;
+        for(ssize_t j=0;j<k;j++) if(b[j]=='\n'){
+          if(i){ got[i-1]++; done++; continue; }
+          Uint64 us = perf_us() - asked; asked = 0;
+          if(!burst) idle[nidle++] = us; else if(nbusy<BUSY_RANKS) busy[nbusy++] = us;
+        }
+      }
+      if(i && pf[i].revents & POLLOUT){
+        char b[4096]; int n = 0;
+        while(sent[i-1]<per && sent[i-1]-got[i-1]<LB_LOAD_WINDOW && n < (int)sizeof b - 24){
+          rng ^= rng<<13; rng ^= rng>>17; rng ^= rng<<5;
+          n += snprintf(b+n, sizeof b - (size_t)n, "add %u\n", (rng%1000)*(rng>>22 & 255)); // many low scores, a long tail
+          sent[i-1]++;
+        }
+        lost = n && send(fd, b, (size_t)n, 0)!=n;
+      }
+    }
+  }
+  if(lost) fprintf(stderr,"leaderboard: lost the service\n");
+  else {
+    printf("%ld adds in %.2fs: %.0f a second\n", done, (double)(t1-t0)/1e6, done*1e6/(double)(t1-t0+1));
+    lb_load_report("idle", idle, nidle);
+    lb_load_report("burst", busy, nbusy);
+  }
+  for(int i=0;i<LB_LOAD_WRITERS;i++) close(w[i]);
+  close(rfd); free(idle); free(busy);
+  return lost;
+}
+
+// Reference engine: the rules written as plainly as they go - cells move row
+// by row, gravity comes from the formula, row[] stays the identity so board[r]
+// is logical row r. Nothing runs it but --difftest, which steps it beside the
+// real engine and compares full state every tick; rewrites of the engine are
+// checked against it, so change it only when the rules change.
+static bool ref_collide(const Game *g, const Piece *p, int nx, int ny){
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++){
+    if(!p->m[r][c]) continue;
+    int x = nx + c, y = ny + r;
+    if(x<0||x>=COLS||y<0||y>=ROWS) return true;
+    if(g->board[y][x].filled) return true;
+  }
+  return false;
+}
+
+static void ref_lock_piece(Game *g){
+  for(int r=0;r<4;r++) for(int c=0;c<4;c++){
+    if(!g->cur.m[r][c]) continue;
+    int x=g->cur.x+c, y=g->cur.y+r;
+    if(y>=0 && y<ROWS && x>=0 && x<COLS) g->board[y][x] = (Cell){ true, g->cur.type, g->cur.tint };
+  }
+}
+
+static bool ref_row_full(const Game *g, int r){
+  for(int c=0;c<COLS;c++) if(!g->board[r][c].filled) return false;
+  return true;
+}
+
+static int ref_clear_lines(Game *g){
+  int cleared = 0;
+  for(int r=ROWS-1;r>=0;r--){
+    if(!ref_row_full(g,r)) continue;
+    if(g->fx_clears[r]<255) g->fx_clears[r]++;
+    cleared++;
+    for(int rr=r;rr>0;rr--) memcpy(g->board[rr], g->board[rr-1], sizeof g->board[rr]);
+    memset(g->board[0], 0, sizeof g->board[0]);
+    r++;
+  }
+  if(cleared){
+    static const int score_tbl[5]={0,40,100,300,1200};
+    g->score += score_tbl[imin(cleared,4)]*(g->level+1);
+    g->lines += cleared;
+    g->level = g->lines/10;
+    g->fall_ms = imax(cfg->min_speed_ms, cfg->start_speed_ms - g->level*cfg->speed_step_ms);
+  }
+  return cleared;
+}
+
+static void ref_garbage_rise(Game *g){
+  int budget = GARBAGE_PER_LOCK;
+  while(g->ngarbage && budget && !g->game_over){
+    Garbage *q = &g->garbage[0];
+    int n = imin(q->lines, budget);
+    for(int r=0;r<n;r++) for(int c=0;c<COLS;c++) if(g->board[r][c].filled) g->game_over = true;
+    for(int r=0;r<ROWS-n;r++) memcpy(g->board[r], g->board[r+n], sizeof g->board[r]);
+    for(int r=ROWS-n;r<ROWS;r++) for(int c=0;c<COLS;c++)
+      g->board[r][c] = c==q->hole ? (Cell){ false, 0, 0 } : (Cell){ true, 1, TINT_GARBAGE };
+    q->lines = (Uint8)(q->lines - n); budget -= n;
+    if(!q->lines) memmove(g->garbage, g->garbage+1, sizeof g->garbage[0]*(size_t)--g->ngarbage);
+  }
+}
+
+static void ref_spawn_piece(Game *g){
+  g->cur = g->next;
+  new_bag_piece(g, &g->next, g->pieces+2);
+  g->cur.x = COLS/2 - 2; g->cur.y = 0;
+  if(ref_collide(g,&g->cur,g->cur.x,g->cur.y)) g->game_over=true;
+  g->can_hold=true;
+  g->pieces++;
+}
+
+static void ref_lock_resolve(Game *g){
+  static const int attack_tbl[5]={0,0,1,2,4};
+  int cleared = ref_clear_lines(g);
+  if(g->mode==MODE_SPRINT && g->lines>=SPRINT_LINES){ g->game_over = true; return; }
+  if(cleared) g->attack += garbage_cancel(g, attack_tbl[imin(cleared,4)]);
+  else ref_garbage_rise(g);
+  if(g->game_over) return;
+  if(g->are_ticks){ g->phase = PHASE_ARE; g->phase_left = g->are_ticks; }
+  else ref_spawn_piece(g);
+}
+
+static void ref_piece_landed(Game *g){
+  ref_lock_piece(g);
+  int full = 0;
+  if(g->clear_ticks) for(int r=0;r<ROWS;r++) full += ref_row_full(g,r);
+  if(full && !(g->mode==MODE_SPRINT && g->lines + full >= SPRINT_LINES)){
+    g->phase = PHASE_CLEAR; g->phase_left = g->clear_ticks; return;
+  }
+  ref_lock_resolve(g);
+}
+
+static void ref_soft_step(Game *g){
+  if(!ref_collide(g,&g->cur,g->cur.x,g->cur.y+1)) g->cur.y++;
+  else ref_piece_landed(g);
+}
+
+static void ref_game_apply(Game *g, int act){
+  if(g->game_over || g->phase) return;
+  Piece t = g->cur;
+  int kicks[5][2]={{0,0},{1,0},{-1,0},{0,-1},{0,1}};
+  switch(act){
+    case ACT_LEFT:  if(!ref_collide(g,&g->cur,g->cur.x-1,g->cur.y)) g->cur.x--; break;
+    case ACT_RIGHT: if(!ref_collide(g,&g->cur,g->cur.x+1,g->cur.y)) g->cur.x++; break;
+    case ACT_SOFT:  ref_soft_step(g); break;
+    case ACT_HARD:
+      while(!ref_collide(g,&g->cur,g->cur.x,g->cur.y+1)) g->cur.y++;
+      ref_piece_landed(g);
+      break;
+    case ACT_CW: case ACT_CCW:
+      if(act==ACT_CW) rotate_cw(&t); else rotate_ccw(&t);
+      for(int i=0;i<5;i++) if(!ref_collide(g,&t,t.x+kicks[i][0],t.y+kicks[i][1])){ t.x+=kicks[i][0]; t.y+=kicks[i][1]; g->cur=t; break; }
+      break;
+    case ACT_HOLD:
+      if(!g->can_hold) break;
+      if(!g->has_hold){ g->hold = g->cur; g->has_hold=true; ref_spawn_piece(g); }
+      else { g->cur=g->hold; g->hold=t; g->cur.x=COLS/2-2; g->cur.y=0; if(ref_collide(g,&g->cur,g->cur.x,g->cur.y)) g->game_over=true; }
+      g->can_hold=false;
+      break;
+  }
+}
+
+static void ref_game_tick(Game *g){
+  g->tick++;
+  if(g->game_over) return;
+  if(g->mode==MODE_ULTRA && g->tick>=ULTRA_TICKS){ g->game_over = true; return; }
+  if(g->phase){
+    if(--g->phase_left) return;
+    int done = g->phase; g->phase = PHASE_FALL;
+    if(done==PHASE_CLEAR) ref_lock_resolve(g); else ref_spawn_piece(g);
+    return;
+  }
+  g->fall_accum += TICK_US;
+  Uint32 step = (Uint32)g->fall_ms*1000u;
+  while(g->fall_accum >= step){ g->fall_accum -= step; ref_soft_step(g); }
+}
+
+// Differential test: random and mutated input sequences run through both
+// engines from the same seed. A case is its delays, mode, some junk prefilled
+// at the bottom of the board, and tick-stamped events (actions, or garbage
+// arriving). On the first tick whose state differs, the case is shrunk - events
+// dropped in halving chunks, the prefill and delays simplified - for as long as
+// it still diverges, and the minimal repro is written out.
+#define DIFF_EVENTS 4096
+#define DIFF_GARBAGE ACT_COUNT // event kind: arg = lines<<4 | hole
+typedef struct { Uint16 tick; Uint8 kind, arg; } DiffEvent;
+typedef struct {
+  Uint32 seed; Uint8 clear_ticks, are_ticks, mode, bag;
+  int ticks;
+  Uint16 prefill[ROWS]; // filled columns per row, bit c
+  int n; DiffEvent ev[DIFF_EVENTS];
+} DiffCase;
+
+static Uint32 diff_rand(Uint32 *s){ Uint32 x=*s; x ^= x<<13; x ^= x>>17; x ^= x<<5; return *s = x; }
+
+// Everything a tick can change: the packed state (cells in logical order,
+// garbage queue included) plus the outputs, which snapshots leave out.
+static bool diff_same(const Game *a, const Game *b){
+  Uint8 pa[SNAP_BYTES], pb[SNAP_BYTES];
+  game_pack(a,pa); game_pack(b,pb);
+  return !memcmp(pa,pb,sizeof pa) && a->attack==b->attack && !memcmp(a->fx_clears,b->fx_clears,sizeof a->fx_clears);
+}
+
+// Returns the first tick after which the engines disagree or a lock cleared
+// more than 4 lines (0: from the start), or -1.
+static int diff_run(const DiffCase *dc, Game *opt, Game *ref){
+  game_reset(opt, dc->seed);
+  opt->clear_ticks = dc->clear_ticks; opt->are_ticks = dc->are_ticks; opt->mode = dc->mode;
+  if(dc->bag) game_use_bag(opt);
+  for(int r=0;r<ROWS;r++) for(int c=0;c<COLS;c++)
+    if(dc->prefill[r]>>c & 1) CELL(opt,r,c) = (Cell){ true, (r+c)&1, (r*3+c)%8 };
+  *ref = *opt;
+  int e = 0;
+  for(int t=0;t<dc->ticks;t++){
+    int lines = opt->lines, pieces = opt->pieces;
+    for(; e<dc->n && dc->ev[e].tick==t; e++){
+      const DiffEvent *v = &dc->ev[e];
+      if(v->kind==DIFF_GARBAGE){
+        game_queue_garbage(opt, v->arg>>4, (v->arg&15)%COLS); game_queue_garbage(ref, v->arg>>4, (v->arg&15)%COLS);
+      } else { game_apply(opt, v->kind); ref_game_apply(ref, v->kind); }
+    }
+    game_tick(opt); ref_game_tick(ref);
+    if(!diff_same(opt,ref)) return t+1;
+    // No lock can clear more than 4 lines; more means a board the engines should never see.
+    if(opt->lines - lines > 4*imax(1, opt->pieces - pieces)) return t+1;
+  }
+  return -1;
+}
+
+static void diff_push(DiffCase *dc, int tick, int kind, int arg){
+  if(dc->n<DIFF_EVENTS) dc->ev[dc->n++] = (DiffEvent){ (Uint16)tick, (Uint8)kind, (Uint8)arg };
+}
+
+// Input that reaches the interesting code: bursts of moves and rotations,
+// frequent drops (so boards fill and clear), delays, garbage, and junk rows -
+// some of them one cell short - for the first locks to finish.
+static void diff_random(DiffCase *dc, Uint32 *s){
+  memset(dc, 0, sizeof *dc);
+  dc->seed = diff_rand(s);
+  dc->clear_ticks = diff_rand(s)%3 ? (Uint8)(diff_rand(s)%20) : 0;
+  dc->are_ticks = diff_rand(s)%3 ? (Uint8)(diff_rand(s)%8) : 0;
+  Uint32 m = diff_rand(s)%10; dc->mode = m<7 ? MODE_MARATHON : m<9 ? MODE_SPRINT : MODE_ULTRA;
+  dc->bag = diff_rand(s)%2;
+  if(diff_rand(s)%2) for(int r=ROWS-1-(int)(diff_rand(s)%12);r<ROWS;r++)
+    dc->prefill[r] = (Uint16)(diff_rand(s)%8==0 ? ((1u<<COLS)-1) & ~(1u<<(diff_rand(s)%COLS)) : diff_rand(s) & diff_rand(s)>>3 & ((1u<<COLS)-1));
+  dc->ticks = 200 + (int)(diff_rand(s)%4000);
+  int density = 2 + (int)(diff_rand(s)%6); // one event per tick in density, roughly
+  for(int t=0;t<dc->ticks;t++){
+    if(diff_rand(s)%400==0) diff_push(dc, t, DIFF_GARBAGE, (int)(1 + diff_rand(s)%8)<<4 | (int)(diff_rand(s)%COLS));
+    if(diff_rand(s)%(Uint32)density) continue;
+    Uint32 a = diff_rand(s)%20;
+    diff_push(dc, t, a<4 ? ACT_LEFT : a<8 ? ACT_RIGHT : a<11 ? ACT_CW : a<13 ? ACT_CCW : a<16 ? ACT_SOFT : a<19 ? ACT_HARD : ACT_HOLD, 0);
+  }
+}
+
+// A neighbour of the last case: same shape, a few events rewritten, inserted
+// or dropped, sometimes another seed or other delays.
+static void diff_mutate(DiffCase *dc, Uint32 *s){
+  int edits = 1 + (int)(diff_rand(s)%16);
+  for(int k=0;k<edits && dc->n;k++){
+    int i = (int)(diff_rand(s)%(Uint32)dc->n);
+    switch(diff_rand(s)%4){
+      case 0: dc->ev[i].kind = (Uint8)(diff_rand(s)%ACT_COUNT); break;
+      case 1: memmove(dc->ev+i, dc->ev+i+1, sizeof dc->ev[0]*(size_t)(--dc->n - i)); break;
+      case 2: if(dc->n<DIFF_EVENTS){ // a burst at the same tick
+        memmove(dc->ev+i+1, dc->ev+i, sizeof dc->ev[0]*(size_t)(dc->n++ - i));
+        dc->ev[i].kind = (Uint8)(diff_rand(s)%2 ? ACT_HARD : ACT_HOLD);
+      } break;
+      case 3: dc->ev[i].kind = DIFF_GARBAGE; dc->ev[i].arg = (Uint8)((1 + diff_rand(s)%15)<<4 | diff_rand(s)%COLS); break;
+    }
+  }
+  if(diff_rand(s)%4==0) dc->seed = diff_rand(s);
+  if(diff_rand(s)%8==0){ dc->clear_ticks = (Uint8)(diff_rand(s)%4); dc->are_ticks = (Uint8)(diff_rand(s)%4); }
+}
+
+// Keeps the case diverging while it gets smaller; ticks end at the divergence.
+static void diff_shrink(DiffCase *dc){
+  static DiffCase t; Game a, b;
+  int bad = diff_run(dc,&a,&b);
+  for(bool again=true; again;){
+    again = false;
+    dc->ticks = bad;
+    while(dc->n && dc->ev[dc->n-1].tick>=bad) dc->n--;
+    for(int chunk=imax(1,dc->n/2); chunk>=1; chunk/=2){
+      for(int i=0;i+chunk<=dc->n;){
+        t = *dc;
+        memmove(t.ev+i, t.ev+i+chunk, sizeof t.ev[0]*(size_t)(t.n-i-chunk)); t.n -= chunk;
+        int tb = diff_run(&t,&a,&b);
+        if(tb>=0){ *dc = t; bad = tb; again = true; } else i += chunk;
+      }
+    }
+    for(int r=0;r<ROWS;r++){
+      if(!dc->prefill[r]) continue;
+      t = *dc; t.prefill[r] = 0;
+      int tb = diff_run(&t,&a,&b);
+      if(tb>=0){ *dc = t; bad = tb; again = true; }
+    }
+    for(int k=0;k<3;k++){
+      t = *dc; if(k==2) t.bag = 0; else if(k) t.are_ticks = 0; else t.clear_ticks = 0;
+      if(!memcmp(&t, dc, sizeof t)) continue;
+      int tb = diff_run(&t,&a,&b);
+      if(tb>=0){ *dc = t; bad = tb; again = true; }
+    }
+  }
+}
+
+static void diff_report(FILE *f, const DiffCase *dc){
+  static const char *kinds[] = { "left", "right", "soft", "hard", "cw", "ccw", "hold", "garbage" };
+  Game a, b;
+  int bad = diff_run(dc,&a,&b);
+  fprintf(f,"seed %08x clear %d are %d mode %s%s, diverges after tick %d\n", dc->seed, dc->clear_ticks, dc->are_ticks, MODE_NAMES[dc->mode], dc->bag ? " bag" : "", bad);
+  for(int r=0;r<ROWS;r++) if(dc->prefill[r]){
+    fprintf(f,"prefill %2d ", r);
+    for(int c=0;c<COLS;c++) fputc(dc->prefill[r]>>c & 1 ? '#' : '.', f);
+    fputc('\n', f);
+  }
+  for(int i=0;i<dc->n;i++){
+    fprintf(f,"%5d %s", dc->ev[i].tick, kinds[dc->ev[i].kind]);
+    if(dc->ev[i].kind==DIFF_GARBAGE) fprintf(f," %d hole %d", dc->ev[i].arg>>4, (dc->ev[i].arg&15)%COLS);
+    fputc('\n', f);
+  }
+  fprintf(f,"-- engine: attack %d garbage %d\n", a.attack, garbage_queued(&a)); game_dump(f,&a);
+  fprintf(f,"-- reference: attack %d garbage %d\n", b.attack, garbage_queued(&b)); game_dump(f,&b);
+}
+
+// Odd cases mutate the case before them. Returns 0 when every case agreed.
+static int difftest(long cases, Uint32 seed){
+  static DiffCase dc;
+  Uint32 s = seed ? seed : 0x9E3779B9u;
+  Uint64 ticks = 0;
+  Game a, b;
+  printf("difftest: %ld cases from seed %08x\n", cases, seed);
+  for(long i=0;i<cases;i++){
+    if(i%2 && dc.n) diff_mutate(&dc, &s); else diff_random(&dc, &s);
+    int bad = diff_run(&dc,&a,&b);
+    ticks += (Uint64)(bad<0 ? dc.ticks : bad);
+    if(bad<0) continue;
+    printf("difftest: case %ld diverges after tick %d; shrinking\n", i, bad);
+    diff_shrink(&dc);
+    char path[64]; snprintf(path, sizeof path, "difftest-%08x-%ld.txt", seed, i);
+    FILE *f = fopen(path, "w");
+    diff_report(stdout, &dc);
+    if(f){ diff_report(f, &dc); fclose(f); printf("difftest: repro in %s\n", path); }
+    return 1;
+  }
+  printf("difftest: ok, %llu ticks compared\n", (unsigned long long)ticks);
+  return 0;
+}
+
+// Keys per action (ACT_* order). One player keeps the classic layout; in
+// versus two share the keyboard and everyone else needs a gamepad.
+static const SDL_Keycode KEYS_SOLO[ACT_COUNT] = { SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_SPACE, SDLK_UP, SDLK_z, SDLK_c };
+static const SDL_Keycode KEYS_VERSUS[2][ACT_COUNT] = {
+  { SDLK_a, SDLK_d, SDLK_s, SDLK_w, SDLK_e, SDLK_q, SDLK_LSHIFT },
+  { SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_UP, SDLK_PERIOD, SDLK_COMMA, SDLK_RSHIFT },
+};
+
+// Settings file: "key = value" lines, '#' starts a comment line. Colors are
+// #rrggbb. Unknown keys and out-of-range values are errors, so a typo on a
+// cabinet fails at startup instead of silently playing defaults. Gameplay keys
+// (gravity.*) are part of the rules: replays record them and play back under them.
+enum { SET_INT, SET_STR, SET_COLOR };
+typedef struct { const char *key; int kind; size_t off; int lo, hi; } SettingKey; // hi: buffer size for SET_STR
+#define SET_I(k, f, lo, hi) { k, SET_INT, offsetof(Settings, f), lo, hi }
+#define SET_S(k, f) { k, SET_STR, offsetof(Settings, f), 0, (int)sizeof ((Settings*)0)->f }
+#define SET_C(k, f) { k, SET_COLOR, offsetof(Settings, f), 0, 0 }
+static const SettingKey SETTING_KEYS[] = {
+  SET_I("gravity.start_ms", start_speed_ms, 4, 10000), SET_I("gravity.step_ms", speed_step_ms, 0, 10000),
+  SET_I("gravity.min_ms", min_speed_ms, 4, 10000),
+  SET_I("delay.clear_ticks", clear_ticks, 0, 255), SET_I("delay.are_ticks", are_ticks, 0, 255),
+  SET_I("fx.particles", particles, 0, MAX_PARTICLES), SET_I("fx.burst_min", burst_min, 0, MAX_PARTICLES),
+  SET_I("fx.burst_range", burst_range, 0, MAX_PARTICLES), SET_I("fx.bloom", bloom, 0, 400),
+  SET_I("pad.das_ms", pad_das_ms, 1, 2000), SET_I("pad.arr_ms", pad_arr_ms, 1, 2000), SET_I("pad.deadzone", pad_deadzone, 0, 32767),
+  SET_I("audio.buffer", audio_buffer, 32, 8192),
+  SET_I("window.width", win_w, 320, 8192), SET_I("window.height", win_h, 240, 8192), SET_I("window.max_width", win_max_w, 320, 8192),
+  SET_S("font.emoji", emoji_font), SET_S("font.ui", ui_font), SET_I("font.ui_size", ui_font_size, 6, 128),
+  SET_C("color.bg", col_bg), SET_C("color.grid", col_grid), SET_C("color.text", col_text),
+  SET_C("color.i", col_piece[0]), SET_C("color.o", col_piece[1]), SET_C("color.t", col_piece[2]), SET_C("color.s", col_piece[3]),
+  SET_C("color.z", col_piece[4]), SET_C("color.j", col_piece[5]), SET_C("color.l", col_piece[6]), SET_C("color.garbage", col_piece[7]),
+};
+#define SETTING_COUNT (int)(sizeof SETTING_KEYS/sizeof SETTING_KEYS[0])
+
+static void settings_default(Settings *s){
+  static const SDL_Color piece[8] = {
+    {45, 212, 191, 255}, // I
+    {250, 204, 21, 255}, // O
+    {192, 132, 252, 255}, // T
+    {74, 222, 128, 255}, // S
+    {251, 113, 133, 255}, // Z
+    {96, 165, 250, 255}, // J
+    {245, 158, 11, 255}, // L
+    {120, 124, 132, 255} // garbage
+  };
+  memset(s,0,sizeof *s);
+  s->start_speed_ms = START_SPEED_MS; s->speed_step_ms = SPEED_STEP_MS; s->min_speed_ms = MIN_SPEED_MS;
+  s->clear_ticks = CLEAR_TICKS; s->are_ticks = ARE_TICKS;
+  s->particles = MAX_PARTICLES; s->burst_min = 120; s->burst_range = 80;
+  s->pad_das_ms = PAD_DAS_MS; s->pad_arr_ms = PAD_ARR_MS; s->pad_deadzone = PAD_DEADZONE;
+  s->audio_buffer = AUDIO_BUFFER;
+  s->win_w = 720; s->win_h = 760; s->win_max_w = 1600; s->ui_font_size = 22;
+  s->col_bg = (SDL_Color){20, 24, 28, 255}; s->col_grid = (SDL_Color){36, 42, 48, 255}; s->col_text = (SDL_Color){235, 235, 235, 255};
+  memcpy(s->col_piece, piece, sizeof piece);
+}
+
+static bool settings_set(void *dst, const SettingKey *k, const char *val){
+  void *f = (char*)dst + k->off;
+  char *end; long v; unsigned rgb;
+  switch(k->kind){
+    case SET_INT:
+      v = strtol(val, &end, 10);
+      if(end==val || *end || v < k->lo || v > k->hi) return false;
+      *(int*)f = (int)v; return true;
+    case SET_STR:
+      if(strlen(val) >= (size_t)k->hi) return false;
+      strcpy(f, val); return true;
+    default:
+      if(val[0]!='#' || strlen(val)!=7 || sscanf(val+1, "%6x", &rgb)!=1) return false;
+      *(SDL_Color*)f = (SDL_Color){ (Uint8)(rgb>>16), (Uint8)(rgb>>8), (Uint8)rgb, 255 }; return true;
+  }
+}
+
+static void settings_derive(Settings *s){
+  settings_gravity(s, s->start_speed_ms, s->speed_step_ms, s->min_speed_ms);
+  s->burst_cap = imax(1, s->particles/4);
+  s->pad_das_us = (Uint64)s->pad_das_ms*1000; s->pad_arr_us = (Uint64)s->pad_arr_ms*1000;
+}
+
+// Strips surrounding blanks (and the newline) in place.
+static char *settings_trim(char *line){
+  char *p = line; while(*p==' '||*p=='\t') p++;
+  char *e = p + strlen(p); while(e>p && (e[-1]=='\n'||e[-1]=='\r'||e[-1]==' '||e[-1]=='\t')) *--e = 0;
+  return p;
+}
+
+// One trimmed "key = value" line into dst; false (after saying why) on any error.
+static bool settings_pair(char *p, const char *path, int ln, const SettingKey *keys, int nkeys, void *dst){
+  char *eq = strchr(p, '=');
+  if(!eq){ fprintf(stderr,"%s:%d: expected key = value\n", path, ln); return false; }
+  char *val = eq+1; while(*val==' '||*val=='\t') val++;
+  while(eq>p && (eq[-1]==' '||eq[-1]=='\t')) eq--;
+  *eq = 0;
+  int i = 0; while(i<nkeys && strcmp(keys[i].key, p)) i++;
+  if(i==nkeys){ fprintf(stderr,"%s:%d: unknown key '%s'\n", path, ln, p); return false; }
+  if(!settings_set(dst, &keys[i], val)){ fprintf(stderr,"%s:%d: bad value for %s: '%s'\n", path, ln, p, val); return false; }
+  return true;
+}
+
+// Reads key = value lines from f into dst through a key table; false on any error.
+static bool settings_read(FILE *f, const char *path, const SettingKey *keys, int nkeys, void *dst){
+  bool ok = true;
+  char line[512];
+  for(int ln=1; fgets(line, sizeof line, f); ln++){
+    char *p = settings_trim(line);
+    if(*p && *p!='#') ok &= settings_pair(p, path, ln, keys, nkeys, dst);
+  }
+  return ok;
+}
+
+// Defaults, then the file if there is one (a missing file is an error only when
+// required). Errors go to stderr with the line number.
+static bool settings_load(const char *path, bool required){
+  Settings *s = &settings_rw;
+  settings_default(s);
+  FILE *f = path ? fopen(path, "r") : NULL;
+  bool ok = f || !required;
+  if(!f && required) fprintf(stderr,"%s: cannot open\n", path);
+  if(f){ ok = settings_read(f, path, SETTING_KEYS, SETTING_COUNT, s); fclose(f); }
+  if(s->min_speed_ms > s->start_speed_ms){ fprintf(stderr,"%s: gravity.min_ms exceeds gravity.start_ms\n", path); ok = false; }
+  settings_derive(s);
+  return ok;
+}
+
+// The effective settings in file form, as a starting point for a cabinet.
+static void settings_print(FILE *f){
+  for(int i=0;i<SETTING_COUNT;i++){
+    const SettingKey *k = &SETTING_KEYS[i];
+    const void *v = (const char*)cfg + k->off;
+    if(k->kind==SET_INT) fprintf(f, "%s = %d\n", k->key, *(const int*)v);
+    else if(k->kind==SET_STR) fprintf(f, "%s = %s\n", k->key, (const char*)v);
+    else { const SDL_Color *c = v; fprintf(f, "%s = #%02x%02x%02x\n", k->key, c->r, c->g, c->b); }
+  }
+}
+
+// Theme files use the settings syntax. Image paths are relative to the file.
+//   name = neon
+//   tile.ice = glyph:🍦          tile.burger = image:burger.bmp
+//   background = stars.bmp       particle.image = spark.bmp
+//   particle.size = 6            particle.color = #ffc878
+//   color.bg / color.grid / color.text / color.i ... color.garbage = #rrggbb
+#define THEME_S(k, f) { k, SET_STR, offsetof(Theme, f), 0, (int)sizeof ((Theme*)0)->f }
+#define THEME_C(k, f) { k, SET_COLOR, offsetof(Theme, f), 0, 0 }
+static const SettingKey THEME_KEYS[] = {
+  THEME_S("name", name), THEME_S("tile.ice", face[0]), THEME_S("tile.burger", face[1]),
+  THEME_S("background", background), THEME_S("particle.image", particle),
+  { "particle.size", SET_INT, offsetof(Theme, particle_size), 1, 64 }, THEME_C("particle.color", burst),
+  THEME_C("color.bg", bg), THEME_C("color.grid", grid), THEME_C("color.text", text),
+  THEME_C("color.i", piece[0]), THEME_C("color.o", piece[1]), THEME_C("color.t", piece[2]), THEME_C("color.s", piece[3]),
+  THEME_C("color.z", piece[4]), THEME_C("color.j", piece[5]), THEME_C("color.l", piece[6]), THEME_C("color.garbage", piece[7]),
+};
+
+// The built-in look, colored by the settings file; themes start from it too.
+static void theme_default(Theme *th){
+  memset(th,0,sizeof *th);
+  snprintf(th->name, sizeof th->name, "classic");
+  snprintf(th->face[0], sizeof th->face[0], "glyph:%s", EMOJI_ICE);
+  snprintf(th->face[1], sizeof th->face[1], "glyph:%s", EMOJI_BURGER);
+  th->particle_size = 4;
+  th->bg = cfg->col_bg; th->grid = cfg->col_grid; th->text = cfg->col_text; th->burst = (SDL_Color){255, 200, 120, 255};
+  memcpy(th->piece, cfg->col_piece, sizeof th->piece);
+}
+
+static bool theme_path_fix(char *field, size_t n, const char *prefix, const char *dir, int dirlen){
+  size_t pl = strlen(prefix);
+  if(!field[0] || strncmp(field, prefix, pl) || field[pl]=='/' || !dirlen) return true;
+  char tmp[THEME_PATH];
+  if(snprintf(tmp, sizeof tmp, "%s%.*s/%s", prefix, dirlen, dir, field+pl) >= (int)sizeof tmp) return false;
+  snprintf(field, n, "%s", tmp);
+  return true;
+}
+
+static bool theme_load(Theme *th, const char *path){
+  theme_default(th);
+  const char *slash = strrchr(path, '/'), *base = slash ? slash+1 : path;
+  snprintf(th->name, sizeof th->name, "%.*s", (int)strcspn(base, "."), base);
+  FILE *f = fopen(path, "r");
+  if(!f){ fprintf(stderr,"%s: cannot open\n", path); return false; }
+  bool ok = settings_read(f, path, THEME_KEYS, (int)(sizeof THEME_KEYS/sizeof THEME_KEYS[0]), th);
+  fclose(f);
+  int dirlen = slash ? (int)(slash - path) : 0;
+  for(int t=0;t<2;t++) ok &= theme_path_fix(th->face[t], sizeof th->face[t], "image:", path, dirlen);
+  ok &= theme_path_fix(th->background, sizeof th->background, "", path, dirlen);
+  ok &= theme_path_fix(th->particle, sizeof th->particle, "", path, dirlen);
+  if(!ok) fprintf(stderr,"%s: theme not loaded\n", path);
+  return ok;
+}
+
+// Fonts: an emoji font that really has both tile glyphs, and a UI font. With
+// fontconfig they are whatever it ranks best among fonts covering the glyphs;
+// without it, a short list of well-known paths. Either way every candidate is
+// opened and asked for the glyphs, since a font that merely opens renders tofu.
+// The choice is cached, keyed by each file's size and mtime, so later
+// startups skip the scan; the lack of one is keyed by a stamp of the font
+// directories (font_stamp), so installing a font is noticed. --font-rescan
+// ignores the cache.
+#define FONT_CACHE_MAGIC "iceburger-fonts 2"
+
+typedef struct { char path[256]; int index; } FontRef; // path[0]==0: none
+typedef struct { FontRef emoji, ui; } FontChoice;
+
+static const Uint32 TILE_GLYPHS[] = { 0x1F366, 0x1F354 }; // 🍦 🍔, see EMOJI_ICE/EMOJI_BURGER
+static const Uint32 UI_GLYPHS[] = { 'A', '0', ':' };
+
+// Probed in order when there is no fontconfig.
+static const char *const FONT_EMOJI_PATHS[] = {
+  "/System/Library/Fonts/Apple Color Emoji.ttc", // macOS
+  "/usr/share/fonts/truetype/noto/NotoColorEmoji.ttf",
+  "/usr/share/fonts/noto/NotoColorEmoji.ttf",
+  "/usr/share/fonts/google-noto-emoji/NotoColorEmoji.ttf",
+  NULL
+};
+static const char *const FONT_UI_PATHS[] = {
+  "/System/Library/Fonts/SFNS.ttf",
+  "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+  "/usr/share/fonts/TTF/DejaVuSans.ttf",
+  "/usr/share/fonts/dejavu/DejaVuSans.ttf",
+  NULL
+};
+
+static bool font_provides(const char *path, int index, const Uint32 *need, int n){
+  TTF_Font *f = TTF_OpenFontIndex(path, 24, index);
+  if(!f) return false;
+  bool ok = true;
+  for(int i=0;i<n && ok;i++) ok = TTF_GlyphIsProvided32(f, need[i])!=0;
+  TTF_CloseFont(f);
+  return ok;
+}
+
+static bool font_take(FontRef *out, const char *path, int index, const Uint32 *need, int n){
+  if(strlen(path) >= sizeof out->path || !font_provides(path, index, need, n)) return false;
+  strcpy(out->path, path); out->index = index;
+  return true;
+}
+
+#ifdef HAVE_FONTCONFIG
+static bool font_search(FontRef *out, const char *family, const Uint32 *need, int n){
+  FcPattern *pat = FcNameParse((const FcChar8*)family);
+  FcCharSet *cs = FcCharSetCreate();
+  if(!pat || !cs){ if(pat) FcPatternDestroy(pat); if(cs) FcCharSetDestroy(cs); return false; }
+  for(int i=0;i<n;i++) FcCharSetAddChar(cs, need[i]);
+  FcPatternAddCharSet(pat, FC_CHARSET, cs);
+  FcConfigSubstitute(NULL, pat, FcMatchPattern);
+  FcDefaultSubstitute(pat);
+  FcResult res;
+  FcFontSet *fs = FcFontSort(NULL, pat, FcFalse, NULL, &res);
+  bool found = false;
+  for(int i=0; fs && i<fs->nfont && !found; i++){
+    FcChar8 *file; FcCharSet *have; int index = 0;
+    if(FcPatternGetString(fs->fonts[i], FC_FILE, 0, &file)!=FcResultMatch) continue;
+    FcPatternGetInteger(fs->fonts[i], FC_INDEX, 0, &index);
+    bool covers = true; // sorted, not filtered: skip what fontconfig already knows lacks a glyph
+    if(FcPatternGetCharSet(fs->fonts[i], FC_CHARSET, 0, &have)==FcResultMatch)
+      for(int k=0;k<n && covers;k++) covers = FcCharSetHasChar(have, need[k]);
+    found = covers && font_take(out, (const char*)file, index, need, n);
+  }
+  if(fs) FcFontSetDestroy(fs);
+  FcCharSetDestroy(cs); FcPatternDestroy(pat);
+  return found;
+}
+#endif
+
+static void fonts_scan(FontChoice *fc){
+#ifdef HAVE_FONTCONFIG
+  if(FcInit()){
+    font_search(&fc->emoji, "emoji", TILE_GLYPHS, 2);
+    font_search(&fc->ui, "sans-serif", UI_GLYPHS, 3);
+    return;
+  }
+#endif
+  for(int i=0;FONT_EMOJI_PATHS[i] && !font_take(&fc->emoji, FONT_EMOJI_PATHS[i], 0, TILE_GLYPHS, 2);i++){}
+  for(int i=0;FONT_UI_PATHS[i] && !font_take(&fc->ui, FONT_UI_PATHS[i], 0, UI_GLYPHS, 3);i++){}
+}
+
+static Uint32 font_stamp_file(Uint32 crc, const char *path){
+  struct stat st; long long v[2] = { -1, -1 };
+  if(stat(path, &st)==0){ v[0] = st.st_size; v[1] = st.st_mtime; }
+  crc = crc32c(crc, path, strlen(path));
+  return crc32c(crc, v, sizeof v);
+}
+
+// What a cached "none" holds for: every directory fontconfig scans (adding a
+// font bumps its directory's mtime), or without it the paths fonts_scan tries.
+static Uint32 font_stamp(void){
+  Uint32 crc = 0;
+#ifdef HAVE_FONTCONFIG
+  if(FcInit()){
+    FcStrList *dirs = FcConfigGetFontDirs(NULL);
+    for(FcChar8 *d; dirs && (d = FcStrListNext(dirs)); ) crc = font_stamp_file(crc, (const char*)d);
+    if(dirs) FcStrListDone(dirs);
+    return crc;
+  }
+#endif
+  for(int i=0;FONT_EMOJI_PATHS[i];i++) crc = font_stamp_file(crc, FONT_EMOJI_PATHS[i]);
+  for(int i=0;FONT_UI_PATHS[i];i++) crc = font_stamp_file(crc, FONT_UI_PATHS[i]);
+  return crc;
+}
+
+static bool font_cache_path(char *out, size_t n){
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  char dir[480];
+  if(xdg && *xdg) snprintf(dir, sizeof dir, "%s", xdg);
+  else if(home && *home) snprintf(dir, sizeof dir, "%s/.cache", home);
+  else return false;
+  mkdir(dir, 0755); // usually there already
+  return snprintf(out, n, "%s/iceburger-fonts", dir) < (int)n;
+}
+
+// "emoji|ui - STAMP" for none, else "emoji|ui INDEX SIZE MTIME PATH".
+static void font_cache_line(TextBuf *tb, const char *name, const FontRef *r, Uint32 stamp){
+  struct stat st;
+  if(!r->path[0] || stat(r->path, &st)!=0){ tb_printf(tb, "%s - %08x\n", name, stamp); return; }
+  tb_printf(tb, "%s %d %lld %lld %s\n", name, r->index, (long long)st.st_size, (long long)st.st_mtime, r->path);
+}
+
+static bool font_cache_entry(const char *line, const char *name, FontRef *r){
+  size_t nl = strlen(name);
+  if(strncmp(line, name, nl) || line[nl]!=' ') return false;
+  line += nl+1;
+  unsigned was;
+  if(line[0]=='-'){ r->path[0] = 0; return sscanf(line+1, "%x", &was)==1 && was==font_stamp(); }
+  long long size, mtime; int off = 0;
+  if(sscanf(line, "%d %lld %lld %n", &r->index, &size, &mtime, &off)!=3 || !line[off]) return false;
+  snprintf(r->path, sizeof r->path, "%.*s", (int)strcspn(line+off, "\r\n"), line+off);
+  struct stat st; // stale once the file changed or went away
+  return stat(r->path, &st)==0 && (long long)st.st_size==size && (long long)st.st_mtime==mtime;
+}
+
+static bool font_cache_load(const char *path, FontChoice *fc){
+  FILE *f = fopen(path, "r");
+  if(!f) return false;
+  char line[600]; int got = 0;
+  bool ok = fgets(line, sizeof line, f) && !strncmp(line, FONT_CACHE_MAGIC, strlen(FONT_CACHE_MAGIC));
+  while(ok && got<2 && fgets(line, sizeof line, f)) ok = font_cache_entry(line, got ? "ui" : "emoji", got ? &fc->ui : &fc->emoji) && ++got;
+  fclose(f);
+  return ok && got==2;
+}
+
+static void font_cache_save(const char *path, const FontChoice *fc){
+  char body[1400]; TextBuf tb = { body, 0, sizeof body }; body[0] = 0;
+  tb_printf(&tb, "%s\n", FONT_CACHE_MAGIC);
+  Uint32 stamp = fc->emoji.path[0] && fc->ui.path[0] ? 0 : font_stamp();
+  font_cache_line(&tb, "emoji", &fc->emoji, stamp); font_cache_line(&tb, "ui", &fc->ui, stamp);
+  write_file_atomic(path, body, tb.n);
+}
+
+// Paths from the settings file win; they are still checked, but never cached.
+static void fonts_find(FontChoice *fc, bool rescan){
+  memset(fc,0,sizeof *fc);
+  char cache[512];
+  bool cached = font_cache_path(cache, sizeof cache);
+  if(!(cached && !rescan && font_cache_load(cache, fc))){
+    memset(fc,0,sizeof *fc);
+    fonts_scan(fc);
+    if(cached) font_cache_save(cache, fc);
+  }
+  if(cfg->emoji_font[0] && !font_take(&fc->emoji, cfg->emoji_font, 0, TILE_GLYPHS, 2))
+    fprintf(stderr,"font.emoji: %s lacks the tile emoji\n", cfg->emoji_font);
+  if(cfg->ui_font[0] && !font_take(&fc->ui, cfg->ui_font, 0, UI_GLYPHS, 3))
+    fprintf(stderr,"font.ui: cannot use %s\n", cfg->ui_font);
+}
+
+// Board fixtures: a game state to start from, for benchmarks, puzzles and bug
+// reports. The text form uses the settings syntax plus the board itself,
+// bottom rows last, in game_dump letters (upper case burger, lower case ice):
+//   name = tetris-ready
+//   seed = 0x1234            rng = 0x89ab (default: as game_reset leaves it)
+//   score = 1200   lines = 28   level = 2 (default lines/10)
+//   cur = I                  next = o     hold = T 3 5 1 (letter [x y cw-turns])
+//   JJJLLLOOI.
+//   ZZTOOSSLI.
+// The binary form (.ibf) is the magic, a version byte and the snapshot blob,
+// so it holds everything exactly - delays, mode and (version 2) garbage included.
+#define FIXTURE_MAGIC 0x58464249u // "IBFX"
+#define FIXTURE_VERSION 2
+#define FIXTURE_BYTES (5 + SNAP_BYTES)
+#define FIXTURE_BYTES_V1 (5 + SNAP_BYTES_V1)
+
+typedef struct { char name[32], seed[16], rng[16], cur[24], next[24], hold[24]; int score, lines, level; } FixtureText;
+#define FIX_S(k, f) { k, SET_STR, offsetof(FixtureText, f), 0, (int)sizeof ((FixtureText*)0)->f }
+#define FIX_I(k, f) { k, SET_INT, offsetof(FixtureText, f), 0, 1000000000 }
+static const SettingKey FIXTURE_KEYS[] = {
+  FIX_S("name", name), FIX_S("seed", seed), FIX_S("rng", rng), FIX_S("cur", cur), FIX_S("next", next), FIX_S("hold", hold),
+  FIX_I("score", score), FIX_I("lines", lines), FIX_I("level", level),
+};
+
+// The benchmark corpus: what every --bench run measures, so keep it fixed
+// (add scenarios rather than edit them, or old numbers stop comparing).
+typedef struct { const char *name, *text; } Fixture;
+static const Fixture FIXTURES[] = {
+  { "empty", "seed = 1\ncur = T\nnext = I\n" },
+  { "tetris-ready", "seed = 2\ncur = I\nnext = O\n"
+    "JJJLLLOOI.\nJTTTLSSOI.\nZZTOOSSLI.\nIZZOOJLLI.\nSSOOTTTJJ.\nZSSOOTJJJ.\nLLLZZIIII.\nLOOJZZTTT.\n" },
+  { "tspin", "seed = 3\ncur = T\nnext = S\nhold = I\n"
+    "Z.........\nZZZZ......\nTTT...LLLL\nJJJJ.OOSSO\n" },
+  { "high-stack", "seed = 4\ncur = S\nnext = Z\nscore = 20400\nlines = 96\n"
+    "...LL.....\n..LLJ...O.\n.IJJJ.T.OO\nOIZZ.TTTOO\nOIZZZ.JSSL\nTIS.ZZJSLL\nTSSJ.JJ.LZ\nTTSJ.IIIIZ\n"
+    "OO.JJ..ZZL\nOOLSS.ZZ.L\nIL.SSTTTLL\nILL.TOOTJ.\nIZZ.OOJJJI\nIOZZ.OO.I.\nIOO.LLLII.\nGGGG.GGGGG\n" },
+  { "garbage-tower", "seed = 5\ncur = L\nnext = J\n"
+    "GGG.GGGGGG\nGGG.GGGGGG\nGGGGGGG.GG\nGGGGGGG.GG\nG.GGGGGGGG\nG.GGGGGGGG\nGGGGGGGG.G\n"
+    "GGGGGGGG.G\nGGGG.GGGGG\nGGGG.GGGGG\n.GGGGGGGGG\n.GGGGGGGGG\nGGGGGG.GGG\nGGGGGG.GGG\n" },
+  { "swiss-cheese", "seed = 6\ncur = I\nnext = T\n"
+    ".IIIIOOJJJ\nZ.ZLLOOTJS\nSZZ.LLTTTS\nSSOO.ZZJJI\nLLOOZ.ZZJI\nLTTTJJ.SSI\nIIIIOO.SSI\n"
+    "OOJJJLL.TT\nOOZZJLL.TT\nSSZZTTJJ.L\nOOLLLZZTT.\n" },
+  { "near-topout", "seed = 7\ncur = O\nnext = I\nscore = 98000\nlines = 180\n"
+    "LL.....JJJ\nLLL...ZZ.J\nOOTT..SZZI\nOOT..SSOOI\nIIIIJ..OOI\nZZ.JJJ..OI\nSZZ.LLL.OO\nSSTTTL.ZZO\n"
+    "ISJTOO.ZZL\nISSJOO.LLL\nI.SJJJ.IIT\nI.LLL.TTTT\nOO.LZZ.T.J\nOO.SSZZ.JJ\nJ.SS.TTTJL\nJJJ.I.TLLL\nGGGG.GGGGG\n" },
+};
+#define FIXTURE_COUNT (int)(sizeof FIXTURES/sizeof FIXTURES[0])
+
+static const char PIECE_LETTERS[] = "IOTSZJLiotszjl"; // upper case burger (type 1), lower case ice
+static const char CELL_LETTERS[] = "IOTSZJLGiotszjlg";  // by tint, likewise
+
+// "L", or "L x y turns" (clockwise quarter turns from the spawn shape).
+static bool fixture_piece(Piece *p, const char *s){
+  char l, extra; int x = COLS/2-2, y = 0, turns = 0;
+  int got = sscanf(s, " %c %d %d %d %c", &l, &x, &y, &turns, &extra);
+  const char *at = got>=1 && l ? strchr(PIECE_LETTERS, l) : NULL;
+  if(!at || (got!=1 && got!=4) || turns<0 || turns>3 || x<-3 || x>=COLS || y<-3 || y>=ROWS) return false;
+  int k = (int)(at-PIECE_LETTERS);
+  piece_from_k(p, k%7, k<7);
+  for(int i=0;i<turns;i++) rotate_cw(p);
+  p->x = x; p->y = y;
+  return true;
+}
+
+static int piece_turns(const Piece *p){
+  Piece t; piece_from_k(&t, p->k, p->type);
+  for(int i=0;i<4;i++,rotate_cw(&t)) if(!memcmp(t.m, p->m, sizeof t.m)) return i;
+  return 0;
+}
+
+static void fixture_put_piece(FILE *f, const char *key, const Piece *p){
+  char l = PIECE_LETTERS[p->k + (p->type ? 0 : 7)];
+  int turns = piece_turns(p);
+  if(p->x==COLS/2-2 && !p->y && !turns) fprintf(f, "%s = %c\n", key, l);
+  else fprintf(f, "%s = %c %d %d %d\n", key, l, p->x, p->y, turns);
+}
+
+static bool fixture_u32(const char *s, Uint32 *v){
+  char *end; unsigned long x = strtoul(s, &end, 0);
+  if(end==s || *end) return false;
+  *v = (Uint32)x; return true;
+}
+
+// Text fixture into g; errors go to stderr as where:line.
+static bool fixture_parse(Game *g, const char *text, const char *where){
+  FixtureText ft; memset(&ft,0,sizeof ft); ft.level = -1;
+  static Cell rows[ROWS][COLS]; int nrows = 0;
+  bool ok = true;
+  int ln = 1;
+  for(const char *s=text; *s; ln++){
+    const char *nl = strchr(s, '\n');
+    int len = nl ? (int)(nl-s) : (int)strlen(s);
+    char line[512]; snprintf(line, sizeof line, "%.*s", len, s);
+    s += len + (nl!=NULL);
+    char *p = settings_trim(line);
+    if(!*p || *p=='#') continue;
+    if(strchr(p, '=')){ ok &= settings_pair(p, where, ln, FIXTURE_KEYS, (int)(sizeof FIXTURE_KEYS/sizeof FIXTURE_KEYS[0]), &ft); continue; }
+    bool good = strlen(p)==COLS && nrows<ROWS;
+    for(int c=0;c<COLS && good;c++){
+      const char *at = strchr(CELL_LETTERS, p[c]);
+      int i = at ? (int)(at-CELL_LETTERS) : 0;
+      if(p[c]=='.') rows[nrows][c] = (Cell){ false, 0, 0 };
+      else if(p[c] && at) rows[nrows][c] = (Cell){ true, i<8, i%8 };
+      else good = false;
+    }
+    if(good && !strchr(p, '.')){ fprintf(stderr,"%s:%d: board row '%s' is full; it would have cleared\n", where, ln, p); ok = false; }
+    else if(good) nrows++;
+    else { fprintf(stderr,"%s:%d: bad board row '%s'\n", where, ln, p); ok = false; }
+  }
+  Uint32 seed = 0, rng = 0;
+  if(ft.seed[0] && !fixture_u32(ft.seed, &seed)){ fprintf(stderr,"%s: bad seed '%s'\n", where, ft.seed); ok = false; }
+  if(ft.rng[0] && (!fixture_u32(ft.rng, &rng) || !rng)){ fprintf(stderr,"%s: bad rng '%s'\n", where, ft.rng); ok = false; }
+  game_reset(g, seed);
+  if(rng) g->rng = rng;
+  if(ft.cur[0] && !fixture_piece(&g->cur, ft.cur)){ fprintf(stderr,"%s: bad cur '%s'\n", where, ft.cur); ok = false; }
+  if(ft.next[0] && !fixture_piece(&g->next, ft.next)){ fprintf(stderr,"%s: bad next '%s'\n", where, ft.next); ok = false; }
+  if(ft.hold[0] && !(g->has_hold = fixture_piece(&g->hold, ft.hold))){ fprintf(stderr,"%s: bad hold '%s'\n", where, ft.hold); ok = false; }
+  g->score = ft.score; g->lines = ft.lines; g->level = ft.level<0 ? ft.lines/10 : ft.level;
+  g->fall_ms = gravity_for(g->level);
+  for(int r=0;r<nrows;r++) memcpy(&CELL(g, ROWS-nrows+r, 0), rows[r], sizeof rows[r]);
+  if(ok && collide(g,&g->cur,g->cur.x,g->cur.y)){ fprintf(stderr,"%s: cur overlaps the board\n", where); ok = false; }
+  return ok;
+}
+
+// Text form of any state; what it can't say (tick, delays, timers) starts afresh.
+static void fixture_write(FILE *f, const Game *g, const char *name){
+  if(name) fprintf(f, "name = %s\n", name);
+  fprintf(f, "seed = 0x%08x\nrng = 0x%08x\nscore = %d\nlines = %d\nlevel = %d\n", g->seed, g->rng, g->score, g->lines, g->level);
+  fixture_put_piece(f, "cur", &g->cur); fixture_put_piece(f, "next", &g->next);
+  if(g->has_hold) fixture_put_piece(f, "hold", &g->hold);
+  int top = 0; while(top<ROWS){ int c=0; while(c<COLS && !CELL(g,top,c).filled) c++; if(c<COLS) break; top++; }
+  for(int r=top;r<ROWS;r++){
+    for(int c=0;c<COLS;c++){ const Cell *x = &CELL(g,r,c); fputc(x->filled ? CELL_LETTERS[x->tint + (x->type ? 0 : 8)] : '.', f); }
+    fputc('\n', f);
+  }
+}
+
+// A built-in scenario by name, else a file: binary if it starts with the magic.
+static bool fixture_load(Game *g, const char *arg){
+  for(int i=0;i<FIXTURE_COUNT;i++) if(!strcmp(FIXTURES[i].name, arg)) return fixture_parse(g, FIXTURES[i].text, arg);
+  size_t len = 0;
+  Uint8 *buf = read_file(arg, &len);
+  if(!buf){ fprintf(stderr,"%s: cannot open\n", arg); return false; }
+  bool ok;
+  if(len>=4 && get_u32(buf)==FIXTURE_MAGIC){
+    Uint8 snap[SNAP_BYTES];
+    ok = (len==FIXTURE_BYTES && buf[4]==FIXTURE_VERSION) || (len==FIXTURE_BYTES_V1 && buf[4]==1);
+    if(ok){ if(buf[4]==1) snap_upgrade(snap, buf+5); else memcpy(snap, buf+5, SNAP_BYTES); }
+    if(ok) ok = snap_sane(snap);
+    if(ok) game_unpack(g, snap); else fprintf(stderr,"%s: corrupt fixture\n", arg);
+  } else {
+    Uint8 *text = realloc(buf, len+1);
+    if(text){ buf = text; buf[len] = 0; }
+    ok = text && fixture_parse(g, (const char*)buf, arg);
+  }
+  free(buf);
+  return ok;
+}
+
+static bool fixture_save_binary(const Game *g, const char *path){
+  Uint8 b[FIXTURE_BYTES];
+  put_u32(b, FIXTURE_MAGIC); b[4] = FIXTURE_VERSION; game_pack(g, b+5);
+  FILE *f = fopen(path, "wb");
+  bool ok = f && fwrite(b, 1, sizeof b, f)==sizeof b;
+  if(f && fclose(f)!=0) ok = false;
+  return ok;
+}
+
+// IN (a scenario name or file) to OUT: binary when OUT ends in .ibf, text otherwise.
+static int fixture_convert(const char *in, const char *out){
+  Game g;
+  if(!fixture_load(&g, in)) return 1;
+  size_t n = strlen(out);
+  bool ok;
+  if(n>4 && !strcmp(out+n-4, ".ibf")) ok = fixture_save_binary(&g, out);
+  else { FILE *f = fopen(out, "w"); ok = f!=NULL; if(f){ fixture_write(f, &g, NULL); ok = fclose(f)==0; } }
+  if(!ok){ fprintf(stderr,"%s: cannot write\n", out); return 1; }
+  return 0;
+}
+
+// Benchmark: from every corpus scenario, every placement of the current piece
+// (turns x target column, shifted there, hard dropped, then a second of
+// gravity), ROUNDS times over. The corpus fixes the work, so the crc of the
+// resulting states must agree across runs and builds; only the time may not.
+// Then the bot's side: enumerating and scoring every placement (plan), and
+// the scoring alone (infer), per decision.
+static int bench(int rounds, const Net *net, const char *simd){
+  static Uint8 x[MAX_PLACEMENTS*NN_INPUTS];
+  double freq = (double)SDL_GetPerformanceFrequency();
+  printf("kernels: %s\n", simd);
+  printf("%-14s %10s %9s  %-8s %5s %8s %8s\n", "scenario", "placements", "ns each", "crc", "cands", "plan us", "infer us");
+  for(int i=0;i<FIXTURE_COUNT;i++){
+    Game start, g;
+    if(!fixture_parse(&start, FIXTURES[i].text, FIXTURES[i].name)) return 1;
+    Uint32 crc = 0; long n = 0;
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    for(int round=0;round<rounds;round++) for(int turns=0;turns<4;turns++) for(int px=-2;px<COLS;px++){
+      g = start;
+      for(int k=0;k<turns;k++) game_apply(&g, ACT_CW);
+      for(int k=0;k<COLS && g.cur.x!=px;k++) game_apply(&g, g.cur.x>px ? ACT_LEFT : ACT_RIGHT);
+      game_apply(&g, ACT_HARD);
+      for(int tk=0;tk<SIM_HZ;tk++) game_tick(&g);
+      if(!round){ Uint8 b[4]; put_u32(b, game_checksum(&g)); crc = crc32c(crc, b, 4); }
+      n++;
+    }
+    double ns = (double)(SDL_GetPerformanceCounter()-t0)*1e9/freq/(double)n;
+    Placement pl[MAX_PLACEMENTS], best; Sint32 score[MAX_PLACEMENTS];
+    int cands = bot_placements(&start, pl, x);
+    t0 = SDL_GetPerformanceCounter();
+    for(int round=0;round<rounds;round++) bot_choose(net, &start, &best);
+    double plan = (double)(SDL_GetPerformanceCounter()-t0)*1e6/freq/rounds;
+    t0 = SDL_GetPerformanceCounter();
+    for(int round=0;round<rounds;round++) net_eval(net, x, cands, score);
+    double infer = (double)(SDL_GetPerformanceCounter()-t0)*1e6/freq/rounds;
+    printf("%-14s %10ld %9.0f  %08x %5d %8.1f %8.1f\n", FIXTURES[i].name, n, ns, crc, cands, plan, infer);
+  }
+  // Bloom at 1080p: three stacked boards side by side, four bursts over each.
+  static Bloom bloom; static Atlas atlas; static FxPool fx[3]; static Uint32 px[1920*1080/(BLOOM_DOWN*BLOOM_DOWN)];
+  Game g;
+  if(!fixture_parse(&g, FIXTURES[1].text, FIXTURES[1].name)) return 1;
+  memcpy(atlas.piece, cfg->col_piece, sizeof atlas.piece); atlas.particle_size = 8;
+  for(int b=0;b<3;b++){ fx_reset(&fx[b], (Uint32)b+1); for(int k=0;k<4;k++) fx_explosion(&fx[b], COLS*TILE/2, (float)((ROWS-1-k)*TILE), cfg->col_piece[k]); fx_update(&fx[b], 0.3f); }
+  if(!bloom_open(&bloom, NULL, 1920, 1080, SDL_GetCPUCount()-1)){ fprintf(stderr,"bloom: out of memory\n"); return 1; }
+  int passes = imax(10, rounds/20);
+  Uint64 extract = 0, blur = 0;
+  for(int round=0;round<passes;round++){
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    bloom_clear(&bloom);
+    for(int b=0;b<3;b++){ bloom_board(&bloom, &atlas, &g, 40 + b*PANEL_W, 40, 0.5f); bloom_particles(&bloom, &atlas, &fx[b], 40 + b*PANEL_W, 40); }
+    Uint64 t1 = SDL_GetPerformanceCounter();
+    bloom_run(&bloom, px, bloom.w);
+    blur += SDL_GetPerformanceCounter() - t1; extract += t1 - t0;
+  }
+  printf("bloom 1920x1080 -> %dx%d, %d+1 threads: extract %.0f us, blur %.0f us, total %.0f us\n", bloom.w, bloom.h, bloom.threads,
+         (double)extract*1e6/freq/passes, (double)blur*1e6/freq/passes, (double)(extract+blur)*1e6/freq/passes);
+  bloom_close(&bloom);
+  return 0;
+}
+
+static void usage(const char *argv0){
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  --config PATH           settings file (default tetris.conf, if present)\n"
+    "  --print-config          print the effective settings in file form and exit\n"
+    "  --theme FILE            add a theme (repeatable); T cycles through them in game\n"
+    "  --font-rescan           look for fonts again instead of using the cached choice\n"
+    "  --statedb PATH          record every (board, piece) state played into PATH\n"
+    "  --statedb-fill PATH N   play N headless random games into PATH and exit\n"
+    "  --statedb-info PATH     print table statistics for PATH and exit\n"
+    "  --record DIR            save a replay of every game as DIR/<seed>.ibr\n"
+    "  --replay FILE           watch a replay (checkpoints verified as it plays)\n"
+    "  --verify FILE...        re-simulate replays headless and report desyncs\n"
+    "  --fixture FILE|NAME     start from a board fixture (text, .ibf, or a built-in scenario)\n"
+    "  --fixture-list          list the built-in scenarios\n"
+    "  --fixture-convert IN OUT  write fixture IN to OUT (binary if OUT ends in .ibf)\n"
+    "  --bench [ROUNDS]        time the engine and the bot from every built-in scenario\n"
+    "  --bot                   the last board (the only one solo) is played by the placement bot\n"
+    "  --net FILE              bot weights (.ibn; default: the built-in starter net)\n"
+    "  --mcts MS               the bot searches (MCTS) for MS per move\n"
+    "  --mcts-threads N        search threads (default: a core each, one left for the game;\n"
+    "                          0 = search in slices between frames)\n"
+    "  --bot-eval GAMES        play GAMES headless games with the bot and print how it did\n"
+    "  --net-starter FILE      write the starter net as a .ibn to train from\n"
+    "  --book FILE             the bot opens 7-bag games from this opening book (.ibk)\n"
+    "  --book-build FILE [BEAM]  search every first bag (beam default %d) and write the book\n"
+    "  --difftest N [SEED]     run N random input sequences through the engine and the\n"
+    "                          reference engine; shrink and save the first divergence\n"
+    "  --telemetry PATH        append a JSON status line per second to PATH\n"
+    "  --metrics PORT          serve Prometheus metrics on http://127.0.0.1:PORT/metrics\n"
+    "  --stats PATH            rewrite the same metrics into PATH once a second\n"
+    "  --spectate PORT         stream the board to WebSocket overlays on ws://127.0.0.1:PORT/\n"
+    "  --clear-ticks N         line-clear delay in %dms ticks (default %d; 0 = instant)\n"
+    "  --are-ticks N           delay before the next piece spawns (default %d)\n"
+    "  --mode sprint|ultra     40-line sprint or 2-minute ultra, with splits\n"
+    "  --bag                   7-bag randomizer: every 7 pieces deal each shape once\n"
+    "  --pb PATH               personal bests for timed modes (default tetris-pb.txt)\n"
+    "  --players N             local versus for N (2-%d) players on one screen\n"
+    "  --royale HOST:PORT      join a battle royale; 1-4 target random/attackers/KOs/badges\n"
+    "  --royale-server PORT [MATCHES]  host royales of up to %d (exit after MATCHES)\n"
+    "  --royale-bots HOST:PORT N  join N bot players to a royale server\n"
+    "  --leaderboard FILE|HOST:PORT  rank each marathon game: in FILE, or on a leaderboard server\n"
+    "  --leaderboard-server PORT FILE  serve the leaderboard kept in FILE (snapshots every %ds)\n"
+    "  --leaderboard-load HOST:PORT N  send N scores from %d connections, timing ranks meanwhile\n"
+    "  --audio-buffer N        audio callback size in frames (default %d; lower = less latency)\n", argv0, BOOK_BEAM, 1000/SIM_HZ, CLEAR_TICKS, ARE_TICKS, MAX_PLAYERS, ROYALE_MAX, LB_SNAPSHOT_MS/1000, LB_LOAD_WRITERS, AUDIO_BUFFER);
+}
+
+static Uint32 new_seed(){ return (Uint32)rand() ^ (Uint32)rand()<<16 ^ (Uint32)time(NULL); }
+
+static void record_finish(ReplayWriter *w, const char *dir, const Game *g){
+  if(!dir || !w->len) return;
+  char path[600]; snprintf(path, sizeof path, "%s/%08x.ibr", dir, g->seed);
+  if(!replay_save(w, path)) fprintf(stderr,"record: cannot write %s\n", path);
+  w->len = 0;
+}
+
+int main(int argc, char **argv){
+  srand((unsigned)time(NULL));
+  zobrist_init();
+  crc32c_init();
+  const char *simd = simd_init();
+
+  const char *statedb_path = NULL, *record_dir = NULL, *replay_path = NULL, *telemetry_path = NULL, *pb_path = "tetris-pb.txt";
+  static MetricsExport metrics;
+  static Spectate spectate;
+  // Settings first: the command line overrides them, and headless tools use them too.
+  const char *config_path = NULL;
+  for(int i=1;i<argc-1;i++) if(!strcmp(argv[i],"--config")) config_path = argv[i+1];
+  if(!settings_load(config_path ? config_path : "tetris.conf", config_path!=NULL)) return 2;
+  bool font_rescan = false;
+  static Theme themes[MAX_THEMES];
+  int nthemes = 1, theme_cur = 0, theme_want = 0;
+  theme_default(&themes[0]);
+  static Game fixture; bool has_fixture = false;
+  static Net net; bool bot_on = false; int bench_rounds = 0, mcts_ms = 0, mcts_threads = -1, eval_games = 0;
+  static Book book; bool has_book = false, bag = false; const char *book_out = NULL; int book_beam = BOOK_BEAM;
+  const char *royale_addr = NULL, *royale_bots_addr = NULL; int royale_port = 0, royale_matches = 0, royale_bots_n = 0;
+  const char *lb_arg = NULL, *lb_file = NULL, *lb_load_addr = NULL; int lb_port = 0; long lb_load_n = 0;
+  net_starter(&net);
+  int audio_buffer = cfg->audio_buffer, players = 1, clear_ticks = cfg->clear_ticks, are_ticks = cfg->are_ticks, mode = MODE_MARATHON;
+  for(int i=1;i<argc;i++){
+    if(!strcmp(argv[i],"--config") && i+1<argc) i++;
+    else if(!strcmp(argv[i],"--print-config")){ settings_print(stdout); return 0; }
+    else if(!strcmp(argv[i],"--font-rescan")) font_rescan = true;
+    else if(!strcmp(argv[i],"--theme") && i+1<argc){
+      if(nthemes==MAX_THEMES){ fprintf(stderr,"--theme: at most %d\n", MAX_THEMES-1); return 2; }
+      if(!theme_load(&themes[nthemes++], argv[++i])) return 2;
+      theme_cur = theme_want = nthemes-1; // the last one given starts
+    }
+    else if(!strcmp(argv[i],"--statedb") && i+1<argc) statedb_path = argv[++i];
+    else if(!strcmp(argv[i],"--record") && i+1<argc) record_dir = argv[++i];
+    else if(!strcmp(argv[i],"--replay") && i+1<argc) replay_path = argv[++i];
+    else if(!strcmp(argv[i],"--telemetry") && i+1<argc) telemetry_path = argv[++i];
+    else if(!strcmp(argv[i],"--metrics") && i+1<argc) metrics.port = imax(1, imin(65535, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--spectate") && i+1<argc) spectate.port = imax(1, imin(65535, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--stats") && i+1<argc) metrics.stats_path = argv[++i];
+    else if(!strcmp(argv[i],"--clear-ticks") && i+1<argc) clear_ticks = imax(0, imin(255, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--are-ticks") && i+1<argc) are_ticks = imax(0, imin(255, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--mode") && i+1<argc){
+      const char *m = argv[++i];
+      if(!strcmp(m, MODE_NAMES[MODE_SPRINT])) mode = MODE_SPRINT;
+      else if(!strcmp(m, MODE_NAMES[MODE_ULTRA])) mode = MODE_ULTRA;
+      else { usage(argv[0]); return 2; }
+    }
+    else if(!strcmp(argv[i],"--bag")) bag = true;
+    else if(!strcmp(argv[i],"--pb") && i+1<argc) pb_path = argv[++i];
+    else if(!strcmp(argv[i],"--players") && i+1<argc) players = imax(1, imin(MAX_PLAYERS, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--royale") && i+1<argc) royale_addr = argv[++i];
+    else if(!strcmp(argv[i],"--royale-server") && i+1<argc){
+      royale_port = imax(1, imin(65535, atoi(argv[++i])));
+      if(i+1<argc && argv[i+1][0]>='0' && argv[i+1][0]<='9') royale_matches = imax(1, atoi(argv[++i]));
+    }
+    else if(!strcmp(argv[i],"--royale-bots") && i+2<argc){ royale_bots_addr = argv[++i]; royale_bots_n = imax(1, atoi(argv[++i])); }
+    else if(!strcmp(argv[i],"--leaderboard") && i+1<argc) lb_arg = argv[++i];
+    else if(!strcmp(argv[i],"--leaderboard-server") && i+2<argc){ lb_port = imax(1, imin(65535, atoi(argv[++i]))); lb_file = argv[++i]; }
+    else if(!strcmp(argv[i],"--leaderboard-load") && i+2<argc){ lb_load_addr = argv[++i]; lb_load_n = imax(LB_LOAD_WRITERS, atoi(argv[++i])); }
+    else if(!strcmp(argv[i],"--audio-buffer") && i+1<argc) audio_buffer = imax(32, imin(8192, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--verify") && i+1<argc){
+      int bad=0; for(i++;i<argc;i++) bad |= replay_verify(argv[i]);
+      return bad;
+    }
+    else if(!strcmp(argv[i],"--fixture") && i+1<argc){
+      if(!fixture_load(&fixture, argv[++i])) return 2;
+      has_fixture = true;
+    }
+    else if(!strcmp(argv[i],"--fixture-list")){ for(int f=0;f<FIXTURE_COUNT;f++) printf("%s\n", FIXTURES[f].name); return 0; }
+    else if(!strcmp(argv[i],"--fixture-convert") && i+2<argc) return fixture_convert(argv[i+1], argv[i+2]);
+    else if(!strcmp(argv[i],"--bench")) bench_rounds = i+1<argc && argv[i+1][0]>='0' && argv[i+1][0]<='9' ? imax(1, atoi(argv[++i])) : 2000;
+    else if(!strcmp(argv[i],"--bot")) bot_on = true;
+    else if(!strcmp(argv[i],"--mcts") && i+1<argc) mcts_ms = imax(1, imin(60000, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--mcts-threads") && i+1<argc) mcts_threads = imax(0, imin(MCTS_THREADS, atoi(argv[++i])));
+    else if(!strcmp(argv[i],"--bot-eval") && i+1<argc) eval_games = imax(1, atoi(argv[++i]));
+    else if(!strcmp(argv[i],"--net") && i+1<argc){ if(!net_load(&net, argv[++i])) return 2; }
+    else if(!strcmp(argv[i],"--book") && i+1<argc){ if(!book_load(&book, argv[++i])) return 2; has_book = true; }
+    else if(!strcmp(argv[i],"--book-build") && i+1<argc){
+      book_out = argv[++i];
+      if(i+1<argc && argv[i+1][0]>='0' && argv[i+1][0]<='9') book_beam = imax(1, imin(BOOK_MAX_BEAM, atoi(argv[++i])));
+    }
+    else if(!strcmp(argv[i],"--net-starter") && i+1<argc){
+      net_starter(&net);
+      if(!net_save(&net, argv[++i])){ fprintf(stderr,"%s: cannot write\n", argv[i]); return 1; }
+      return 0;
+    }
+    else if(!strcmp(argv[i],"--difftest") && i+1<argc){
+      long cases = atol(argv[++i]);
+      Uint32 seed = i+1<argc && argv[i+1][0]>='0' && argv[i+1][0]<='9' ? (Uint32)strtoul(argv[++i], NULL, 0) : new_seed();
+      return difftest(cases, seed);
+    }
+    else if(!strcmp(argv[i],"--statedb-fill") && i+2<argc) return statedb_fill(argv[i+1], atoi(argv[i+2]));
+    else if(!strcmp(argv[i],"--statedb-info") && i+1<argc) return statedb_info(argv[i+1]);
+    else { usage(argv[0]); return 2; }
+  }
+
+  if(bench_rounds) return bench(bench_rounds, &net, simd);
+  if(book_out) return book_build(book_out, &net, book_beam);
+  if(royale_port) return royale_server(royale_port, royale_matches);
+  if(royale_bots_addr) return royale_bots(royale_bots_addr, royale_bots_n, &net);
+  if(lb_port) return leaderboard_server(lb_port, lb_file);
+  if(lb_load_addr) return leaderboard_load(lb_load_addr, lb_load_n);
+  // MCTS leaves a core for the game itself unless told otherwise; on a single
+  // core that means no workers, and the search runs in slices between frames.
+  static Mcts mcts;
+  Bot bot = { &net, NULL, mcts_ms, -1, 0, 0, false, false, has_book ? &book : NULL, NULL, 0, 0, false, {0} }; // plays the last board with --bot
+  if(mcts_ms && (bot_on || eval_games)){
+    int threads = mcts_threads>=0 ? mcts_threads : eval_games ? SDL_GetCPUCount() : SDL_GetCPUCount()-1;
+    if(!mcts_open(&mcts, &net, threads)){ fprintf(stderr,"mcts: out of memory\n"); return 1; }
+    bot.mcts = &mcts;
+  }
+  if(eval_games){ int rc = bot_eval(&bot, eval_games, bag); if(bot.mcts) mcts_close(&mcts); return rc; }
+  if(players>1 && (statedb_path || record_dir || replay_path)){
+    fprintf(stderr,"--players: --statedb, --record and --replay follow a single board\n"); return 2;
+  }
+  if(players>1 && mode){ fprintf(stderr,"--mode: timed modes are single player\n"); return 2; }
+  if(royale_addr && (players>1 || mode || replay_path || record_dir || has_fixture)){
+    fprintf(stderr,"--royale: the server deals the game; no --players, --mode, --replay, --record or --fixture\n"); return 2;
+  }
+  if(lb_arg && (players>1 || mode || replay_path || has_fixture || bot_on || royale_addr)){
+    fprintf(stderr,"--leaderboard: ranks marathon games played by hand; no --players, --mode, --replay, --fixture, --bot or --royale\n"); return 2;
+  }
+  // A FILE is ranked in locally; HOST:PORT (anything with a colon) asks the service.
+  static Leaderboard lb_local;
+  LbView lbv = { NULL, lb_arg, -1, {0}, 0, 0, 0, false, false };
+  if(lb_arg && strchr(lb_arg, ':')){
+    signal(SIGPIPE, SIG_IGN);
+    if((lbv.fd = tcp_connect(lb_arg))<0) fprintf(stderr,"leaderboard: games go unranked\n");
+  }
+  else if(lb_arg){ if(!lb_load(&lb_local, lb_arg)) return 2; lbv.local = &lb_local; }
+  static RoyClient royale; royale.fd = -1;
+  if(royale_addr){
+    signal(SIGPIPE, SIG_IGN);
+    if((royale.fd = tcp_connect(royale_addr))<0) return 1;
+  }
+
+  static StateDB statedb; // large visit buffer; keep it off the stack
+  if(statedb_path && !sdb_open(&statedb, statedb_path)) fprintf(stderr,"statedb: cannot open %s\n", statedb_path);
+
+  size_t replay_len = 0;
+  Uint8 *replay_buf = replay_path ? read_file(replay_path, &replay_len) : NULL;
+  ReplayReader replay;
+  if(replay_path && (!replay_buf || !replay_open(&replay, replay_buf, replay_len))){
+    fprintf(stderr,"%s: not a replay\n", replay_path); return 1;
+  }
+  if(replay_buf) replay_use_gravity(&replay);
+
+  if(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER)!=0){ fprintf(stderr,"SDL_Init error: %s\n", SDL_GetError()); return 1; }
+  perf_hz = SDL_GetPerformanceFrequency();
+  if(TTF_Init()!=0){ fprintf(stderr,"TTF_Init error: %s\n", TTF_GetError()); return 1; }
+
+  // Versus lays the panels side by side and scales the lot to fit.
+  // A royale adds the other 98 boards in miniature to the right.
+  int winW = royale_addr ? PANEL_W + ROY_MINI_COLS*ROY_MINI_W + 40 : players==1 ? cfg->win_w : players*PANEL_W + 40, winH = cfg->win_h;
+  int viewW = winW, viewH = winH;
+  if(winW > cfg->win_max_w){ winH = winH*cfg->win_max_w/winW; winW = cfg->win_max_w; }
+  SDL_Window *win = SDL_CreateWindow("IceBurger Tetris", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, winW, winH, SDL_WINDOW_SHOWN);
+  SDL_Renderer *ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED|SDL_RENDERER_PRESENTVSYNC);
+  SDL_RenderSetLogicalSize(ren, viewW, viewH);
+
+  // Without an emoji font the tiles are plain colored squares.
+  FontChoice fonts;
+  fonts_find(&fonts, font_rescan);
+  TTF_Font *emoji_font = fonts.emoji.path[0] ? TTF_OpenFontIndex(fonts.emoji.path, 64, fonts.emoji.index) : NULL;
+  TTF_Font *ui_font = fonts.ui.path[0] ? TTF_OpenFontIndex(fonts.ui.path, cfg->ui_font_size, fonts.ui.index) : NULL;
+
+  static Atlas atlas;
+  atlas_build(&atlas, ren, emoji_font, &themes[theme_cur]); // the emoji font stays open for theme switches
+  static AtlasJob atlas_job;
+  static Glyphs glyphs;
+  glyphs_build(&glyphs, ren, ui_font); // likewise: all text comes from the cache
+  if(ui_font){ TTF_CloseFont(ui_font); ui_font = NULL; }
+  Batch batch = {0}, text = {0};
+  // Bloom gets the cores left after the game and MCTS; with none, the rendering thread blurs alone.
+  static Bloom bloom;
+  int bloom_threads = imax(0, SDL_GetCPUCount()-1 - (bot.mcts ? bot.mcts->threads : 0));
+  if(cfg->bloom && !bloom_open(&bloom, ren, viewW, viewH, bloom_threads)){ fprintf(stderr,"bloom: unavailable, playing without\n"); bloom_close(&bloom); }
+
+  static Lockstep lockstep;
+  static ReplayWriter rec;
+  static TimeTravel tt;
+  bool scrub = false; Uint32 scrub_tick = 0; Game view; // time-travel debugger (F9)
+  char scrub_msg[96] = "";
+  static Audio audio;
+  audio_open(&audio, audio_buffer);
+  music_toggle(&audio);
+
+  static Match match;
+  match.n = players; match.clear_ticks = (Uint8)clear_ticks; match.are_ticks = (Uint8)are_ticks; match.mode = (Uint8)mode; match.bag = bag;
+  static Run run;
+  pb_load(&run, pb_path);
+  Game *g = &match.b[0].g; // the board recorded, replayed, published and rewound
+  if(has_fixture) match_load(&match, &fixture); else match_reset(&match, new_seed());
+  if(replay_buf) replay_start_game(&replay, g);
+  met_add(&met_main, MET_GAMES, 1);
+  lockstep_record(&lockstep, g);
+  state_publish(&state_pub, g);
+  if(record_dir && !replay_buf) replay_begin(&rec, g);
+  static Telemetry telemetry;
+  SDL_Thread *telemetry_th = NULL;
+  if(telemetry_path){ telemetry.path = telemetry_path; telemetry_th = SDL_CreateThread(telemetry_thread, "telemetry", &telemetry); }
+  SDL_Thread *metrics_th = metrics.port || metrics.stats_path ? SDL_CreateThread(metrics_thread, "metrics", &metrics) : NULL;
+  SDL_Thread *spectate_th = spectate.port ? SDL_CreateThread(spectate_thread, "spectate", &spectate) : NULL;
+  bool replay_has = replay_buf && replay_next(&replay), desync = false;
+  Uint8 acts[MAX_PLAYERS][64]; int nacts[MAX_PLAYERS];
+  static PadPoll pads;
+  pads_start(&pads);
+  Uint64 sim_acc_us = 0;
+  bool was_over = false;
+  int seen_pieces = -1;
+  StateEntry here = {0}; // copied out: growth may unmap the slot it came from
+
+  bool running=true, paused=false;
+  Uint64 now=SDL_GetPerformanceCounter();
+  Uint64 last=now; double freq=(double)SDL_GetPerformanceFrequency();
+
+  while(running){
+    last = now; now = SDL_GetPerformanceCounter();
+    float dt = (float)((now-last)/freq);
+    Uint64 frame_us = perf_us();
+    Uint64 ticks_base_us = frame_us - (Uint64)SDL_GetTicks()*1000; // event timestamps are SDL_GetTicks ms
+    met_add(&met_main, MET_FRAMES, 1);
+    met_observe(&met_main, met_main.frame_hist, FRAME_BOUNDS_US, MET_FRAME_US, (Uint64)(dt*1e6f));
+
+    // input
+    SDL_Event e; while(SDL_PollEvent(&e)){
+      if(e.type==SDL_QUIT) running=false;
+      if(e.type==SDL_KEYDOWN){
+        SDL_Keycode k = e.key.keysym.sym;
+        if(k==SDLK_F9 && (scrub || tt.nseg)){
+          scrub = !scrub; scrub_msg[0] = 0;
+          if(scrub){ scrub_tick = tt_last_tick(&tt); tt_restore(&tt, scrub_tick, &view); }
+          continue;
+        }
+        if(scrub){
+          Uint32 lo = tt_first_tick(&tt), hi = tt_last_tick(&tt), t = scrub_tick;
+          if(k==SDLK_LEFT) t = t>lo ? t-1 : lo;
+          else if(k==SDLK_RIGHT) t = t<hi ? t+1 : hi;
+          else if(k==SDLK_LEFTBRACKET) t = t>=lo+SIM_HZ ? t-SIM_HZ : lo;
+          else if(k==SDLK_RIGHTBRACKET) t = t+SIM_HZ<=hi ? t+SIM_HZ : hi;
+          else if(k==SDLK_F5){
+            char path[64]; snprintf(path, sizeof path, "rewind-%08x-%u.ibr", g->seed, scrub_tick);
+            snprintf(scrub_msg, sizeof scrub_msg, tt_dump(&tt, scrub_tick, path) ? "wrote %s" : "cannot write %s", path);
+          }
+          else if(k==SDLK_ESCAPE) running=false;
+          if(t!=scrub_tick){ scrub_tick = t; tt_restore(&tt, t, &view); }
+          continue;
+        }
+        if(k==SDLK_ESCAPE) running=false;
+        else if(royale_addr && k>=SDLK_1 && k<SDLK_1+TGT_COUNT){
+          Uint8 s = (Uint8)(k-SDLK_1);
+          if(royale.fd>=0 && !roy_client_send(&royale, ROY_TARGET, &s, 1)) roy_client_close(&royale);
+          continue;
+        }
+        else if(royale_addr && (k==SDLK_p || k==SDLK_r)) continue; // the server runs the game: no pausing or restarting it
+        else if(k==SDLK_p) paused=!paused;
+        else if(k==SDLK_m) music_toggle(&audio);
+        else if(k==SDLK_t){ theme_want = (theme_cur + 1) % nthemes; continue; }
+        else if(k==SDLK_r && !replay_buf) {
+          if(!g->game_over){ sdb_end_game(&statedb,g); record_finish(&rec, record_dir, g); }
+          if(has_fixture) match_load(&match, &fixture); else match_reset(&match, new_seed());
+          lockstep_record(&lockstep, g); tt_clear(&tt); state_publish(&state_pub, g);
+          met_add(&met_main, MET_GAMES, 1);
+          if(record_dir) replay_begin(&rec, g);
+          paused=false; seen_pieces=-1; was_over=false; run.cur = (RunRecord){0}; run.new_best = false; lbv.has = lbv.waiting = false;
+        }
+        if(match_over(&match)||paused||replay_buf) continue;
+        for(int pl=0; pl<imin(match.n, 2); pl++){
+          const SDL_Keycode *keys = match.n==1 ? KEYS_SOLO : KEYS_VERSUS[pl];
+          for(int act=0; act<ACT_COUNT; act++) if(k==keys[act]){
+            Board *b = &match.b[pl];
+            input_queue(b->pending, &b->npending, (int)(sizeof b->pending/sizeof b->pending[0]),
+                        (InputEvent){ ticks_base_us + (Uint64)e.key.timestamp*1000, (Uint8)pl, (Uint8)act });
+          }
+        }
+      }
+    }
+    InputEvent pe; while(spsc_pop(&pads.q, &pe)){
+      if(pe.act==INPUT_PAUSE){ if(!scrub && !royale_addr) paused = !paused; continue; }
+      int pl = match.n==1 ? 0 : pe.player; // one player: every pad drives the board
+      if(pl>=match.n || match_over(&match) || paused || scrub || replay_buf) continue;
+      Board *b = &match.b[pl];
+      input_queue(b->pending, &b->npending, (int)(sizeof b->pending/sizeof b->pending[0]), pe);
+    }
+
+    if(bot_on && bot.mcts) bot_think(&bot); // a sliced search's share of this frame
+    if(royale_addr){
+      // Royale: keys go up each tick, the board comes back as the server has it.
+      sim_acc_us += (Uint64)(dt*1e6f);
+      if(sim_acc_us > 250000) sim_acc_us = 250000;
+      while(sim_acc_us >= TICK_US){
+        sim_acc_us -= TICK_US;
+        int n = board_take(&match.b[0], frame_us - sim_acc_us, frame_us, acts[0]);
+        if(bot_on && royale.has_game) n += bot_act(&bot, &royale.g, acts[0]+n);
+        if(royale.fd>=0 && !roy_client_send(&royale, ROY_ACT, acts[0], n)) roy_client_close(&royale);
+      }
+      if(royale.fd>=0 && !roy_client_read(&royale)) roy_client_close(&royale);
+      if(royale.has_game){ SfxProbe before = sfx_probe(g); *g = royale.g; sfx_for_tick(&audio, &before, g, false); }
+    }
+    else if(!paused && !scrub && !match_over(&match) && !desync){
+      sim_acc_us += (Uint64)(dt*1e6f);
+      if(sim_acc_us > 250000) sim_acc_us = 250000; // don't spiral after a stall
+      while(sim_acc_us >= TICK_US && !match_over(&match) && !desync){
+        sim_acc_us -= TICK_US;
+        Uint64 tick_end_us = frame_us - sim_acc_us; // wall time this tick catches the sim up to
+        for(int pl=0;pl<match.n;pl++) nacts[pl] = board_take(&match.b[pl], tick_end_us, frame_us, acts[pl]);
+        int bp = match.n-1; // in versus the bot is the last player
+        if(bot_on && !replay_buf && nacts[bp] <= (int)sizeof acts[bp] - (4+COLS+1)) nacts[bp] += bot_act(&bot, &match.b[bp].g, acts[bp]+nacts[bp]);
+        if(replay_buf){
+          nacts[0] = replay_feed(&replay, &replay_has, g, &lockstep, acts[0], (int)sizeof acts[0], &desync);
+          if(desync || (!replay_has && !nacts[0])) break; // diverged, or the recording ended
+        }
+        if(match.n==1) tt_record(&tt, g, acts[0], nacts[0]);
+        for(int pl=0;pl<match.n;pl++){
+          Game *bg = &match.b[pl].g;
+          if(bg->game_over) continue;
+          SfxProbe before = sfx_probe(bg);
+          sim_tick(bg, acts[pl], nacts[pl], pl==0 ? &lockstep : NULL, pl==0 && record_dir ? &rec : NULL);
+          sfx_for_tick(&audio, &before, bg, nacts[pl]>0);
+        }
+        match_exchange(&match);
+        if(g->mode) run_note(&run.cur, g);
+        state_publish(&state_pub, g);
+        met_add(&met_main, MET_TICKS, 1);
+      }
+    } else { sim_acc_us = 0; for(int pl=0;pl<match.n;pl++) match.b[pl].npending = 0; }
+    if(g->game_over && !was_over){
+      tt_record(&tt, g, NULL, 0); record_finish(&rec, record_dir, g); was_over = true;
+      if(lb_arg) lb_submit(&lbv, (Uint32)g->score);
+      if(game_finished(g) && !replay_buf && run_finish(&run, g) && !pb_save(&run, pb_path)) fprintf(stderr,"pb: cannot write %s\n", pb_path);
+    }
+
+    lb_poll(&lbv);
+
+    if(g->pieces!=seen_pieces && statedb.cur.h){
+      seen_pieces = g->pieces;
+      const StateEntry *e = g->game_over ? NULL : sdb_lookup(&statedb, state_hash(g));
+      here = e ? *e : (StateEntry){0};
+      if(g->game_over) sdb_end_game(&statedb,g); else sdb_note(&statedb,g);
+    }
+
+    // A theme switch builds on a worker; the new atlas is swapped in here,
+    // between frames, never mid-batch. The old theme shows until then.
+    if(theme_want!=theme_cur && !atlas_job.busy) atlas_job_start(&atlas_job, emoji_font, &themes[theme_want], theme_want);
+    if(atlas_job_poll(&atlas_job, ren, &atlas)) theme_cur = atlas_job.want;
+
+    int live = 0;
+    for(int pl=0;pl<match.n;pl++){ fx_from_game(&match.b[pl].fx, &match.b[pl].g, atlas.burst); live += fx_update(&match.b[pl].fx, dt); }
+    met_set(&met_main, MET_PARTICLES, (Uint64)live);
+
+    // draw: every board into one batch, one draw call, then text on top
+    SDL_SetRenderDrawColor(ren, atlas.bg.r,atlas.bg.g,atlas.bg.b,255);
+    SDL_RenderClear(ren);
+    if(atlas.has_bg) batch_slot(&batch, &atlas, 0, 0, (float)viewW, (float)viewH, ATLAS_BG);
+
+    int ox = 40, oy = 40;
+    for(int pl=0;pl<match.n;pl++){
+      const Game *shown = scrub && pl==0 ? &view : &match.b[pl].g;
+      int bx = ox + pl*PANEL_W;
+      render_board(&batch, &atlas, shown, bx, oy, scrub ? 0 : (float)sim_acc_us/TICK_US);
+      render_preview(&batch, &atlas, &shown->next, bx + COLS*TILE + 40, oy);
+      if(shown->has_hold) render_preview(&batch, &atlas, &shown->hold, bx + COLS*TILE + 40, oy + PREVIEW_H*TILE + 24);
+    }
+    for(int pl=0;pl<match.n;pl++) render_particles(&batch, &atlas, &match.b[pl].fx, ox + pl*PANEL_W, oy);
+    if(royale_addr) roy_render_minis(&batch, &atlas, &royale, ox + PANEL_W, oy);
+    batch_flush(&batch, ren, &atlas);
+    if(bloom.tex){ // glow over the boards, under the text
+      bloom_clear(&bloom);
+      for(int pl=0;pl<match.n;pl++){
+        bloom_board(&bloom, &atlas, scrub && pl==0 ? &view : &match.b[pl].g, ox + pl*PANEL_W, oy, scrub ? 0 : (float)sim_acc_us/TICK_US);
+        bloom_particles(&bloom, &atlas, &match.b[pl].fx, ox + pl*PANEL_W, oy);
+      }
+      bloom_draw(&bloom, ren);
+    }
+
+    char buf[128];
+    const Game *shown = scrub ? &view : g;
+    for(int pl=0;pl<match.n;pl++){
+      const Game *bg = pl ? &match.b[pl].g : shown;
+      snprintf(buf,sizeof buf, "Score %d  Lines %d  Level %d", bg->score, bg->lines, bg->level);
+      batch_text(&text, &glyphs, buf, ox + pl*PANEL_W, oy + ROWS*TILE + 24, atlas.text);
+      if(match.n==1) continue;
+      snprintf(buf,sizeof buf, "P%d", pl+1);
+      batch_text(&text, &glyphs, buf, ox + pl*PANEL_W, oy-34, atlas.text);
+      if(bg->game_over) batch_text(&text, &glyphs, "OUT", ox + pl*PANEL_W + 130, oy+260, (SDL_Color){255,120,120,255});
+    }
+    if(here.visits){
+      snprintf(buf,sizeof buf, "Seen here %ux: avg +%.0f pts, %.1f pieces", here.visits,
+               (double)here.sum_gain/here.visits, (double)here.sum_pieces/here.visits);
+      batch_text(&text, &glyphs, buf, ox, oy + ROWS*TILE + 50, atlas.text);
+    }
+
+    if(royale_addr){
+      if(royale.has_game){
+        snprintf(buf,sizeof buf, "%d/%d left  KOs %d  Badges %d  Targeting you %d  [%s] (1-4)", royale.alive, royale.players,
+                 royale.kos, royale.badges, royale.attackers, TGT_NAMES[royale.strat%TGT_COUNT]);
+        batch_text(&text, &glyphs, buf, ox, oy-34, atlas.text);
+        if(royale.place){
+          if(royale.place==1) snprintf(buf,sizeof buf, "WINNER"); else snprintf(buf,sizeof buf, "OUT - #%d of %d", royale.place, royale.players);
+          batch_text(&text, &glyphs, buf, ox+120, oy+220, (SDL_Color){255,210,60,255});
+        }
+      }
+      if(royale.fd<0) batch_text(&text, &glyphs, "DISCONNECTED", ox+120, oy+260, (SDL_Color){255,120,120,255});
+      else if(!royale.has_game) batch_text(&text, &glyphs, "WAITING FOR PLAYERS", ox+80, oy+220, atlas.text);
+    }
+    if(paused) batch_text(&text, &glyphs, "PAUSED (P)", ox+220, oy+200, (SDL_Color){255,210,60,255});
+    if(match.n==1 && g->mode) render_run_hud(&text, &glyphs, &run, shown, ox + COLS*TILE + 40, oy + 2*(PREVIEW_H*TILE + 24), atlas.text);
+    if(match.n==1 && g->game_over && game_finished(g)){
+      char res[24];
+      if(g->mode==MODE_SPRINT) fmt_time(res, sizeof res, run.cur.result); else snprintf(res, sizeof res, "%d", g->score);
+      snprintf(buf, sizeof buf, "%s %s%s (R to restart)", g->mode==MODE_SPRINT ? "FINISHED" : "TIME UP", res, run.new_best ? "  NEW PB" : "");
+      batch_text(&text, &glyphs, buf, ox+60, oy+220, (SDL_Color){255,210,60,255});
+    }
+    else if(match.n==1 && g->game_over && !royale_addr) batch_text(&text, &glyphs, "GAME OVER (R to restart)", ox+120, oy+220, (SDL_Color){255,120,120,255});
+    if(g->game_over && lbv.has){
+      char r[16], of[16]; fmt_count(r, sizeof r, lbv.rank); fmt_count(of, sizeof of, lbv.of);
+      snprintf(buf, sizeof buf, "#%s of %s", r, of);
+      batch_text(&text, &glyphs, buf, ox+120, oy+250, (SDL_Color){255,210,60,255});
+    }
+    if(match.n>1 && match_over(&match)){
+      int w = match_winner(&match);
+      if(w>=0) snprintf(buf,sizeof buf, "PLAYER %d WINS (R to restart)", w+1); else snprintf(buf,sizeof buf, "DRAW (R to restart)");
+      batch_text(&text, &glyphs, buf, ox + (w>=0 ? w*PANEL_W : 0) + 40, oy+220, (SDL_Color){255,210,60,255});
+    }
+    if(replay_buf) batch_text(&text, &glyphs, desync ? "REPLAY DESYNC (see desync-*.txt)" : replay_has ? "REPLAY" : "REPLAY END", ox, oy-34,
+                             desync ? (SDL_Color){255,120,120,255} : atlas.text);
+    if(scrub){
+      snprintf(buf,sizeof buf, "REWIND %+.2fs  (<-/-> tick, [/] 1s, F5 dump, F9 resume)",
+               -(double)(tt_last_tick(&tt)-scrub_tick)/SIM_HZ);
+      batch_text(&text, &glyphs, buf, ox, oy-34, (SDL_Color){120,200,255,255});
+      if(scrub_msg[0]) batch_text(&text, &glyphs, scrub_msg, ox, oy + ROWS*TILE + 76, (SDL_Color){120,200,255,255});
+    }
+    batch_flush(&text, ren, &glyphs.a);
+
+    SDL_RenderPresent(ren);
+  }
+
+  if(!g->game_over){ sdb_end_game(&statedb,g); record_finish(&rec, record_dir, g); }
+  sdb_close(&statedb);
+  free(rec.buf); free(replay_buf);
+  if(telemetry_th){ atomic_store(&telemetry.stop, true); SDL_WaitThread(telemetry_th, NULL); }
 
+  pads_stop(&pads);
+  if(bot.mcts) mcts_close(&mcts);
+  roy_client_close(&royale);
+  if(lbv.fd>=0) close(lbv.fd);
+  if(metrics_th){ atomic_store(&metrics.stop, true); SDL_WaitThread(metrics_th, NULL); }
+  if(spectate_th){ atomic_store(&spectate.stop, true); SDL_WaitThread(spectate_th, NULL); }
+  audio_close(&audio);
+  bloom_close(&bloom);
+  free(batch.v); free(batch.idx);
+  atlas_job_cancel(&atlas_job);
+  if(atlas.tex) SDL_DestroyTexture(atlas.tex);
   if(emoji_font) TTF_CloseFont(emoji_font);
-  if(ui_font) TTF_CloseFont(ui_font);
+  if(glyphs.a.tex) SDL_DestroyTexture(glyphs.a.tex);
+  free(text.v); free(text.idx);
   SDL_DestroyRenderer(ren); SDL_DestroyWindow(win);
   TTF_Quit(); SDL_Quit();
   return 0;